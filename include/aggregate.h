@@ -0,0 +1,38 @@
+#ifndef __AGGREGATE_H
+#define __AGGREGATE_H
+
+// Aggregates over the account balances, kept up to date on every
+// change so that the TOPK and RANGESUM commands need no scan. Range
+// sums come from a Fenwick tree of 64-bit partial sums, and the
+// richest accounts from a tournament tree that holds, for every node,
+// the account with the largest balance below it. A change costs
+// O(log n) in each; a range sum is O(log n) and the top k accounts
+// O(k log n log k).
+
+// `aggregate_open` builds the aggregates over the `account_cnt`
+// balances in `balances`, which they read from then on, finding each
+// account in the slot `relabel_slot` gives (see relabel.h). It returns
+// -1 if out of memory.
+int aggregate_open(const int *balances, int account_cnt);
+
+// `aggregate_close` frees the aggregates.
+void aggregate_close();
+
+// `aggregate_update` accounts for the balance of `acc` having changed
+// by `delta`. It must be called after the balance is stored.
+void aggregate_update(int acc, int delta);
+
+// `aggregate_rebuild` rebuilds the aggregates after changes made
+// without `aggregate_update`, in O(n).
+void aggregate_rebuild();
+
+// `aggregate_range_sum` returns the total balance of accounts `lo` to
+// `hi`, both included.
+long long aggregate_range_sum(int lo, int hi);
+
+// `aggregate_top` writes the (at most `k`) accounts with the largest
+// balances, largest first, to `accs`, and returns how many it wrote.
+// Ties go to the lower account number.
+int aggregate_top(int k, int *accs);
+
+#endif
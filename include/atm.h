@@ -10,4 +10,33 @@
 // atm_id       - the ID of the ATM to run
 int atm_run(const char *trace, int bank_out_fd, int atm_in_fd, int atm_id);
 
+// The `atm_use_replica` function makes later `atm_run` calls send
+// BALANCE commands to a read replica (see replica.h) over `out_fd` and
+// read its replies from `in_fd`, instead of asking the bank.
+void atm_use_replica(int out_fd, int in_fd);
+
+// The `atm_connect` function connects to a bank server (see
+// `run_bank_server`) listening on the Unix-domain socket `path`. The
+// returned descriptor is used as both `bank_out_fd` and `atm_in_fd`
+// of `atm_run`. It returns -1 if the bank could not be reached.
+int atm_connect(const char *path);
+
+// The `atm_run_many` function runs `atm_cnt` logical ATMs, with ids
+// starting at `first_atm`, in a single process. Each logical ATM
+// replays its commands of the trace like `atm_run`, but all of them
+// share one pair of descriptors and are driven by one event loop, so
+// the cost of an ATM is a small state machine rather than a process.
+// The bank tells the replies apart by the ATM id they carry.
+int atm_run_many(const char *trace, int bank_out_fd, int atm_in_fd,
+                 int first_atm, int atm_cnt);
+
+// The `atm_open_loop` function makes later `atm_run_many` calls replay
+// the trace open-loop: every logical ATM sends its commands at the
+// times given by its own arrival schedule of `kind` (see schedule.h),
+// `rate` commands per second on average, without waiting for earlier
+// replies. The latency of each reply is measured from the time its
+// command was scheduled and recorded with `stats_latency`. A `rate` of
+// 0 restores the default closed-loop replay.
+void atm_open_loop(int kind, double rate);
+
 #endif
@@ -32,4 +32,36 @@ void bank_dump();
 
 int run_bank(int bank_in_fd[], int atm_out_fd[]);
 
+// The `run_bank_channels` function is `run_bank` for ATM processes
+// that each drive several logical ATMs over one pipe pair. The bank
+// reads commands from the `chan_cnt` descriptors in `bank_in_fd`, and
+// `atm_out_fd` still has atm_cnt elements, one per ATM id, so ATMs
+// sharing a process share the same descriptor.
+//
+// If BANKSIM_IDLE_MS is set and every ATM has its own channel, an ATM
+// that sends nothing for that many milliseconds is sent a TIMEOUT and
+// dropped as if it had exited. This needs the poll backend.
+
+int run_bank_channels(int chan_cnt, int bank_in_fd[], int atm_out_fd[]);
+
+// The `run_bank_server` function runs the bank as a long-lived daemon
+// instead of over inherited pipes. It listens on a Unix-domain
+// SOCK_SEQPACKET socket at `path`, so every record is exactly one
+// command, and accepts ATM connections at any time. A connection is
+// bound to an ATM id by its CONNECT command; at most atm_cnt ATMs (as
+// given to `bank_open`) may be connected at once. With BANKSIM_IDLE_MS
+// set, a connection idle that long is sent a TIMEOUT and closed. The
+// bank keeps serving until it receives SIGINT or SIGTERM.
+
+int run_bank_server(const char *path);
+
+// These are used just for benchmarking. `bench_poll_open` sets up the
+// bank's poll loop over `chan_cnt` descriptors, `bench_find_ready_atm`
+// returns the next one with input, as the bank loop would pick it,
+// and `bench_poll_close` releases the poll set again.
+
+void bench_poll_open(int chan_cnt, int bank_in_fd[]);
+int bench_find_ready_atm();
+void bench_poll_close();
+
 #endif
@@ -0,0 +1,82 @@
+#ifndef __CHANGELOG_H
+#define __CHANGELOG_H
+
+// The change log is an ordered stream of the bank's balance changes,
+// (sequence, account, new balance), in a ring in a shared memory
+// segment. The bank appends a change for every balance it changes and
+// publishes the changes appended so far in batches: every
+// CHANGELOG_BATCH changes and whenever it is about to wait for more
+// commands. Read replicas (see replica.h) apply the published changes
+// to their own copies of the balances. Sequence numbers start at 1 and
+// count every change the bank has made.
+//
+// The bank never overwrites a change a replica has not applied yet: if
+// the ring is full it waits for the slowest replica, so replicas must
+// keep applying changes even while they have nothing to answer. A
+// replica that has closed the log, or could not open it, is retired
+// and no longer waited for.
+
+// The segment the change log lives in.
+#define CHANGELOG_SEGMENT "/banksim-changes"
+
+// Identifies a change log segment and its layout.
+#define CHANGELOG_MAGIC 0xc4a9e101
+
+// Changes appended before they are published.
+#define CHANGELOG_BATCH 64
+
+// The changes the ring holds, unless BANKSIM_REPLICA_LOG says
+// otherwise, and the most replicas a log can feed.
+#define CHANGELOG_DEFAULT_CAP (1 << 20)
+#define CHANGELOG_MAX_READERS 64
+
+typedef struct change {
+  long long seq;
+  int account;
+  int balance;
+} Change;
+
+// `changelog_create` creates the segment `name` for `account_cnt`
+// accounts and `reader_cnt` replicas, with room for `capacity` changes
+// (rounded up to a power of two), replacing one left over by an
+// earlier run. It returns -1 if the segment could not be created.
+int changelog_create(const char *name, int account_cnt, int reader_cnt,
+                     int capacity);
+
+// `changelog_capacity` returns the capacity BANKSIM_REPLICA_LOG asks
+// for, or CHANGELOG_DEFAULT_CAP.
+int changelog_capacity();
+
+// `changelog_open` maps the segment `name`, read-write for the bank or
+// for reading by replica `reader`. It returns -1 if there is no such
+// segment or the reader is out of range.
+int changelog_open(const char *name, int writable, int reader);
+
+// `changelog_close` unmaps the log, retiring the calling replica, and
+// `changelog_unlink` removes the segment once no process needs to open
+// it any more.
+void changelog_close();
+void changelog_unlink(const char *name);
+
+// `changelog_retire` retires replica `reader` of the segment `name`
+// without opening the log, for a replica that could not open it.
+void changelog_retire(const char *name, int reader);
+
+// `changelog_append` adds the change of `account` to `balance`, and
+// `changelog_publish` makes the changes appended so far visible to the
+// replicas. They do nothing unless the log is open for writing.
+void changelog_append(int account, int balance);
+void changelog_publish();
+
+// `changelog_apply` applies every published change the calling replica
+// has not applied yet to `balances`. It returns the number of changes
+// applied.
+int changelog_apply(int *balances);
+
+// `changelog_applied` returns the sequence number of the last change
+// the calling replica applied, and `changelog_written` that of the last
+// change the bank made, published or not.
+long long changelog_applied();
+long long changelog_written();
+
+#endif
@@ -34,6 +34,101 @@ typedef struct command {
 #define NOFUNDS 7
 #define ATMUNKN 8
 #define ACCUNKN 9
+#define BATCH 10
+#define EOD 11
+#define LIMIT 12
+#define STATEMENT 13
+#define TOPK 14
+#define RANGESUM 15
+#define TIMEOUT 16
+
+// The number of command types.
+#define CMD_COUNT 17
+
+// A BATCH command carries a list of DEPOSIT, WITHDRAW and TRANSFER
+// "legs" that the bank applies in one pass. The BATCH message has the
+// number of legs in its from field and the mode in its to field, and
+// it is followed by one command message per leg. In BATCH_ATOMIC mode
+// either all legs are applied or none; in BATCH_BEST_EFFORT mode each
+// leg that can be applied is.
+//
+// The reply is an OK (or, for a failed atomic batch, the NOFUNDS,
+// ACCUNKN or LIMIT of the first failing leg, whose index is in amt)
+// with the number of applied legs in its to field. It is followed by
+// BATCH_FRAMES(legs) messages holding a bitmap of the applied legs, 32
+// legs in each of their from, to and amt fields, lowest bit first.
+#define BATCH_BEST_EFFORT 0
+#define BATCH_ATOMIC 1
+#define BATCH_MAX_LEGS 4096
+#define BATCH_LEGS_PER_FRAME 96
+#define BATCH_FRAMES(legs) \
+  (((legs) + BATCH_LEGS_PER_FRAME - 1) / BATCH_LEGS_PER_FRAME)
+
+// A LIMIT reply refuses a WITHDRAW or TRANSFER (or a batch leg) that
+// would take the from account over its velocity limits (see
+// velocity.h). It has the from account and the amount, like NOFUNDS.
+
+// The most messages that can follow a reply.
+#define CMD_MAX_REPLY_FRAMES 256
+
+// A TIMEOUT reply tells an ATM that the bank has dropped it for
+// sending nothing for too long (see BANKSIM_IDLE_MS in bank.h). It
+// carries the ATM id.
+
+// A STATEMENT command asks for the last entries of the history of the
+// from account, at most amt of them (and no more than
+// STATEMENT_MAX_ENTRIES). The reply is an OK with the account in its
+// from field, the number of entries in its to field and the balance
+// in amt, followed by one message per entry, newest first: the
+// DEPOSIT, WITHDRAW or TRANSFER that made it, with the sequence number
+// of the transaction as its id.
+#define STATEMENT_MAX_ENTRIES CMD_MAX_REPLY_FRAMES
+
+// A TOPK command asks for the amt accounts (at most TOPK_MAX) with the
+// largest balances. The reply is an OK with the number of accounts in
+// its to field, followed by one OK message per account, largest
+// first, with its rank as the id, the account in from and the balance
+// in amt.
+//
+// A RANGESUM command asks for the total balance of the accounts from
+// its from field to its to field, both included. The reply is an OK
+// whose from and to fields hold the high and low 32 bits of the
+// 64-bit total and whose amt holds the number of accounts summed, or
+// an ACCUNKN if the range is not one of accounts.
+#define TOPK_MAX CMD_MAX_REPLY_FRAMES
+
+// An EOD command has the bank run its end-of-day job over all
+// accounts before it takes the next command (see eod.h). It is placed
+// in a trace where a day ends. The reply is an OK with the number of
+// accounts swept in its to field.
+
+// The protocol versions. Version 1, the default, is the fixed 17-byte
+// format above. An ATM asks for version 2, the compact format, with
+// PROTOCOL_V2 in the amt field of its CONNECT (the fixed format has -1
+// there). The bank answers with an OK, still in the fixed format,
+// whose amt is the version it will speak; if that is PROTOCOL_V2 both
+// ends switch to it on that connection for everything after the OK.
+//
+// A compact message is an opcode byte followed by varint fields:
+//
+//   opcode  bits 0-4 the command type; bits 5, 6 and 7 tell whether
+//           from, to and amt follow
+//   id      unsigned LEB128
+//   from    zigzag LEB128, if present
+//   to      zigzag LEB128, if present
+//   amt     zigzag LEB128, if present
+//
+// Fields of -1, the value unused fields are padded with, are left out
+// and read back as -1. On a compact connection the bank also leaves
+// out the fields that only echo the request, so a reply that carries
+// nothing but a status is two bytes for ids below 128. Frames that
+// follow a message are compact messages too.
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+
+// The room a compact message needs to be encoded in: the longest one
+// is 21 bytes, and the encoder stores whole words past its end.
+#define CMD_WIRE_MAX 24
 
 // Macros for constructing command messages. You should use these
 // macros to construct command messages in your ATM and bank
@@ -51,10 +146,24 @@ typedef struct command {
 #define MSG_BALANCE(cmd, id, f) cmd_pack((cmd), BALANCE, (id), (f), -1, -1)
 #define MSG_ATMUNKN(cmd, id) cmd_pack((cmd), ATMUNKN, (id), -1, -1, -1)
 #define MSG_ACCUNKN(cmd, id, t) cmd_pack((cmd), ACCUNKN, (id), -1, (t), -1)
+// (MSG_BATCH itself is taken by <sys/socket.h>.)
+#define MSG_BATCH_HDR(cmd, id, legs, mode) \
+  cmd_pack((cmd), BATCH, (id), (legs), (mode), -1)
+#define MSG_EOD(cmd, id) cmd_pack((cmd), EOD, (id), -1, -1, -1)
+#define MSG_LIMIT(cmd, id, f, a) cmd_pack((cmd), LIMIT, (id), (f), -1, (a))
+#define MSG_TIMEOUT(cmd, id) cmd_pack((cmd), TIMEOUT, (id), -1, -1, -1)
+#define MSG_STATEMENT(cmd, id, f, n) \
+  cmd_pack((cmd), STATEMENT, (id), (f), -1, (n))
+#define MSG_TOPK(cmd, id, k) cmd_pack((cmd), TOPK, (id), -1, -1, (k))
+#define MSG_RANGESUM(cmd, id, lo, hi) \
+  cmd_pack((cmd), RANGESUM, (id), (lo), (hi), -1)
 
 // A cmd_t type represents the command byte in the command message.
 typedef unsigned char cmd_t;
 
+// `cmd_strings` holds the name of each command type, indexed by it.
+extern const char *cmd_strings[];
+
 // `cmd_pack` is used to "pack" each part of a command into the
 // provided command buffer. The parameters are:
 //
@@ -77,6 +186,28 @@ void cmd_pack(Command *cmd, cmd_t c, int id, int from, int to, int amt);
 // amt    - the amount of the transaction (if any)
 void cmd_unpack(Command *cmd, cmd_t *c, int *id, int *from, int *to, int *amt);
 
+// `cmd_encode` writes `cmd` in the compact format to `out`, which has
+// room for CMD_WIRE_MAX bytes, and returns the number of bytes written,
+// or 0 if the command type does not fit in an opcode.
+int cmd_encode(Command *cmd, byte *out);
+
+// `cmd_decode` reads a compact message from the `len` bytes at `in`
+// into `cmd`. It returns the number of bytes it took, 0 if the message
+// is not all there yet, or -1 if it is malformed.
+int cmd_decode(const byte *in, int len, Command *cmd);
+
+// `cmd_is_request` tells whether `c` is a command an ATM may send.
+int cmd_is_request(cmd_t c);
+
+// `cmd_tail_frames` returns the number of command messages that
+// follow the request `cmd` on the wire (the legs of a BATCH), 0 for
+// single-message requests, or -1 if the request is malformed.
+int cmd_tail_frames(Command *cmd);
+
+// `cmd_reply_frames` returns the number of command messages that
+// follow the reply header `reply` to the request `req`.
+int cmd_reply_frames(Command *req, Command *reply);
+
 // `cmd_dump` will dump the command parts to standard output. The
 // `msg` and `id` are included in the output. This function will dump
 // the command only if the `BANKSIM_DEBUG` environment variable has
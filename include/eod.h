@@ -0,0 +1,54 @@
+#ifndef __EOD_H
+#define __EOD_H
+
+// The end-of-day job. When the bank receives an EOD command it stops
+// taking commands and sweeps every account once: balances of at least
+// the minimum balance earn interest, and balances below it pay a fee
+// (never more than they hold). The sweep is split over several threads
+// and its loop is kept free of branches so that the compiler can
+// vectorize it; the interest is exact, rounded down, and the results
+// are clamped to the range of a balance. The bank then resumes serving.
+//
+// The rules come from the `BANKSIM_EOD` environment variable, as
+// `interest_bp,fee,min_balance` (interest in basis points, that is
+// hundredths of a percent), and the number of threads from
+// `BANKSIM_EOD_THREADS`, which defaults to the number of CPUs.
+
+// The rules used when `BANKSIM_EOD` is not set.
+#define EOD_INTEREST_BP 1
+#define EOD_FEE 5
+#define EOD_MIN_BALANCE 100
+
+// Interest rates are below 100%, so the interest on a balance can be
+// worked out in 32 bits.
+#define EOD_MAX_INTEREST_BP 9999
+
+typedef struct eod_rules {
+  int interest_bp;
+  int fee;
+  int min_balance;
+} EodRules;
+
+// What a sweep did.
+typedef struct eod_totals {
+  int accounts;
+  int threads;
+  long long interest; // money paid out as interest
+  long long fees;     // money taken as fees
+  double secs;
+} EodTotals;
+
+// `eod_rules` fills `rules` from the environment. It returns -1 if
+// `BANKSIM_EOD` is malformed, in which case the defaults are used.
+int eod_rules(EodRules *rules);
+
+// `eod_threads` returns the number of threads a sweep should use.
+int eod_threads();
+
+// `eod_sweep` applies `rules` to the `account_cnt` balances in
+// `accounts` using up to `threads` threads, and reports what it did in
+// `totals`.
+void eod_sweep(int *accounts, int account_cnt, const EodRules *rules,
+               int threads, EodTotals *totals);
+
+#endif
@@ -15,6 +15,9 @@
 #define ERR_BAD_TRACE_FILE 7
 #define ERR_NOFUNDS 8
 #define ERR_ATM_CLOSED 9
+#define ERR_SOCKET_ERR 10
+#define ERR_LIMIT 11
+#define ERR_TIMEOUT 12
 
 // This function is used to record an error and an associated message. It is
 // called by the "bank" and "atm" code to indicate any unexpected errors.
@@ -0,0 +1,70 @@
+#ifndef __FAIR_H
+#define __FAIR_H
+
+#include "command.h"
+
+// Fair scheduling of the commands the bank serves. With `BANKSIM_FAIR`
+// set, the bank loop reads every command that has arrived into a queue
+// per ATM and serves them in the order this scheduler picks, instead of
+// one command per ready ATM in turn:
+//
+// - Every command type has a priority class; by default CONNECT and
+//   EXIT are class 0, the commands that move money class 1, and
+//   queries and EOD class 2. A lower class is always served first.
+//   `BANKSIM_CLASSES=TRANSFER:0,BALANCE:2,...` moves types between
+//   classes.
+// - An ATM's commands are served in the order it sent them, so the
+//   class of an ATM is that of the command at the head of its queue.
+// - Within a class, ATMs take turns by deficit round-robin: a turn
+//   adds `quantum` times the ATM's weight to its deficit, and the ATM
+//   is served while its deficit covers the cost of its next command,
+//   1 for a command and 1 more for each leg of a batch.
+//   `BANKSIM_FAIR=quantum` sets the quantum and `BANKSIM_WEIGHTS=w0,
+//   w1,...` the weights of ATMs 0, 1, ..., 1 for those not listed.
+// - `BANKSIM_RATE=rate,burst[,atm...]` gives the listed ATMs, or every
+//   ATM, a token bucket of `burst` cost units refilled at `rate` units
+//   a second. An ATM out of tokens waits in its queue; other ATMs and
+//   lower classes go ahead of it.
+//
+// The time each command spent queued is kept per class, and
+// `fair_print` reports it when the bank stops.
+
+#define FAIR_CLASSES 3
+
+// `fair_open` sets up the queues of `atm_cnt` ATMs from the
+// environment. It returns 1 if fair scheduling is on, 0 if it was not
+// asked for, or -1 if a setting is malformed or there is no memory, in
+// which case it is off.
+int fair_open(int atm_cnt);
+
+// `fair_close` drops the queues and anything still in them.
+void fair_close();
+
+// `fair_class` returns the class of command type `c`.
+int fair_class(cmd_t c);
+
+// `fair_push` queues a copy of the command in `cmds` and its `frames`
+// frames for ATM `atm`. It returns -1 if out of memory.
+int fair_push(int atm, Command *cmds, int frames);
+
+// `fair_queued` returns the number of commands queued, and
+// `fair_waiting` the number queued for ATM `atm`.
+int fair_queued();
+int fair_waiting(int atm);
+
+// `fair_wait_ms` returns how long the bank may wait for more commands
+// before one of the queued ones can be served: 0 if one can be served
+// now, or -1 if nothing is queued.
+long fair_wait_ms();
+
+// `fair_pop` takes the next command to serve off its queue and returns
+// it, followed by its frames, setting `atm` to the ATM it came from, or
+// returns NULL if none can be served now. The command stays valid until
+// the next call.
+Command *fair_pop(int *atm);
+
+// `fair_print` prints, per class, the commands served and the time
+// they spent queued.
+void fair_print();
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include "command.h"
+
+// The bank's record of the transactions applied to each account, for
+// STATEMENT queries. Entries are 12 bytes and live in fixed-size
+// blocks taken from one growing arena; the blocks of an account are
+// chained by arena index, so appending is O(1) and a statement reads
+// only the blocks holding the entries it returns. Once an account holds its
+// retention cap of entries, its oldest block is reused for the newest
+// ones, so memory stays bounded by the cap.
+//
+// The cap is the `BANKSIM_HISTORY` environment variable, in entries
+// per account; 0 turns history off.
+
+// The entries kept per account unless `BANKSIM_HISTORY` says otherwise.
+#define HISTORY_DEFAULT_CAP 100
+
+// The entries in one block.
+#define HISTORY_BLOCK_ENTRIES 20
+
+// `history_cap` returns the retention cap from the environment, or -1
+// if `BANKSIM_HISTORY` is malformed.
+int history_cap();
+
+// `history_open` keeps the last `cap` entries for each of
+// `account_cnt` accounts; memory is held in whole blocks, but no more
+// than `cap` entries are ever returned. It returns -1 if out of memory.
+int history_open(int account_cnt, int cap);
+
+// `history_close` frees the history.
+void history_close();
+
+// `history_add` records that `amt` moved into (DEPOSIT) or out of
+// (WITHDRAW) account `acc`, or, for a TRANSFER, between `from` and
+// `to`, recording it on both accounts.
+void history_add(cmd_t c, int from, int to, int amt);
+
+// `history_last` writes the last (at most `n`, and no more than the
+// cap) entries of account `acc`, newest first, to `out` as the
+// commands that made them, each with its sequence number as the id. It
+// returns how many it wrote.
+int history_last(int acc, int n, Command *out);
+
+// `history_usage` reports the entries held and the bytes used for
+// them, including blocks kept for reuse and the per-account heads.
+void history_usage(long *entries, long *bytes);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __IO_H
+#define __IO_H
+
+// Reading and writing whole messages over pipes and sockets.
+
+// The number of read/write system calls made by `checked_read`,
+// `checked_write` and the wire functions (see wire.h), used to report
+// system calls per transaction, and the number of bytes they moved.
+extern unsigned long io_syscalls;
+extern unsigned long io_bytes;
+
+// `checked_write` writes all `n` bytes of `data` to `fd`, handling
+// partial writes. It returns SUCCESS, or ERR_PIPE_WRITE_ERR if there
+// was an error.
+int checked_write(int fd, void *data, int n);
+
+// `checked_read` reads exactly `n` bytes from `fd` into `data`,
+// handling partial reads. It returns SUCCESS, ERR_ATM_CLOSED if the
+// other end was closed, or ERR_PIPE_READ_ERR if there was an error.
+int checked_read(int fd, void *data, int n);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef __LEDGER_H
+#define __LEDGER_H
+
+// The ledger is the bank's account array placed in a shared memory
+// segment, so that ATMs can map it read-only and answer BALANCE
+// without a round trip to the bank. The bank is the only writer; every
+// change to a balance is bracketed by `ledger_write_begin` and
+// `ledger_write_end`, which bump the sequence number of the account's
+// stripe. A reader retries until it sees the same even sequence number
+// before and after reading, so it never returns a half-made change.
+//
+// The ledger is used when the `BANKSIM_LOCAL_BALANCE` environment
+// variable is set.
+
+// The segment the ledger lives in.
+#define LEDGER_SEGMENT "/banksim-accounts"
+
+// Identifies a ledger segment and its layout.
+#define LEDGER_MAGIC 0x1ed6e401
+
+// Accounts share LEDGER_STRIPES sequence numbers, account a using
+// stripe a % LEDGER_STRIPES, each on its own cache line.
+#define LEDGER_STRIPES 64
+
+// `ledger_create` creates the segment `name` for `account_cnt`
+// accounts, replacing one left over by an earlier run. It must be
+// called before the bank and the ATMs open it. It returns -1 if the
+// segment could not be created.
+int ledger_create(const char *name, int account_cnt);
+
+// `ledger_open` maps the segment `name`, read-write for the bank or
+// read-only for an ATM. It returns -1 if there is no such segment.
+int ledger_open(const char *name, int writable);
+
+// `ledger_close` unmaps the ledger, and `ledger_unlink` removes the
+// segment once no process needs to open it any more.
+void ledger_close();
+void ledger_unlink(const char *name);
+
+// `ledger_balances` returns the balances of a ledger opened
+// read-write, for the bank to use as its accounts, or NULL.
+int *ledger_balances();
+
+// `ledger_ready` tells readers the bank has set up the balances.
+void ledger_ready();
+
+// `ledger_write_begin` and `ledger_write_end` bracket a change to the
+// balance of account `acc`. They do nothing if no ledger is open.
+void ledger_write_begin(int acc);
+void ledger_write_end(int acc);
+
+// `ledger_write_all_begin` and `ledger_write_all_end` bracket a change
+// to any number of balances, such as the end-of-day sweep. Readers
+// wait until it is over.
+void ledger_write_all_begin();
+void ledger_write_all_end();
+
+// `ledger_read` reads the balance of account `acc` into `balance`. It
+// returns 1 on success, 0 if there is no such account, and -1 if no
+// ledger is open or the bank has not set it up yet, in which case the
+// bank must be asked.
+int ledger_read(int acc, int *balance);
+
+#endif
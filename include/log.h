@@ -0,0 +1,22 @@
+#ifndef __LOG_H
+#define __LOG_H
+
+// A buffered, asynchronous logger for per-event messages such as
+// "not enough funds". Messages are only produced when the
+// `BANKSIM_VERBOSE` environment variable is set; otherwise `log_printf`
+// returns immediately. Messages are appended to an in-memory buffer
+// and written to standard output by a background thread, so processes
+// sharing standard output do not contend on it for every event.
+
+// `log_open` starts the logger of the calling process. Since threads
+// do not survive `fork`, it must be called in each child process.
+void log_open();
+
+// `log_close` writes out anything still buffered and stops the
+// logger. It must be called before the process exits.
+void log_close();
+
+// `log_printf` logs one message in `printf` format.
+void log_printf(const char *fmt, ...);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef __PAGES_H
+#define __PAGES_H
+
+// Where the balance array lives. By default it is malloced, but at
+// hundreds of millions of accounts that means a slow start, a TLB miss
+// on most random accesses and, on a NUMA machine, every balance on one
+// node. `BANKSIM_PAGES` picks the pages instead:
+//
+//   malloc  the default
+//   small   an anonymous mapping of 4K pages
+//   thp     an anonymous mapping on a 2 MB boundary, advised to use
+//           transparent huge pages
+//   huge    2 MB pages from the reserved hugetlb pool, or thp if the
+//           pool cannot hold the array
+//
+// and `BANKSIM_NUMA` where they go:
+//
+//   first-touch  the default: on the node of the thread zeroing them
+//   interleave   round robin over the nodes with memory
+//   local        bound to the nodes of the CPUs the bank may run on
+//
+// Either way the array is zeroed by several threads, as many as the
+// end-of-day sweep uses and split the way it splits the array, so the
+// pages are faulted in in parallel and, with first-touch, each part
+// lands on the node of a thread that sweeps it.
+
+#define PAGES_MALLOC 0
+#define PAGES_SMALL 1
+#define PAGES_THP 2
+#define PAGES_HUGE 3
+
+#define NUMA_FIRST_TOUCH 0
+#define NUMA_INTERLEAVE 1
+#define NUMA_LOCAL 2
+
+typedef struct page_plan {
+  int pages;
+  int numa;
+  int threads; // zeroing threads
+} PagePlan;
+
+// What an allocation got.
+typedef struct page_report {
+  int pages;                // the pages used, which may fall back
+  int numa;                 // the placement used
+  int nodes;                // the nodes a placement spans; 0 for
+                            // first-touch or if it could not be set
+  int threads;              // the threads that zeroed the array
+  unsigned long bytes;      // the size of the array
+  unsigned long huge_bytes; // how much of it is on huge pages
+  double secs;              // the time allocating and zeroing took
+} PageReport;
+
+// `pages_plan` fills `plan` from the environment, with one zeroing
+// thread. It returns -1 if `BANKSIM_PAGES` or `BANKSIM_NUMA` is
+// malformed, in which case that one keeps its default.
+int pages_plan(PagePlan *plan);
+
+// `pages_alloc` allocates `bytes` of zeroed memory as `plan` says and
+// reports how in `report`. It returns NULL if out of memory.
+void *pages_alloc(unsigned long bytes, const PagePlan *plan,
+                  PageReport *report);
+
+// `pages_free` frees memory from `pages_alloc`, given its report.
+void pages_free(void *p, const PageReport *report);
+
+// `pages_name` and `numa_name` name a kind of pages and a placement.
+const char *pages_name(int pages);
+const char *numa_name(int numa);
+
+#endif
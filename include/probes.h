@@ -0,0 +1,83 @@
+#ifndef __PROBES_H
+#define __PROBES_H
+
+// Static tracepoints (USDT probes) in the SystemTap format that perf,
+// bpftrace and SystemTap understand, without needing <sys/sdt.h>. A
+// probe compiles to a single nop at the probe site plus a note in the
+// .note.stapsdt section that tells a tracer where the nop is and where
+// to find the arguments, so it costs nothing until a tracer attaches
+// and turns the nop into a breakpoint. Every argument is passed as a
+// signed 64-bit value.
+//
+//   $ bpftrace -l 'usdt:./banksim:*'
+//   $ bpftrace scripts/bank_latency.bt
+//
+// The probes of the provider `banksim`:
+//
+//   receive(channel, cmd)           the bank has read a whole command
+//   dispatch(atm, cmd, from, to, amt)  the bank starts handling it
+//   apply(account, delta, balance)  a balance has changed
+//   reply(atm, cmd, reply, status)  the bank has answered it
+//   wakeup(ready)                   the bank's poll found fds ready
+//   trace_read(commands)            commands were read from a trace
+//   atm_send(atm, cmd)              an ATM sent a command
+//   atm_reply(atm, cmd, reply)      an ATM got the reply to it
+//
+// Building with -DBANKSIM_NO_PROBES leaves them out altogether.
+
+#if !defined(BANKSIM_NO_PROBES) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+
+#define PROBE_ARG(x) "nor"((long long)(x))
+
+#define PROBE_NOTE(name, args, ...)                                      \
+  __asm__ __volatile__(                                                  \
+      "990: nop\n"                                                       \
+      ".pushsection .note.stapsdt,\"?\",\"note\"\n"                      \
+      ".balign 4\n"                                                      \
+      ".4byte 992f-991f, 994f-993f, 3\n"                                 \
+      "991: .asciz \"stapsdt\"\n"                                        \
+      "992: .balign 4\n"                                                 \
+      "993: .8byte 990b\n"                                               \
+      ".8byte _.stapsdt.base\n"                                          \
+      ".8byte 0\n"                                                       \
+      ".asciz \"banksim\"\n"                                             \
+      ".asciz \"" #name "\"\n"                                           \
+      ".asciz \"" args "\"\n"                                            \
+      "994: .balign 4\n"                                                 \
+      ".popsection\n"                                                    \
+      ".ifndef _.stapsdt.base\n"                                         \
+      ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,"    \
+      "comdat\n"                                                         \
+      ".weak _.stapsdt.base\n"                                           \
+      ".hidden _.stapsdt.base\n"                                         \
+      "_.stapsdt.base: .space 1\n"                                       \
+      ".size _.stapsdt.base, 1\n"                                        \
+      ".popsection\n"                                                    \
+      ".endif\n" ::__VA_ARGS__)
+
+#define PROBE1(name, a) PROBE_NOTE(name, "-8@%0", PROBE_ARG(a))
+#define PROBE2(name, a, b) \
+  PROBE_NOTE(name, "-8@%0 -8@%1", PROBE_ARG(a), PROBE_ARG(b))
+#define PROBE3(name, a, b, c)                                  \
+  PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2", PROBE_ARG(a), PROBE_ARG(b), \
+             PROBE_ARG(c))
+#define PROBE4(name, a, b, c, d)                                        \
+  PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3", PROBE_ARG(a), PROBE_ARG(b), \
+             PROBE_ARG(c), PROBE_ARG(d))
+#define PROBE5(name, a, b, c, d, e)                                       \
+  PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3 -8@%4", PROBE_ARG(a),         \
+             PROBE_ARG(b), PROBE_ARG(c), PROBE_ARG(d), PROBE_ARG(e))
+
+#else
+
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#define PROBE5(name, a, b, c, d, e) \
+  ((void)(a), (void)(b), (void)(c), (void)(d), (void)(e))
+
+#endif
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __RELABEL_H
+#define __RELABEL_H
+
+// Hot/cold relabeling packs the most used accounts together at the
+// start of the balance array, so that under skewed load the balances
+// the bank keeps touching share a few cache lines and pages instead of
+// being scattered over the whole array.
+//
+// With `BANKSIM_RELABEL=n` the bank counts how often the first n
+// commands touch each account. It then swaps the up to RELABEL_MAX_HOT
+// most touched accounts into the first slots, busiest first, and the
+// accounts that held those slots into the slots they left. Only the
+// moved accounts are in the remap table, a small hash table, so
+// looking an account up stays in cache; every other account keeps its
+// slot. Account numbers do not change anywhere but in the balance
+// array: replies, history, aggregates, limits, the change log, dumps
+// and snapshots all use the original numbers.
+
+#define RELABEL_MAX_HOT 16384
+
+// `relabel_profile_len` returns the number of commands
+// `BANKSIM_RELABEL` asks to profile, 0 if it is not set, or -1 if it is
+// malformed.
+int relabel_profile_len();
+
+// `relabel_open` starts profiling the next `commands` commands to
+// `account_cnt` accounts. It returns -1 if out of memory.
+int relabel_open(int account_cnt, int commands);
+
+// `relabel_close` drops the profile and the remap table.
+void relabel_close();
+
+// `relabel_profiling` tells whether a profile is being taken.
+int relabel_profiling();
+
+// `relabel_count` counts a use of account `acc`, and `relabel_command`
+// counts a command; it returns 1 once the profile is complete.
+void relabel_count(int acc);
+int relabel_command();
+
+// `relabel_build` moves the hottest accounts of the profile to the
+// front of `balances` and builds the remap table. It returns the
+// number of accounts moved to the front, and sets `hot_share` to the
+// part of the profiled uses that went to them.
+int relabel_build(int *balances, double *hot_share);
+
+// `relabel_slot` returns the slot in the balance array of account
+// `acc`.
+int relabel_slot(int acc);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __RELAY_H
+#define __RELAY_H
+
+// A relay emulates a WAN link between the ATMs and the bank, so that
+// pipelining, batching and protocol changes can be tried against
+// realistic round trips on one box. With `BANKSIM_LINK` set, a relay
+// process sits in every ATM <-> bank pipe pair and holds each chunk of
+// bytes it reads back until the link would have delivered it:
+//
+//   BANKSIM_LINK=delay_ms[,jitter_ms[,mbit_per_s]]
+//
+// Each direction of each channel is a link of its own. A chunk first
+// waits for the link to finish sending the chunks before it, taking
+// 8 bits per byte at `mbit_per_s` (0 or none for no limit), then for the
+// one-way `delay_ms`, give or take up to `jitter_ms` drawn uniformly.
+// Like a TCP stream, a link never reorders: a chunk whose jitter would
+// have it overtake the one before arrives right after it. Closing one
+// end is delivered to the other end after the delay too.
+//
+// Deliveries are scheduled on a timer wheel (see timer.h) ticking in
+// microseconds, one timer per link for the chunk at its head. The relay
+// reads a link no further ahead than RELAY_QUEUE_MAX bytes, so a slow
+// reader pushes back on the writer as a pipe would.
+
+#define RELAY_QUEUE_MAX (1 << 20)
+
+// the largest chunk read from a link at once: a pipe's capacity
+#define RELAY_CHUNK (1 << 16)
+
+typedef struct relay_plan {
+  double delay_ms;
+  double jitter_ms;
+  double mbit_per_s; // 0 for no limit
+} RelayPlan;
+
+// `relay_plan` reads BANKSIM_LINK into `plan`. It returns 1 if a link
+// is asked for, 0 if not, or -1 if the setting is malformed.
+int relay_plan(RelayPlan *plan);
+
+// `relay_run` relays the `link_cnt` links over `plan`: what is read
+// from `in_fd[k]` is written to `out_fd[k]`, and `out_fd[k]` is closed
+// once `in_fd[k]` is. It returns when every link is closed, after
+// printing how much it relayed and how long the bytes were held, with a
+// status code from errors.h.
+int relay_run(const RelayPlan *plan, int link_cnt, int in_fd[], int out_fd[]);
+
+#endif
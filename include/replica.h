@@ -0,0 +1,35 @@
+#ifndef __REPLICA_H
+#define __REPLICA_H
+
+// A read replica answers the BALANCE commands of a subset of the ATMs
+// from its own copy of the balances, which it keeps up to date by
+// applying the bank's change log (see changelog.h), so reads no longer
+// compete with writes for the bank loop. A replica is behind the bank
+// by the changes not yet published or applied, so a balance it reports
+// may not reflect a change the same ATM made a moment ago. The `to`
+// field of its OK replies says which: it holds the sequence number of
+// the last change applied (its low 31 bits).
+//
+// Replicas are used when the `BANKSIM_REPLICAS` environment variable
+// asks for some; ATM i then sends its BALANCE commands to replica
+// i % BANKSIM_REPLICAS.
+
+// How long a replica with nothing to answer waits before applying the
+// changes published meanwhile, in ms.
+#define REPLICA_POLL_MS 1
+
+// `replica_count` returns the number of replicas BANKSIM_REPLICAS asks
+// for, at most CHANGELOG_MAX_READERS, or 0.
+int replica_count();
+
+// The `replica_run` function runs replica `id` over the change log,
+// which must already exist, for `account_cnt` accounts. It answers the
+// commands read from the `chan_cnt` descriptors in `in_fd`, writing
+// the reply to the matching descriptor of `out_fd`, until all of them
+// are closed, and then retires from the change log and prints how
+// many it answered, how fast, and how far behind the bank it was when
+// answering. It returns a status code
+// from errors.h.
+int replica_run(int id, int account_cnt, int chan_cnt, int in_fd[], int out_fd[]);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __SCHEDULE_H
+#define __SCHEDULE_H
+
+// Arrival schedules for open-loop replay. A schedule produces the times
+// at which an ATM is meant to send its next command, independent of
+// when the bank replies, so that queueing delay shows up in the
+// measured latency instead of slowing the senders down.
+
+#define SCHED_FIXED 0   // evenly spaced arrivals
+#define SCHED_POISSON 1 // exponentially distributed gaps
+#define SCHED_BURSTY 2  // bursts at ten times the rate, then silence
+
+// Arrivals per burst of a bursty schedule.
+#define SCHED_BURST_LEN 16
+
+typedef struct schedule {
+  int kind;
+  double gap; // mean ns between arrivals
+  double next; // ns from the start of the replay
+  unsigned long long rng;
+  int burst_left; // arrivals left in the current burst
+} Schedule;
+
+// `schedule_kind` returns the schedule named `name` ("fixed",
+// "poisson" or "bursty"), or -1 if there is no such schedule.
+int schedule_kind(const char *name);
+
+// `schedule_init` starts a schedule of `kind` with `rate` arrivals
+// per second on average. Schedules with the same `seed` produce the
+// same arrivals, so replays can be repeated.
+void schedule_init(Schedule *s, int kind, double rate, unsigned seed);
+
+// `schedule_next` returns the time of the next arrival in ns from the
+// start of the replay. Times never decrease.
+long schedule_next(Schedule *s);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+// Point-in-time images of the account balances, taken while the bank
+// keeps serving. The bank calls `snapshot_take` between two commands,
+// so the image is consistent, and only pauses for as long as it takes
+// to fork (the child then writes the copy-on-write image out) or, with
+// `BANKSIM_SNAPSHOT=copy` or accounts in the shared ledger, to copy the
+// balances for a background thread to write.
+//
+// An image is written to `banksim-<pid>-<n>.snap` in the format of
+// `bank_dump`, preceded by a comment line. One snapshot is written at
+// a time; a request made while one is being written is dropped.
+
+// `snapshot_take` snapshots the `account_cnt` balances in `accounts`.
+// `shared` tells that other processes may change them (so a fork would
+// not freeze them) and `commands` is how many commands the bank had
+// handled. It returns the number of the snapshot, or -1 if none was
+// taken.
+int snapshot_take(const int *accounts, int account_cnt, int shared,
+                  unsigned long commands);
+
+// `snapshot_finish` waits for the snapshot being written, if any.
+void snapshot_finish();
+
+#endif
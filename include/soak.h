@@ -0,0 +1,49 @@
+#ifndef __SOAK_H
+#define __SOAK_H
+
+#include "command.h"
+
+// A synthetic trace for soak tests. Instead of reading a trace file,
+// every ATM process generates the commands of its own ATMs in memory,
+// with the distributions `twriter` uses: each ATM connects, deposits
+// the starter cash of its share of the accounts, then sends random
+// WITHDRAW, TRANSFER and BALANCE commands until it has sent its share
+// of the commands or the time is up, and exits. Every ATM draws from
+// its own generator, seeded by the seed and its id, so its stream does
+// not depend on how the ATMs are spread over processes.
+//
+// A soak is named where a trace file would be, as
+//
+//   soak:<atm_cnt>,<account_cnt>,<commands>[,<secs>[,<seed>]]
+//
+// where <commands> is the total over all ATMs (0 for no limit) and
+// <secs> bounds the run (0, the default, for no limit).
+
+#define SOAK_PREFIX "soak:"
+#define SOAK_STARTER_CASH 5000
+#define SOAK_MAX_AMOUNT 200
+
+typedef struct soak_spec {
+  int atm_cnt;
+  int account_cnt;
+  long commands;
+  int secs;
+  unsigned seed;
+} SoakSpec;
+
+// `soak_parse` fills `spec` from a soak name. It returns 1 if `path`
+// names a soak, 0 if it does not, and -1 if it is malformed.
+int soak_parse(const char *path, SoakSpec *spec);
+
+// `soak_start` starts generating the commands of ATMs first to
+// first + count - 1 of `spec`.
+int soak_start(const SoakSpec *spec, int first, int count);
+
+// `soak_read` generates up to `n` commands into `cmds`. It returns the
+// number generated, or 0 once every ATM has exited.
+int soak_read(Command *cmds, int n);
+
+// `soak_stop` releases the generators.
+void soak_stop();
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include "command.h"
+
+// Outcome counters for the ATMs and the bank. Every ATM and the bank
+// count the commands they handle, by command type and outcome, into
+// their own slot of a region shared by all processes of a run. Nothing
+// is printed per command; `stats_print` merges the slots into one
+// summary table at shutdown.
+//
+// The region is a named POSIX shared memory segment, so it can also be
+// watched while the run is going on by `banksim-top`. Each counter has
+// a single writer and is updated with a relaxed atomic store, which
+// costs no more than a plain increment and never blocks the writer.
+
+// The segment used unless the `BANKSIM_STATS` environment variable
+// names another one.
+#define STATS_SEGMENT "/banksim-stats"
+
+// Identifies a stats segment and its layout.
+#define STATS_MAGIC 0xba5c0de5
+
+// The slot the bank counts into.
+#define STATS_BANK -1
+
+// The command types and outcomes counted.
+#define STATS_CMDS 32
+#define STATS_OK 0
+#define STATS_NOFUNDS 1
+#define STATS_ACCUNKN 2
+#define STATS_ATMUNKN 3
+#define STATS_ERROR 4
+#define STATS_LIMIT 5
+#define STATS_OUTCOMES 6
+
+// Commands drained per bank wake-up are kept in a histogram of
+// power-of-two buckets: 1, 2-3, 4-7, ...
+#define STATS_DRAIN_BUCKETS 16
+
+// Reply latencies of an open-loop replay are kept in a log-linear
+// histogram: bucket 0 holds everything under 1us, then every power of
+// two from 1us up is split into STATS_LAT_SUB buckets, so a bucket is
+// never wider than a quarter of its values.
+#define STATS_LAT_BUCKETS 128
+#define STATS_LAT_SUB 4
+
+// The counters of one ATM or of the bank.
+typedef struct stats_slot {
+  unsigned long count[STATS_CMDS][STATS_OUTCOMES];
+  unsigned long latency[STATS_LAT_BUCKETS];
+  unsigned long latency_max; // in ns
+  long long deposited;       // by DEPOSITs answered OK
+  long long withdrawn;       // by WITHDRAWs answered OK
+} StatsSlot;
+
+// A summary of the latencies recorded by all ATMs, in ns. Percentiles
+// are the upper bounds of the buckets they fall in.
+typedef struct stats_latency {
+  unsigned long count;
+  unsigned long p50;
+  unsigned long p90;
+  unsigned long p99;
+  unsigned long p999;
+  unsigned long max;
+} StatsLatency;
+
+// The start of the segment. It is followed by atm_cnt + 1 StatsSlots
+// (the bank first, then ATM i at 1 + i) and by atm_cnt counters of the
+// commands the bank served for each ATM.
+typedef struct stats_header {
+  unsigned magic;
+  int atm_cnt;
+  int running;               // cleared when the run is over
+  int active_atms;           // ATMs connected and not yet exited
+  unsigned long wakeups;     // times the bank loop woke up
+  unsigned long drained;     // commands handled over all wake-ups
+  unsigned long drain_hist[STATS_DRAIN_BUCKETS];
+  int held_known;            // set once the bank has closed
+  long long held;            // the sum of the balances when it did
+} StatsHeader;
+
+// `stats_open` creates the counters for `atm_cnt` ATMs and the bank in
+// the shared memory segment `name`, or in an anonymous shared mapping
+// if `name` is NULL. It must be called before the ATM and bank
+// processes are forked so that they all share it. It returns -1 if the
+// region could not be mapped, in which case counting is disabled.
+int stats_open(int atm_cnt, const char *name);
+
+// `stats_close` marks the run as over, unmaps the counters and removes
+// the segment. Only the process that called `stats_open` should call it.
+void stats_close();
+
+// `stats_count` counts one command of type `c` handled by ATM `who`
+// (or the bank, with STATS_BANK) whose reply had type `reply`.
+void stats_count(int who, cmd_t c, cmd_t reply);
+
+// `stats_served` counts a command the bank served for ATM `atm`.
+void stats_served(int atm);
+
+// `stats_wakeup` records that the bank loop woke up and handled
+// `drained` commands before waiting again.
+void stats_wakeup(int drained);
+
+// `stats_latency` records that a reply to ATM `atm` arrived `ns`
+// nanoseconds after its command was meant to be sent.
+void stats_latency(int atm, long ns);
+
+// `stats_latency_bucket` returns the histogram bucket of a latency of
+// `ns` nanoseconds, and `stats_latency_bound` the largest latency
+// counted in bucket `b`.
+int stats_latency_bucket(long ns);
+unsigned long stats_latency_bound(int b);
+
+// `stats_latency_summary` merges the latencies of all ATMs into `sum`.
+void stats_latency_summary(StatsLatency *sum);
+
+// `stats_money` counts money ATM `who` saw deposited and withdrawn.
+void stats_money(int who, long long deposited, long long withdrawn);
+
+// `stats_held` records the sum of the balances the bank closed with.
+// `stats_print` then checks it against the money the ATMs counted.
+void stats_held(long long total);
+
+// `stats_active` adds `delta` to the number of active ATMs.
+void stats_active(int delta);
+
+// `stats_print` prints the merged counters of all ATMs and of the bank
+// as one table to standard output.
+void stats_print();
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __STM_H
+#define __STM_H
+
+#include "command.h"
+
+// Speculative parallel execution of the legs of a batch, after
+// Block-STM. Every leg runs optimistically on one of several threads
+// against multi-version balances: a read of an account sees the value
+// written by the nearest earlier leg that touches it, or the balance
+// the batch started from. Each leg records the versions it read and is
+// validated once every earlier leg has run; a leg whose reads went
+// stale is aborted, its writes turn into estimates that make later
+// readers wait for it, and it runs again. When nothing is left to run
+// or validate, the outcome of every leg is the one applying the legs
+// one by one in order gives, including which of them hit NOFUNDS.
+//
+// The engine does not change the balances; it only works out the
+// outcomes, and the bank then commits the legs in order (see
+// `batch_manage` in bank.c). Velocity limits are stateful, so a bank
+// with limits set applies its batches serially.
+
+// Batches shorter than this are applied serially: waking the threads
+// costs more than the legs.
+#define STM_MIN_LEGS 64
+
+#define STM_MAX_THREADS 64
+
+// `stm_threads` returns the number of threads `BANKSIM_BATCH_THREADS`
+// asks for, by default 1, which applies batches serially: a leg is a
+// few adds, which one thread does faster than the bookkeeping costs
+// unless there are cores to spare (see `microbench stm`).
+int stm_threads();
+
+// `stm_open` starts `threads` - 1 worker threads; the thread that
+// calls `stm_run` is the last one. It returns -1 if no worker could be
+// started.
+int stm_open(int threads);
+
+// `stm_close` stops the workers.
+void stm_close();
+
+// `stm_run` works out the outcome of the `n` legs in `legs` against
+// the `account_cnt` balances in `balances`, found in the slots
+// `relabel_slot` gives (see relabel.h): OK, NOFUNDS or ACCUNKN,
+// as the legs would get applied one after another. It returns the
+// number of times legs were executed, which is `n` if no leg had to
+// run again, or -1 if the engine is not open.
+int stm_run(const Command *legs, int n, const int *balances, int account_cnt,
+            cmd_t *outcome);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __TIMER_H
+#define __TIMER_H
+
+// A hierarchical timer wheel, for idle and deadline tracking over many
+// connections. Time is counted in ticks (the bank and the ATMs use
+// milliseconds). Level 0 has a slot for each of the next
+// TIMER_SLOTS ticks, and each level above has slots TIMER_SLOTS times
+// as wide; a timer sits in the slot of the level its expiry falls in
+// and moves down a level each time the level below wraps around. Arming
+// and cancelling a timer is O(1), and advancing the wheel skips the
+// ticks with nothing due, costing O(TIMER_LEVELS) per tick it stops at
+// plus the timers it moves or expires.
+//
+// Timers are embedded in the caller's own structures and are never
+// allocated by the wheel.
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+typedef struct timer {
+  struct timer *next;
+  struct timer *prev; // NULL when the timer is not armed
+  unsigned long long expires;
+  short level;
+  short slot;
+  int id; // for the caller, to tell its timers apart
+} Timer;
+
+typedef struct timer_wheel {
+  unsigned long long now; // the last tick processed
+  int count;              // timers armed
+  unsigned long long occupied[TIMER_LEVELS]; // a bit per non-empty slot
+  Timer slots[TIMER_LEVELS][TIMER_SLOTS];    // list heads
+} TimerWheel;
+
+// `timer_wheel_init` empties the wheel and starts it at tick `now`.
+void timer_wheel_init(TimerWheel *w, unsigned long long now);
+
+// `timer_init` sets up a timer that is not armed.
+void timer_init(Timer *t, int id);
+
+// `timer_arm` (re)arms `t` to expire at tick `expires`; one that is
+// already due expires on the next tick.
+void timer_arm(TimerWheel *w, Timer *t, unsigned long long expires);
+
+// `timer_cancel` disarms `t` if it is armed.
+void timer_cancel(TimerWheel *w, Timer *t);
+
+// `timer_armed` tells whether `t` is armed.
+int timer_armed(const Timer *t);
+
+// `timer_advance` moves the wheel on to tick `now` and returns the
+// timers that expired on the way, chained by `next` and disarmed.
+Timer *timer_advance(TimerWheel *w, unsigned long long now);
+
+// `timer_wait` returns how many ticks can pass before a timer might
+// expire or move down a level, for use as a poll timeout, or -1 if
+// none is armed.
+long timer_wait(const TimerWheel *w);
+
+#endif
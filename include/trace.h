@@ -3,18 +3,30 @@
 
 #include "command.h"
 
-// `trace_open` opens a trace file for processing. It returns -1 if
-// there was a problem.
+// `trace_open` opens a trace file for processing, or a synthetic trace
+// generated in memory if `path` names a soak (see soak.h). It returns
+// -1 if there was a problem.
 int trace_open(const char *path);
 
 // `trace_close` closes a trace file.
 void trace_close();
 
+// `trace_select` tells the trace that only the commands of ATMs first
+// to first + count - 1 are wanted. A synthetic trace then generates
+// just those; a trace file is read whole regardless. It returns -1 if
+// there was a problem.
+int trace_select(int first, int count);
+
 // `trace_read_cmd` reads the next command from the trace file into
 // the command buffer `cmd`. It returns the same return values as the
 // `read` system call (0 when the trace is done).
 int trace_read_cmd(Command *cmd);
 
+// `trace_read_cmds` reads up to `n` commands into `cmds` with as few
+// system calls as possible. It returns the number of commands read,
+// 0 when the trace is done, or -1 on error.
+int trace_read_cmds(Command *cmds, int n);
+
 // `trace_atm_count` returns the number of ATMs the trace was
 // generated for.
 int trace_atm_count();
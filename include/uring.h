@@ -0,0 +1,60 @@
+#ifndef __URING_H
+#define __URING_H
+
+#include <linux/io_uring.h>
+
+// A minimal io_uring, driven through the raw `io_uring_setup` and
+// `io_uring_enter` system calls so that no library is needed. The
+// submission and completion rings are shared with the kernel; the
+// pointers below point into those mappings.
+
+typedef struct uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned to_submit; // queued SQEs not yet passed to the kernel
+  void *sq_ring;
+  void *cq_ring;
+  unsigned long sq_ring_sz;
+  unsigned long cq_ring_sz;
+  unsigned long enters; // io_uring_enter calls made, for benchmarking
+} Uring;
+
+// `uring_init` sets up a ring with room for `entries` submissions. It
+// returns -1 if io_uring is unavailable (e.g. an old kernel or a
+// seccomp filter), in which case the caller should fall back to poll.
+int uring_init(Uring *r, unsigned entries);
+
+// `uring_exit` tears down the ring. Requests still in flight are
+// cancelled by the kernel.
+void uring_exit(Uring *r);
+
+// `uring_prep_read` and `uring_prep_write` queue a read/write of `n`
+// bytes on `fd`. `data` is handed back in the completion. They return
+// -1 if the submission queue is full, in which case `uring_submit`
+// must be called before trying again.
+int uring_prep_read(Uring *r, int fd, void *buf, unsigned n,
+                    unsigned long long data);
+int uring_prep_write(Uring *r, int fd, const void *buf, unsigned n,
+                     unsigned long long data);
+
+// `uring_submit` passes all queued requests to the kernel and, if
+// `wait_nr` is non-zero, waits until at least that many completions
+// are available, all in a single system call.
+int uring_submit(Uring *r, unsigned wait_nr);
+
+// `uring_peek` returns the next completion or NULL when the
+// completion queue is empty. Each completion must be released with
+// `uring_seen` before the next one is peeked.
+struct io_uring_cqe *uring_peek(Uring *r);
+void uring_seen(Uring *r);
+
+#endif
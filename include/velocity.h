@@ -0,0 +1,44 @@
+#ifndef __VELOCITY_H
+#define __VELOCITY_H
+
+// Velocity limits cap how many withdrawals and transfers out of an
+// account, and how much money, the bank accepts in any window of time.
+// Each account has two fixed windows of counts, the current one and
+// the one before; the use over the sliding window ending now is
+// estimated as all of the current window plus the part of the previous
+// one it still overlaps. That is O(1) time and 16 bytes per account,
+// kept in an array beside the balances.
+//
+// The limits come from the `BANKSIM_LIMITS` environment variable, as
+// `count,amount,window_ms`; a count or amount of 0 is no limit. Without
+// it nothing is checked.
+
+// The most debits a limit can allow per window.
+#define VELOCITY_MAX_COUNT 65535
+
+typedef struct velocity_limits {
+  int count;
+  int amount;
+  int window_ms;
+} VelocityLimits;
+
+// `velocity_limits` fills `limits` from the environment. It returns 1
+// if limits are set, 0 if not, and -1 if `BANKSIM_LIMITS` is malformed.
+int velocity_limits(VelocityLimits *limits);
+
+// `velocity_open` enforces `limits` on `account_cnt` accounts, or
+// nothing if `limits` is NULL. It returns -1 if out of memory.
+int velocity_open(const VelocityLimits *limits, int account_cnt);
+
+// `velocity_close` frees the counters.
+void velocity_close();
+
+// `velocity_charge` records a debit of `amt` from account `acc` and
+// returns 1, or returns 0 without recording it if it would go over a
+// limit. It always returns 1 when there are no limits.
+int velocity_charge(int acc, int amt);
+
+// `velocity_refund` takes back a debit that was undone.
+void velocity_refund(int acc, int amt);
+
+#endif
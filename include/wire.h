@@ -0,0 +1,40 @@
+#ifndef __WIRE_H
+#define __WIRE_H
+
+#include "command.h"
+
+// Reading and writing commands in the protocol version in use on a
+// descriptor (see command.h): the fixed format unless `wire_use`
+// switched it. Compact messages are read into a buffer kept per
+// descriptor, one whole record at a time from a SOCK_SEQPACKET socket
+// and as much as is there from a pipe, so what a read took beyond the
+// messages asked for is left for the next one.
+
+// `wire_use` switches `fd` to protocol `version`. It returns -1 if out
+// of memory.
+int wire_use(int fd, int version);
+
+// `wire_version` returns the protocol version in use on `fd`.
+int wire_version(int fd);
+
+// `wire_forget` drops the state of `fd`, which is about to be closed;
+// a descriptor reused later starts out in the fixed format.
+void wire_forget(int fd);
+
+// `wire_write` writes the `n` commands in `cmds` to `fd`. It returns
+// SUCCESS or ERR_PIPE_WRITE_ERR, as `checked_write` does.
+int wire_write(int fd, Command *cmds, int n);
+
+// `wire_read` reads `n` commands from `fd` into `cmds`. It returns
+// SUCCESS, ERR_ATM_CLOSED or ERR_PIPE_READ_ERR, as `checked_read` does,
+// and ERR_PIPE_READ_ERR for a malformed message too.
+int wire_read(int fd, Command *cmds, int n);
+
+// `wire_buffered` tells whether bytes read from `fd` are waiting in its
+// buffer, so that a poll could block with a message already in hand,
+// and `wire_backlog` returns the number of descriptors for which that
+// is so.
+int wire_buffered(int fd);
+int wire_backlog();
+
+#endif
@@ -0,0 +1,158 @@
+#include "aggregate.h"
+#include <stdlib.h>
+#include "relabel.h"
+
+static const int *balances = NULL;
+static int account_count = 0;
+
+// fenwick[i] holds the sum of the balances of accounts
+// (i - lowbit(i), i], counting accounts from 1.
+static long long *fenwick = NULL;
+
+// The tournament tree: node 1 is the root, the children of node x are
+// 2x and 2x+1, and the leaves leaf_base..2*leaf_base-1 are the
+// accounts, padded with -1 (no account) up to a power of two.
+static int *winner = NULL;
+static int leaf_base = 0;
+
+// the balance of account `acc`, which relabeling may have moved to
+// another slot (see relabel.h)
+static inline int balance(int acc) { return balances[relabel_slot(acc)]; }
+
+// tells whether account a beats account b
+static inline int beats(int a, int b) {
+  if (b < 0) return a >= 0;
+  if (a < 0) return 0;
+  int x = balance(a), y = balance(b);
+  return x > y || (x == y && a < b);
+}
+
+static inline int match(int x) {
+  int l = winner[2 * x], r = winner[2 * x + 1];
+  return beats(r, l) ? r : l;
+}
+
+int aggregate_open(const int *b, int account_cnt) {
+  aggregate_close();
+  leaf_base = 1;
+  while (leaf_base < account_cnt) leaf_base *= 2;
+  fenwick = malloc(sizeof(long long) * (account_cnt + 1));
+  winner = malloc(sizeof(int) * 2 * leaf_base);
+  if (fenwick == NULL || winner == NULL) {
+    aggregate_close();
+    return -1;
+  }
+  balances = b;
+  account_count = account_cnt;
+  aggregate_rebuild();
+  return 1;
+}
+
+void aggregate_close() {
+  free(fenwick);
+  free(winner);
+  fenwick = NULL;
+  winner = NULL;
+  balances = NULL;
+  account_count = 0;
+}
+
+void aggregate_rebuild() {
+  if (fenwick == NULL) return;
+
+  // each node adds itself to its parent once, bottom up
+  fenwick[0] = 0;
+  for (int i = 1; i <= account_count; i++) fenwick[i] = balance(i - 1);
+  for (int i = 1; i <= account_count; i++) {
+    int parent = i + (i & -i);
+    if (parent <= account_count) fenwick[parent] += fenwick[i];
+  }
+
+  for (int i = 0; i < leaf_base; i++)
+    winner[leaf_base + i] = i < account_count ? i : -1;
+  for (int x = leaf_base - 1; x >= 1; x--) winner[x] = match(x);
+}
+
+void aggregate_update(int acc, int delta) {
+  if (fenwick == NULL) return;
+
+  for (int i = acc + 1; i <= account_count; i += i & -i) fenwick[i] += delta;
+
+  // replay the matches on the path to the root; once a node's winner
+  // is unchanged and is not `acc`, nothing above it changes either
+  for (int x = (leaf_base + acc) / 2; x >= 1; x /= 2) {
+    int w = match(x);
+    if (w == winner[x] && w != acc) break;
+    winner[x] = w;
+  }
+}
+
+static long long prefix(int n) {
+  long long sum = 0;
+  for (int i = n; i > 0; i -= i & -i) sum += fenwick[i];
+  return sum;
+}
+
+long long aggregate_range_sum(int lo, int hi) {
+  if (fenwick == NULL) return 0;
+  return prefix(hi + 1) - prefix(lo);
+}
+
+// The top accounts are found by walking down from the root to the
+// winner's leaf and setting aside the losers met on the way in a max
+// heap; the next winner is the best of them. The heap holds at most
+// log2(leaf_base) nodes per account found.
+#define TOP_HEAP (256 * 32)
+
+static int heap[TOP_HEAP];
+static int heap_len;
+
+static void heap_push(int x) {
+  if (winner[x] < 0 || heap_len == TOP_HEAP) return;
+  int i = heap_len++;
+  while (i > 0 && beats(winner[x], winner[heap[(i - 1) / 2]])) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = x;
+}
+
+static int heap_pop() {
+  int top = heap[0];
+  int last = heap[--heap_len];
+  int i = 0;
+  while (2 * i + 1 < heap_len) {
+    int c = 2 * i + 1;
+    if (c + 1 < heap_len && beats(winner[heap[c + 1]], winner[heap[c]])) c++;
+    if (!beats(winner[heap[c]], winner[last])) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = last;
+  return top;
+}
+
+int aggregate_top(int k, int *accs) {
+  if (winner == NULL) return 0;
+  if (k > TOP_HEAP / 32) k = TOP_HEAP / 32;
+
+  heap_len = 0;
+  heap_push(1);
+  int got = 0;
+  while (got < k && heap_len > 0) {
+    int x = heap_pop();
+    int w = winner[x];
+    while (x < leaf_base) {
+      int l = 2 * x;
+      if (winner[l] == w) {
+        heap_push(l + 1);
+        x = l;
+      } else {
+        heap_push(l);
+        x = l + 1;
+      }
+    }
+    accs[got++] = w;
+  }
+  return got;
+}
@@ -1,10 +1,27 @@
+#define _GNU_SOURCE
 #include "atm.h"
 #include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include "command.h"
 #include "errors.h"
+#include "ledger.h"
+#include "log.h"
+#include "probes.h"
+#include "schedule.h"
+#include "stats.h"
+#include "timer.h"
 #include "trace.h"
+#include "wire.h"
 #include <stdbool.h>
 
 // The following functions should be used to read and write
@@ -46,12 +63,18 @@ static int checked_read(int fd, void *data, int n)
   while (n > 0)
   {
     int result = read(fd, d, n);
-    if (result >= 0)
+    if (result > 0)
     {
       // this approach handles both complete and partial reads
       d += result;
       n -= result;
     }
+    else if (result == 0)
+    {
+      // the bank is gone, so no reply will ever come
+      error_msg(ERR_PIPE_READ_ERR, "bank closed the connection");
+      return ERR_PIPE_READ_ERR;
+    }
     else
     {
       error_msg(ERR_PIPE_READ_ERR, "could not read message from bank");
@@ -61,6 +84,16 @@ static int checked_read(int fd, void *data, int n)
   return SUCCESS;
 }
 
+// the pipe pair to a read replica, if BALANCE goes to one
+static int replica_out_fd = -1;
+static int replica_in_fd = -1;
+
+void atm_use_replica(int out_fd, int in_fd)
+{
+  replica_out_fd = out_fd;
+  replica_in_fd = in_fd;
+}
+
 // helper to check is cmd belongs to the curr atm
 static bool atm_is_correct(int id_cmd, int id_curr)
 {
@@ -68,19 +101,82 @@ static bool atm_is_correct(int id_cmd, int id_curr)
   return is_holder ? true : false;
 }
 
-// helper to send cmd to bank
+// The protocol version the ATM asks for on CONNECT, from
+// BANKSIM_PROTOCOL; the bank may still answer with the fixed format.
+static int protocol_wanted = PROTOCOL_V1;
+
+static void set_up_protocol()
+{
+  char *eval = getenv("BANKSIM_PROTOCOL");
+  protocol_wanted = eval && atoi(eval) == PROTOCOL_V2 ? PROTOCOL_V2 : PROTOCOL_V1;
+}
+
+// helpers to write and read `n` commands in the protocol version in
+// use on fd
+static int cmd_write(int fd, Command *c, int n)
+{
+  return wire_version(fd) == PROTOCOL_V2
+             ? wire_write(fd, c, n)
+             : checked_write(fd, c, n * MESSAGE_SIZE);
+}
+
+static int cmd_read(int fd, Command *c, int n)
+{
+  return wire_version(fd) == PROTOCOL_V2
+             ? wire_read(fd, c, n)
+             : checked_read(fd, c, n * MESSAGE_SIZE);
+}
+
+// helper to send cmd to bank, along with the frames that follow it
+// (the legs of a batch) as a second message
 static int bank_send(int out, Command *c)
 {
-  int outcome = checked_write(out, c, MESSAGE_SIZE);
+  int outcome = cmd_write(out, c, 1);
+  int tail = cmd_tail_frames(c);
+  if (outcome == SUCCESS && tail > 0)
+    outcome = cmd_write(out, c + 1, tail);
   bool success = (outcome == SUCCESS);
 
   return success ? outcome : (error_print(), outcome);
 }
 
+// How long an ATM waits for a reply before it gives up, in ms, from
+// BANKSIM_TIMEOUT_MS; 0 waits forever.
+static int reply_timeout_ms = 0;
+
+static void set_up_timeout()
+{
+  char *eval = getenv("BANKSIM_TIMEOUT_MS");
+  reply_timeout_ms = eval && atoi(eval) > 0 ? atoi(eval) : 0;
+
+  // a bank that has gone away fails the next write instead of
+  // killing the ATM
+  signal(SIGPIPE, SIG_IGN);
+}
+
+// helper to wait for a reply from the bank for at most
+// reply_timeout_ms
+static int res_wait(int in)
+{
+  struct pollfd pfd = {in, POLLIN, 0};
+  int result;
+  while ((result = poll(&pfd, 1, reply_timeout_ms)) < 0 && errno == EINTR)
+    ;
+  if (result == 0)
+  {
+    error_msg(ERR_TIMEOUT, "no reply from the bank in time");
+    return ERR_TIMEOUT;
+  }
+  return SUCCESS;
+}
+
 // helper to received cmd from bank
 static int res_get(int in, Command *res)
 {
-  int outcome = checked_read(in, res, MESSAGE_SIZE);
+  // a compact reply may already be in hand
+  int outcome = reply_timeout_ms && !wire_buffered(in) ? res_wait(in) : SUCCESS;
+  if (outcome == SUCCESS)
+    outcome = cmd_read(in, res, 1);
   bool success = (outcome == SUCCESS);
 
   return success ? outcome : (error_print(), outcome);
@@ -105,16 +201,56 @@ static int res_manage(Command *res)
   case NOFUNDS:
     return ERR_NOFUNDS;
 
+  case LIMIT:
+    return ERR_LIMIT;
+
+  case TIMEOUT:
+    error_msg(ERR_TIMEOUT, "dropped by the bank for being idle");
+    return ERR_TIMEOUT;
+
   default:
     error_msg(ERR_UNKNOWN_CMD, "invalid res cmd");
     return ERR_UNKNOWN_CMD;
   }
 }
 
+// helper to count the money moved by a DEPOSIT or WITHDRAW the bank
+// answered OK, for the conservation check in the stats summary
+static void money_count(int atm_id, Command *sent, cmd_t reply)
+{
+  cmd_t c;
+  int i, f, t, a;
+  cmd_unpack(sent, &c, &i, &f, &t, &a);
+  if (reply == OK && c == DEPOSIT)
+    stats_money(atm_id, a, 0);
+  else if (reply == OK && c == WITHDRAW)
+    stats_money(atm_id, 0, a);
+}
+
+// helper to read the protocol version off the OK to a CONNECT
+static int reply_version(Command *res)
+{
+  cmd_t r;
+  int rid, f, t, a;
+  cmd_unpack(res, &r, &rid, &f, &t, &a);
+  return a;
+}
+
 // helper to handle transaction req
 static int handle_trans(int out, int in, Command *c, int i)
 {
+  // the compact protocol is asked for on CONNECT
+  Command ask;
+  if (c->cmd[0] == CONNECT && protocol_wanted == PROTOCOL_V2)
+  {
+    cmd_t k;
+    int id, f, t, a;
+    cmd_unpack(c, &k, &id, &f, &t, &a);
+    cmd_pack(&ask, k, id, f, t, PROTOCOL_V2);
+    c = &ask;
+  }
   cmd_dump("atm - bank", i, c);
+  PROBE2(atm_send, i, c->cmd[0]);
 
   int outcome = bank_send(out, c);
   bool success_w = (outcome == SUCCESS);
@@ -124,13 +260,70 @@ static int handle_trans(int out, int in, Command *c, int i)
                       ? res_get(in, &res)
                       : (error_print(), outcome);
 
+  // a batch reply carries the bitmap of applied legs after it, and a
+  // statement or top-k query its entries
+  int tail = resultant == SUCCESS ? cmd_reply_frames(c, &res) : 0;
+  if (tail > CMD_MAX_REPLY_FRAMES)
+  {
+    error_msg(ERR_UNKNOWN_CMD, "reply too long");
+    resultant = ERR_UNKNOWN_CMD;
+  }
+  else if (tail > 0)
+  {
+    Command frames[CMD_MAX_REPLY_FRAMES];
+    resultant = cmd_read(in, frames, tail);
+    int rid, f, t, a;
+    cmd_t r;
+    cmd_unpack(&res, &r, &rid, &f, &t, &a);
+    if (c->cmd[0] == BATCH)
+      log_printf("atm %d: batch applied %d of %d legs\n", i, t, f);
+    else
+    {
+      log_printf("atm %d: %s of %d entries\n", i, cmd_strings[c->cmd[0]], t);
+      for (int k = 0; k < tail; k++)
+        cmd_dump(cmd_strings[c->cmd[0]], i, &frames[k]);
+    }
+  }
+
   bool success_r = (resultant == SUCCESS);
+  stats_count(i, c->cmd[0], success_r ? res.cmd[0] : (cmd_t)-1);
+  PROBE3(atm_reply, i, c->cmd[0], success_r ? res.cmd[0] : -1);
+  if (success_r)
+    money_count(i, c, res.cmd[0]);
+
+  // and spoken from the reply on if the bank agrees
+  if (success_r && c->cmd[0] == CONNECT && res.cmd[0] == OK &&
+      reply_version(&res) == PROTOCOL_V2 &&
+      (wire_use(out, PROTOCOL_V2) < 0 || wire_use(in, PROTOCOL_V2) < 0))
+  {
+    error_msg(ERR_PIPE_READ_ERR, "out of memory switching protocol");
+    resultant = ERR_PIPE_READ_ERR;
+    success_r = false;
+  }
 
   return (success_r)
              ? (cmd_dump("bank - atm", i, &res), res_manage(&res))
              : (error_print(), resultant);
 }
 
+// helper to answer a BALANCE from the shared ledger, without asking
+// the bank. It returns false if there is no ledger to read.
+static bool balance_local(Command *cmd, int atm_id, int *status)
+{
+  cmd_t c;
+  int i, f, t, a;
+  cmd_unpack(cmd, &c, &i, &f, &t, &a);
+
+  int balance;
+  int found = ledger_read(f, &balance);
+  if (found < 0)
+    return false;
+
+  stats_count(atm_id, BALANCE, found ? OK : ACCUNKN);
+  *status = found ? SUCCESS : ERR_UNKNOWN_ACCOUNT;
+  return true;
+}
+
 // The `atm` function processes commands received from a trace
 // file.  It communicates to the bank transactions with a matching
 // ID.  It then receives a response from the bank process and handles
@@ -161,6 +354,19 @@ int atm(int bank_out_fd, int atm_in_fd, int atm_id, Command *cmd)
     con = true;
   }
 
+  // a balance is read from the shared ledger when there is one
+  int local;
+  if (c == BALANCE && balance_local(cmd, atm_id, &local))
+  {
+    return local;
+  }
+
+  // or by a read replica
+  if (c == BALANCE && replica_out_fd >= 0)
+  {
+    return handle_trans(replica_out_fd, replica_in_fd, cmd, atm_id);
+  }
+
   switch (c)
   {
   case CONNECT:
@@ -169,6 +375,11 @@ int atm(int bank_out_fd, int atm_in_fd, int atm_id, Command *cmd)
   case WITHDRAW:
   case TRANSFER:
   case BALANCE:
+  case BATCH:
+  case EOD:
+  case STATEMENT:
+  case TOPK:
+  case RANGESUM:
 
     return handle_trans(bank_out_fd, atm_in_fd, cmd, atm_id);
 
@@ -180,51 +391,720 @@ int atm(int bank_out_fd, int atm_in_fd, int atm_id, Command *cmd)
   // return status;
 }
 
+// helper to report the outcome of a command to the ATM user. It
+// returns SUCCESS if the ATM can go on with the next command.
+static int status_report(int status, int atm_id)
+{
+  switch (status)
+  {
+  // We continue if the ATM was unknown. This is ok because the trace
+  // file contains commands for all the ATMs.
+  case ERR_UNKNOWN_ATM:
+    return SUCCESS;
+
+  // We display an error message to the ATM user if the account
+  // is not valid. Outcomes are counted in the stats, so the message
+  // is only logged when asked for.
+  case ERR_UNKNOWN_ACCOUNT:
+    log_printf("atm %d: unknown account! ATM Out of service\n", atm_id);
+    return SUCCESS;
+
+  // We display an error message to the ATM user if the account
+  // does not have sufficient funds.
+  case ERR_NOFUNDS:
+    log_printf("atm %d: not enough funds, retry transaction\n", atm_id);
+    return SUCCESS;
+
+  // Likewise if the account has reached its velocity limits.
+  case ERR_LIMIT:
+    log_printf("atm %d: account limit reached, retry later\n", atm_id);
+    return SUCCESS;
+
+  // A reply that never came, or the bank dropping an idle ATM, stops
+  // the ATM rather than leaving it hanging.
+  case ERR_TIMEOUT:
+    printf("atm %d: timed out, stopping\n", atm_id);
+    return status;
+
+  // If we receive some other status that is not successful
+  // we return with the status.
+  default:
+    if (status != SUCCESS)
+    {
+      printf("atm %d: status is %d\n", atm_id, status);
+    }
+    return status;
+  }
+}
+
+int atm_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    error_msg(ERR_SOCKET_ERR, "socket path too long");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    error_msg(ERR_SOCKET_ERR, "could not create atm socket");
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    error_msg(ERR_SOCKET_ERR, "could not connect to bank");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
 int atm_run(const char *trace, int bank_out_fd, int atm_in_fd, int atm_id)
 {
   int status = trace_open(trace);
-  if (status == -1)
+  if (status == -1 || trace_select(atm_id, 1) == -1)
   {
     error_msg(ERR_BAD_TRACE_FILE, "could not open trace file");
     return ERR_BAD_TRACE_FILE;
   }
 
-  Command cmd;
-  while (trace_read_cmd(&cmd))
+  set_up_timeout();
+  set_up_protocol();
+
+  // a command and the frames that follow it in the trace
+  static Command cmd[1 + BATCH_MAX_LEGS];
+  while (trace_read_cmd(cmd))
   {
-    status = atm(bank_out_fd, atm_in_fd, atm_id, &cmd);
+    int tail = cmd_tail_frames(cmd);
+    if (tail < 0 || (tail > 0 && trace_read_cmds(cmd + 1, tail) != tail))
+    {
+      error_msg(ERR_BAD_TRACE_FILE, "truncated command in trace file");
+      return ERR_BAD_TRACE_FILE;
+    }
+
+    status = atm(bank_out_fd, atm_in_fd, atm_id, cmd);
+    status = status_report(status, atm_id);
+    if (status != SUCCESS)
+      return status;
+  }
+
+  trace_close();
+
+  return SUCCESS;
+}
+
+// The arrival schedule of an open-loop replay (see `atm_open_loop`);
+// a rate of 0 means closed-loop.
+static int open_kind = SCHED_POISSON;
+static double open_rate = 0;
 
-    switch (status)
+void atm_open_loop(int kind, double rate)
+{
+  open_kind = kind;
+  open_rate = rate;
+}
+
+// A logical ATM driven by `atm_run_many`. Instead of a process per
+// ATM, each one is a small state machine holding the next few commands
+// of its share of the trace and whether it waits for a bank reply.
+
+#define ATM_QUEUE 16 // trace commands buffered per logical ATM
+
+typedef struct logical_atm
+{
+  Command *queue; // a ring of ATM_QUEUE commands, or more if open-loop
+  Command **tails; // the frames following a queued command
+  int head;
+  int len;
+  int cap;
+  bool connected;
+  bool waiting;
+  bool done; // its share of the trace has been sent
+  int inflight; // commands sent and not yet answered
+  Schedule sched; // open-loop only
+  long due; // when the next command is meant to be sent, in ns
+  Timer deadline; // for the reply to its oldest command in flight
+} LogicalAtm;
+
+// A command written to the bank and not yet answered. The bank answers
+// the commands of one channel in order, so these form a FIFO.
+typedef struct flight
+{
+  int k; // the logical ATM that sent it
+  Command sent;
+  long due; // when it was meant to be sent, in ns
+} Flight;
+
+// The state of one multiplexing ATM process.
+typedef struct atm_mux
+{
+  LogicalAtm *atms;
+  int first;
+  int count;
+  int *ready; // logical ATMs that may send their next command
+  int ready_count;
+  Command chunk[256]; // trace commands read but not yet distributed
+  int chunk_pos;
+  int chunk_len;
+  bool trace_done;
+  byte *out; // commands not yet written to the bank
+  int out_len;
+  int out_cap;
+  byte *in; // replies received but not yet handled
+  int in_cap;
+  int have;
+  Flight *flights; // a ring of the commands awaiting replies
+  int flight_head;
+  int flight_len;
+  int flight_cap;
+  bool open_loop;
+  long start; // when the replay started, in ns
+  bool records; // the bank is a SOCK_SEQPACKET socket
+  int out_tail; // bytes of the tail of a command still to be written
+  TimerWheel deadlines; // of the logical ATMs, in ms, with reply_timeout_ms
+} AtmMux;
+
+static long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// With a reply timeout, every logical ATM with commands in flight has
+// a deadline for the reply to the oldest one. The bank answers them in
+// order, so each reply moves the deadline on to the next.
+static void mux_deadline(AtmMux *m, int k)
+{
+  if (reply_timeout_ms == 0)
+    return;
+  if (m->atms[k].inflight > 0)
+    timer_arm(&m->deadlines, &m->atms[k].deadline,
+              m->deadlines.now + reply_timeout_ms);
+  else
+    timer_cancel(&m->deadlines, &m->atms[k].deadline);
+}
+
+// fails with ERR_TIMEOUT if a logical ATM has waited too long
+static int mux_expired(AtmMux *m)
+{
+  if (reply_timeout_ms == 0)
+    return SUCCESS;
+  Timer *t = timer_advance(&m->deadlines, now_ns() / 1000000);
+  if (t == NULL)
+    return SUCCESS;
+  error_msg(ERR_TIMEOUT, "no reply from the bank in time");
+  return status_report(ERR_TIMEOUT, m->first + t->id);
+}
+
+// makes sure a growable buffer has room for n bytes
+static byte *mux_fit(byte **buf, int *cap, int n)
+{
+  if (n > *cap)
+  {
+    *cap = 2 * n;
+    *buf = (byte *)realloc(*buf, *cap);
+  }
+  return *buf;
+}
+
+// takes the next n commands of the trace, copying them to dst unless
+// it is NULL
+static int mux_take(AtmMux *m, Command *dst, int n)
+{
+  while (n > 0)
+  {
+    if (m->chunk_pos == m->chunk_len)
     {
-    // We continue if the ATM was unknown. This is ok because the trace
-    // file contains commands for all the ATMs.
-    case ERR_UNKNOWN_ATM:
-      break;
+      m->chunk_len = trace_read_cmds(m->chunk, 256);
+      m->chunk_pos = 0;
+      if (m->chunk_len <= 0)
+      {
+        error_msg(ERR_BAD_TRACE_FILE, "truncated command in trace file");
+        return ERR_BAD_TRACE_FILE;
+      }
+    }
 
-    // We display an error message to the ATM user if the account
-    // is not valid.
-    case ERR_UNKNOWN_ACCOUNT:
-      printf("ATM error: unknown account! ATM Out of service\n");
-      break;
+    int k = m->chunk_len - m->chunk_pos;
+    k = k < n ? k : n;
+    if (dst != NULL)
+    {
+      memcpy(dst, &m->chunk[m->chunk_pos], k * MESSAGE_SIZE);
+      dst += k;
+    }
+    m->chunk_pos += k;
+    n -= k;
+  }
+  return SUCCESS;
+}
 
-    // We display an error message to the ATM user if the account
-    // does not have sufficient funds.
-    case ERR_NOFUNDS:
-      printf("not enough funds, retry transaction\n");
-      break;
+// doubles the queue of a logical ATM, unwrapping it
+static void atm_grow(LogicalAtm *atm)
+{
+  int cap = atm->cap ? 2 * atm->cap : ATM_QUEUE;
+  Command *queue = (Command *)malloc(sizeof(Command) * cap);
+  Command **tails = (Command **)malloc(sizeof(Command *) * cap);
+  for (int q = 0; q < atm->len; ++q)
+  {
+    queue[q] = atm->queue[(atm->head + q) % atm->cap];
+    tails[q] = atm->tails[(atm->head + q) % atm->cap];
+  }
+  free(atm->queue);
+  free(atm->tails);
+  atm->queue = queue;
+  atm->tails = tails;
+  atm->cap = cap;
+  atm->head = 0;
+}
 
-    // If we receive some other status that is not successful
-    // we return with the status.
-    default:
-      if (status != SUCCESS)
+// hands trace commands to the queues of the logical ATMs they belong
+// to, stopping when a queue is full so memory stays bounded
+static int mux_fill(AtmMux *m)
+{
+  while (!m->trace_done)
+  {
+    if (m->chunk_pos == m->chunk_len)
+    {
+      m->chunk_len = trace_read_cmds(m->chunk, 256);
+      m->chunk_pos = 0;
+      if (m->chunk_len <= 0)
       {
-        printf("status is %d\n", atm_id, status);
-        return status;
+        m->trace_done = true;
+        return m->chunk_len < 0 ? ERR_BAD_TRACE_FILE : SUCCESS;
       }
     }
+
+    cmd_t c;
+    int i, f, t, a;
+    Command cmd = m->chunk[m->chunk_pos];
+    cmd_unpack(&cmd, &c, &i, &f, &t, &a);
+
+    int tail = cmd_tail_frames(&cmd);
+    if (tail < 0)
+    {
+      error_msg(ERR_BAD_TRACE_FILE, "malformed command in trace file");
+      return ERR_BAD_TRACE_FILE;
+    }
+
+    // commands of other ATM processes are skipped
+    int k = i - m->first;
+    LogicalAtm *atm = (k >= 0 && k < m->count) ? &m->atms[k] : NULL;
+    if (atm != NULL && atm->len == atm->cap)
+    {
+      // An open-loop ATM sends on its own schedule, not when the others
+      // have drained the trace before its commands, so its queue grows.
+      if (!m->open_loop)
+        return SUCCESS;
+      atm_grow(atm);
+    }
+    m->chunk_pos++;
+
+    Command *frames = (atm != NULL && tail > 0)
+                          ? (Command *)malloc(tail * MESSAGE_SIZE)
+                          : NULL;
+    int status = mux_take(m, frames, tail);
+    if (status != SUCCESS)
+      return status;
+
+    if (atm != NULL)
+    {
+      int at = (atm->head + atm->len) % atm->cap;
+      atm->queue[at] = cmd;
+      atm->tails[at] = frames;
+      atm->len++;
+    }
   }
+  return SUCCESS;
+}
 
-  trace_close();
+// takes the next command a logical ATM should send, dropping repeated
+// CONNECTs as `atm` does. It returns false if the queue ran dry.
+static bool mux_next(LogicalAtm *atm, Command *out, Command **tail)
+{
+  while (atm->len > 0)
+  {
+    *out = atm->queue[atm->head];
+    *tail = atm->tails[atm->head];
+    atm->head = (atm->head + 1) % atm->cap;
+    atm->len--;
+
+    if (out->cmd[0] != CONNECT || !atm->connected)
+    {
+      atm->connected |= out->cmd[0] == CONNECT;
+      return true;
+    }
+  }
+  return false;
+}
 
+// appends a command of logical ATM k (and its tail) to the commands to
+// write to the bank, and remembers it until its reply arrives
+static int mux_queue(AtmMux *m, int k, Command *cmd, Command *tail, long due)
+{
+  byte c = cmd->cmd[0];
+  if (!cmd_is_request(c))
+  {
+    free(tail);
+    error_msg(ERR_UNKNOWN_CMD, "invalid atm cmd");
+    return ERR_UNKNOWN_CMD;
+  }
+  cmd_dump("atm - bank", m->first + k, cmd);
+  PROBE2(atm_send, m->first + k, c);
+
+  int frames = cmd_tail_frames(cmd);
+  mux_fit(&m->out, &m->out_cap, m->out_len + (1 + frames) * MESSAGE_SIZE);
+  memcpy(m->out + m->out_len, cmd, MESSAGE_SIZE);
+  if (frames > 0)
+    memcpy(m->out + m->out_len + MESSAGE_SIZE, tail, frames * MESSAGE_SIZE);
+  free(tail);
+  m->out_len += (1 + frames) * MESSAGE_SIZE;
+
+  if (m->flight_len == m->flight_cap)
+  {
+    // grow the ring, unwrapping it
+    int cap = m->flight_cap ? 2 * m->flight_cap : 64;
+    Flight *f = (Flight *)malloc(sizeof(Flight) * cap);
+    for (int q = 0; q < m->flight_len; ++q)
+    {
+      f[q] = m->flights[(m->flight_head + q) % m->flight_cap];
+    }
+    free(m->flights);
+    m->flights = f;
+    m->flight_cap = cap;
+    m->flight_head = 0;
+  }
+  if (m->atms[k].inflight++ == 0)
+    mux_deadline(m, k);
+  Flight *f = &m->flights[(m->flight_head + m->flight_len++) % m->flight_cap];
+  f->k = k;
+  f->sent = *cmd;
+  f->due = due;
+  return SUCCESS;
+}
+
+// answers a BALANCE of logical ATM k from the shared ledger, unless
+// it has commands in flight the balance should reflect. It returns
+// false if the command must be sent to the bank.
+static bool mux_local(AtmMux *m, int k, Command *cmd, long due, int *status)
+{
+  if (cmd->cmd[0] != BALANCE || m->atms[k].inflight > 0 ||
+      !balance_local(cmd, m->first + k, status))
+    return false;
+
+  if (m->open_loop)
+    stats_latency(m->first + k, now_ns() - m->start - due);
+  *status = status_report(*status, m->first + k);
+  return true;
+}
+
+// queues the next command of every ready logical ATM to be sent in
+// one write, retiring the ones whose share of the trace is done
+static int mux_send(AtmMux *m, int *active, int *outstanding)
+{
+  int keep = 0;
+  for (int j = 0; j < m->ready_count; ++j)
+  {
+    int k = m->ready[j];
+    LogicalAtm *atm = &m->atms[k];
+    Command cmd, *tail;
+    int status;
+
+    bool next = mux_next(atm, &cmd, &tail);
+    while (next && mux_local(m, k, &cmd, 0, &status))
+    {
+      if (status != SUCCESS)
+        return status;
+      next = mux_next(atm, &cmd, &tail);
+    }
+
+    if (next)
+    {
+      int status = mux_queue(m, k, &cmd, tail, 0);
+      if (status != SUCCESS)
+        return status;
+      atm->waiting = true;
+      (*outstanding)++;
+    }
+    else if (m->trace_done)
+      (*active)--;
+    else
+      m->ready[keep++] = k;
+  }
+  m->ready_count = keep;
   return SUCCESS;
 }
+
+// In an open-loop replay, queues every command whose scheduled time
+// has come, whether or not earlier ones were answered, and retires the
+// logical ATMs whose share of the trace is done. It returns when the
+// next command is due, or -1 if none is waiting to be sent.
+static long mux_send_due(AtmMux *m, int *active, int *outstanding, int *status)
+{
+  long now = now_ns() - m->start;
+  long next = -1;
+  for (int k = 0; k < m->count; ++k)
+  {
+    LogicalAtm *atm = &m->atms[k];
+    Command cmd, *tail;
+
+    while (!atm->done && atm->due <= now && mux_next(atm, &cmd, &tail))
+    {
+      bool local = mux_local(m, k, &cmd, atm->due, status);
+      if (!local)
+        *status = mux_queue(m, k, &cmd, tail, atm->due);
+      if (*status != SUCCESS)
+        return -1;
+      atm->due = schedule_next(&atm->sched);
+      *outstanding += !local;
+    }
+
+    if (atm->done)
+      continue;
+    if (atm->len == 0 && m->trace_done)
+    {
+      atm->done = true;
+      (*active)--;
+    }
+    else if (atm->len > 0 && (next < 0 || atm->due < next))
+      next = atm->due;
+  }
+  return next;
+}
+
+// writes as much of the queued commands as the bank will take now. On
+// a socket every write is a record, so a command and its tail are
+// written as two records, as `bank_send` does, rather than all at once.
+static int mux_write(AtmMux *m, int bank_out_fd)
+{
+  int done = 0;
+  while (done < m->out_len)
+  {
+    int n = m->out_len - done;
+    if (m->records)
+      n = m->out_tail > 0 ? m->out_tail : (int)MESSAGE_SIZE;
+
+    int result = write(bank_out_fd, m->out + done, n);
+    if (result < 0)
+    {
+      if (errno == EAGAIN)
+        break;
+      error_msg(ERR_PIPE_WRITE_ERR, "could not write message to bank");
+      return (error_print(), ERR_PIPE_WRITE_ERR);
+    }
+    if (m->records)
+    {
+      Command *c = (Command *)(m->out + done);
+      m->out_tail = m->out_tail > 0 ? 0 : cmd_tail_frames(c) * MESSAGE_SIZE;
+    }
+    done += result;
+    if (!m->records)
+      break;
+  }
+  m->out_len -= done;
+  memmove(m->out, m->out + done, m->out_len);
+  return SUCCESS;
+}
+
+// reads whatever replies are available and hands each one to the
+// logical ATM whose id it carries
+static int mux_receive(AtmMux *m, int atm_in_fd, int *outstanding)
+{
+  // room for the longest reply, which a SOCK_SEQPACKET read must take
+  // in one go
+  mux_fit(&m->in, &m->in_cap, m->have + (1 + CMD_MAX_REPLY_FRAMES) * MESSAGE_SIZE);
+  int result = read(atm_in_fd, m->in + m->have, m->in_cap - m->have);
+  if (result <= 0)
+  {
+    error_msg(ERR_PIPE_READ_ERR, "could not read message from bank");
+    return ERR_PIPE_READ_ERR;
+  }
+  m->have += result;
+  long now = now_ns() - m->start;
+
+  int done = 0;
+  while (done + (int)MESSAGE_SIZE <= m->have)
+  {
+    Command *res = (Command *)(m->in + done);
+    cmd_t c;
+    int i, f, t, a;
+    cmd_unpack(res, &c, &i, &f, &t, &a);
+
+    if (c == TIMEOUT)
+      return status_report(res_manage(res), i);
+
+    if (m->flight_len == 0 || i != m->first + m->flights[m->flight_head].k)
+    {
+      error_msg(ERR_UNKNOWN_ATM, "reply for an atm not waiting");
+      return ERR_UNKNOWN_ATM;
+    }
+
+    // a reply is handled once the frames after it are in as well
+    Flight *fl = &m->flights[m->flight_head];
+    int size = (1 + cmd_reply_frames(&fl->sent, res)) * MESSAGE_SIZE;
+    if (done + size > m->have)
+      break;
+    done += size;
+
+    cmd_dump("bank - atm", i, res);
+    for (int k = 1; k < size / (int)MESSAGE_SIZE; k++)
+    {
+      if (fl->sent.cmd[0] != BATCH)
+        cmd_dump(cmd_strings[fl->sent.cmd[0]], i, &res[k]);
+    }
+    stats_count(i, fl->sent.cmd[0], c);
+    PROBE3(atm_reply, i, fl->sent.cmd[0], c);
+    money_count(i, &fl->sent, c);
+    if (m->open_loop)
+    {
+      // measured from when it should have been sent, so a backlog
+      // that delayed sending it is part of its latency
+      stats_latency(i, now - fl->due);
+    }
+    int status = status_report(res_manage(res), i);
+    if (status != SUCCESS)
+      return status;
+
+    m->atms[fl->k].inflight--;
+    mux_deadline(m, fl->k);
+    if (!m->open_loop)
+    {
+      m->atms[fl->k].waiting = false;
+      m->ready[m->ready_count++] = fl->k;
+    }
+    m->flight_head = (m->flight_head + 1) % m->flight_cap;
+    m->flight_len--;
+    (*outstanding)--;
+  }
+
+  m->have -= done;
+  memmove(m->in, m->in + done, m->have);
+  return SUCCESS;
+}
+
+int atm_run_many(const char *trace, int bank_out_fd, int atm_in_fd,
+                 int first_atm, int atm_cnt)
+{
+  if (trace_open(trace) == -1 || trace_select(first_atm, atm_cnt) == -1)
+  {
+    error_msg(ERR_BAD_TRACE_FILE, "could not open trace file");
+    return ERR_BAD_TRACE_FILE;
+  }
+
+  AtmMux m;
+  memset(&m, 0, sizeof(m));
+  m.first = first_atm;
+  m.count = atm_cnt;
+  m.atms = (LogicalAtm *)calloc(atm_cnt, sizeof(LogicalAtm));
+  m.ready = (int *)malloc(sizeof(int) * atm_cnt);
+  for (int k = 0; k < atm_cnt; ++k)
+  {
+    atm_grow(&m.atms[k]);
+    timer_init(&m.atms[k].deadline, k);
+    m.ready[m.ready_count++] = k;
+  }
+  set_up_timeout();
+  timer_wheel_init(&m.deadlines, now_ns() / 1000000);
+
+  // An open-loop replay gives every logical ATM its own schedule,
+  // seeded by its id, and asks for timer wake-ups as exact as the
+  // kernel can make them.
+  m.open_loop = open_rate > 0;
+  int status = m.open_loop ? mux_fill(&m) : SUCCESS; // all of the trace
+  m.start = now_ns();
+  for (int k = 0; m.open_loop && k < atm_cnt; ++k)
+  {
+    schedule_init(&m.atms[k].sched, open_kind, open_rate, first_atm + k + 1);
+    m.atms[k].due = schedule_next(&m.atms[k].sched);
+  }
+  if (m.open_loop)
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+  // Commands are written without blocking and replies are read as
+  // they come, so neither side can fill its pipe while the other one
+  // waits to write, however many commands are in flight.
+  fcntl(bank_out_fd, F_SETFL, fcntl(bank_out_fd, F_GETFL) | O_NONBLOCK);
+  int type;
+  socklen_t type_len = sizeof(type);
+  m.records = getsockopt(bank_out_fd, SOL_SOCKET, SO_TYPE, &type,
+                         &type_len) == 0 &&
+              type == SOCK_SEQPACKET;
+
+  int active = atm_cnt;
+  int outstanding = 0;
+
+  while (status == SUCCESS && (active > 0 || outstanding > 0))
+  {
+    long next = -1;
+    status = mux_fill(&m);
+    if (status == SUCCESS && !m.open_loop)
+      status = mux_send(&m, &active, &outstanding);
+    else if (status == SUCCESS)
+      next = mux_send_due(&m, &active, &outstanding, &status);
+    if (status != SUCCESS ||
+        (m.out_len == 0 && outstanding == 0 && next < 0))
+      continue;
+
+    // wait for replies, room to write, or the next scheduled command
+    struct timespec wait, *timeout = NULL;
+    if (next >= 0)
+    {
+      long left = next - (now_ns() - m.start);
+      left = left > 0 ? left : 0;
+      wait.tv_sec = left / 1000000000L;
+      wait.tv_nsec = left % 1000000000L;
+      timeout = &wait;
+    }
+
+    // or for a reply to be overdue
+    long wheel = reply_timeout_ms ? timer_wait(&m.deadlines) : -1;
+    if (wheel >= 0 && (timeout == NULL || wait.tv_sec * 1000L + wait.tv_nsec / 1000000 > wheel))
+    {
+      wait.tv_sec = wheel / 1000;
+      wait.tv_nsec = wheel % 1000 * 1000000L;
+      timeout = &wait;
+    }
+
+    struct pollfd fds[2] = {{atm_in_fd, POLLIN, 0},
+                            {bank_out_fd, m.out_len > 0 ? POLLOUT : 0, 0}};
+    if (ppoll(fds, 2, timeout, NULL) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      error_msg(ERR_PIPE_READ_ERR, "could not poll the bank");
+      status = ERR_PIPE_READ_ERR;
+      break;
+    }
+
+    if (fds[1].revents)
+      status = mux_write(&m, bank_out_fd);
+    if (status == SUCCESS && fds[0].revents)
+      status = mux_receive(&m, atm_in_fd, &outstanding);
+    if (status == SUCCESS)
+      status = mux_expired(&m);
+  }
+
+  for (int k = 0; k < atm_cnt; ++k)
+  {
+    for (int q = 0; q < m.atms[k].len; ++q)
+    {
+      free(m.atms[k].tails[(m.atms[k].head + q) % m.atms[k].cap]);
+    }
+    free(m.atms[k].queue);
+    free(m.atms[k].tails);
+  }
+  free(m.atms);
+  free(m.ready);
+  free(m.out);
+  free(m.in);
+  free(m.flights);
+  trace_close();
+
+  return status;
+}
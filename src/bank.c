@@ -1,10 +1,36 @@
+#define _GNU_SOURCE
 #include "bank.h"
+#include "aggregate.h"
+#include "changelog.h"
+#include <errno.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include "command.h"
+#include "eod.h"
 #include "errors.h"
+#include "fair.h"
+#include "history.h"
+#include "io.h"
+#include "ledger.h"
+#include "log.h"
+#include "pages.h"
+#include "probes.h"
+#include "relabel.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "stm.h"
+#include "timer.h"
+#include "uring.h"
+#include "velocity.h"
+#include "wire.h"
 #include <stdbool.h>
 
 // The account balances are represented by an array.
@@ -13,70 +39,91 @@ static int *accounts = NULL;
 // The number of accounts.
 static int account_count = 0;
 
+// How the balance array was allocated, unless it is the shared ledger.
+static PageReport account_pages;
+
 // The number of ATMs.
 static int atm_count = 0;
 
+// The rules of the end-of-day job and the threads it runs on.
+static EodRules eod_rules_in_force;
+static int eod_thread_count = 1;
+
+// Whether batches are worked out speculatively on several threads
+// (see stm.h) rather than applied leg by leg.
+static bool stm_batches = false;
+
+// The number of channels the bank reads commands from. This is
+// atm_count unless ATM processes drive several logical ATMs each.
+static int chan_count = 0;
+
 // This is used just for testing.
 int *get_accounts() { return accounts; }
 
-// Performs a `write` call, checking for errors and handlings
-// partial writes. If there was an error it returns ERR_PIPE_WRITE_ERR.
-// Note: data is void * since the actual type being written does not matter.
+// Transactions processed by the bank loop, reported with the system
+// calls it made (io_syscalls) when `BANKSIM_IO_STATS` is set.
+static unsigned long io_transactions = 0;
 
-static int checked_write(int fd, void *data, int n)
+// The command being read, followed by the frames that come with it
+// (see `cmd_tail_frames`). It grows to fit the longest command seen.
+static Command *frames = NULL;
+static int frames_cap = 0;
+
+// makes room for n frames in a growable command buffer
+static Command *frames_fit(Command **buf, int *cap, int n)
 {
-  char *d = (char *)data;
-  while (n > 0)
+  if (n > *cap)
   {
-    int result = write(fd, d, n);
-    if (result >= 0)
-    {
-      // this approach handles both complete and partial writes
-      d += result;
-      n -= result;
-    }
-    else
-    {
-      error_msg(ERR_PIPE_WRITE_ERR, "could not write message to atm");
-      perror("write");
-
-      return ERR_PIPE_WRITE_ERR;
-    }
+    *cap = n;
+    *buf = (Command *)realloc(*buf, sizeof(Command) * n);
   }
-  return SUCCESS;
+  return *buf;
 }
 
-// Performs a `read` call, checking for errors and handlings
-// partial read. If there was an error it returns ERR_PIPE_READ_ERR.
-// Note: data is void * since the actual type being read does not matter.
+// The descriptor the command being served was read from, which a
+// CONNECT switches to the compact protocol along with the reply one;
+// -1 when commands arrive some other way.
+static int command_fd = -1;
 
-static int checked_read(int fd, void *data, int n)
+// Reads a command and the frames that follow it into `frames`. The
+// header and the frames are read separately, which matters on a
+// SOCK_SEQPACKET socket where each is its own record.
+static int read_command(int fd)
 {
-  char *d = (char *)data;
-  while (n > 0)
-  {
-    int result = read(fd, d, n);
+  frames_fit(&frames, &frames_cap, 1);
+  command_fd = fd;
+  int result = wire_read(fd, frames, 1);
+  if (result != SUCCESS)
+    return result;
+  PROBE2(receive, fd, frames->cmd[0]);
 
-    if (result > 0)
-    {
-      // this approach handles both complete and partial reads
-      d += result;
-      n -= result;
-      continue;
-    }
+  int tail = cmd_tail_frames(frames);
+  if (tail < 0)
+  {
+    error_msg(ERR_UNKNOWN_CMD, "malformed command received");
+    return ERR_UNKNOWN_CMD;
+  }
+  if (tail == 0)
+    return SUCCESS;
 
-    if (result == 0)
-    {
-      // indicates EOF
-      return ERR_ATM_CLOSED;
-    }
+  frames_fit(&frames, &frames_cap, 1 + tail);
+  result = wire_read(fd, frames + 1, tail);
+  return result == ERR_ATM_CLOSED ? ERR_PIPE_READ_ERR : result;
+}
 
-    error_msg(ERR_PIPE_READ_ERR, "could not read message from atm");
-    return ERR_PIPE_READ_ERR;
-  }
-  return SUCCESS;
+// writes replies in the protocol version in use on `fd`
+static int reply_wire(int fd, void *data, int n)
+{
+  return wire_write(fd, (Command *)data, n / MESSAGE_SIZE);
 }
 
+// Replies to ATMs go through `reply_write` so that an I/O backend can
+// queue them instead of writing them one by one.
+static int (*reply_write)(int fd, void *data, int n) = reply_wire;
+
+// The type of the last reply sent, for the outcome counters.
+static cmd_t reply_type;
+
 // Checks to make sure that the ATM id is a valid ID.
 
 static int check_valid_atm(int atmid)
@@ -113,18 +160,119 @@ static int check_valid_account(int accountid)
 void bank_open(int atm_cnt, int account_cnt)
 {
   atm_count = atm_cnt;
-  // Create the accounts:
-  accounts = (int *)malloc(sizeof(int) * account_cnt);
-  for (int i = 0; i < account_cnt; i++)
+  // Create the accounts, in the shared ledger if one is open:
+  int *shared = ledger_balances();
+  PagePlan plan;
+  if (pages_plan(&plan) < 0)
+    printf("bank: BANKSIM_PAGES should be malloc, small, thp or huge, and "
+           "BANKSIM_NUMA first-touch, interleave or local\n");
+  bool planned = getenv("BANKSIM_PAGES") || getenv("BANKSIM_NUMA");
+  if (shared)
+  {
+    accounts = shared;
+    for (int i = 0; i < account_cnt; i++)
+    {
+      accounts[i] = 0;
+    }
+    if (planned)
+      printf("bank: the balances are in the shared ledger; BANKSIM_PAGES and BANKSIM_NUMA do not apply\n");
+  }
+  else
   {
-    accounts[i] = 0;
+    plan.threads = eod_threads();
+    accounts = (int *)pages_alloc(sizeof(int) * (unsigned long)account_cnt,
+                                  &plan, &account_pages);
+    if (accounts == NULL)
+    {
+      printf("bank: no memory for %d accounts\n", account_cnt);
+      exit(EXIT_FAILURE);
+    }
+    if (planned)
+      printf("bank: %d accounts on %s pages, %lu of %lu MB huge, placed %s "
+             "on %d nodes, zeroed by %d threads in %.3f ms\n",
+             account_cnt, pages_name(account_pages.pages),
+             account_pages.huge_bytes >> 20, account_pages.bytes >> 20,
+             numa_name(account_pages.numa), account_pages.nodes,
+             account_pages.threads, account_pages.secs * 1e3);
   }
   account_count = account_cnt;
+  ledger_ready();
+
+  if (eod_rules(&eod_rules_in_force) < 0)
+    printf("bank: BANKSIM_EOD should be interest_bp,fee,min_balance; using defaults\n");
+  eod_thread_count = eod_threads();
+
+  VelocityLimits limits;
+  int limited = velocity_limits(&limits);
+  if (limited < 0)
+    printf("bank: BANKSIM_LIMITS should be count,amount,window_ms; no limits set\n");
+  velocity_open(limited > 0 ? &limits : NULL, account_cnt);
+
+  // velocity limits depend on the order legs are charged in
+  int threads = stm_threads();
+  stm_batches = limited <= 0 && threads > 1 && stm_open(threads) > 0;
+
+  int cap = history_cap();
+  if (cap < 0)
+    printf("bank: BANKSIM_HISTORY should be a number of entries; using %d\n",
+           cap = HISTORY_DEFAULT_CAP);
+  if (history_open(account_cnt, cap) < 0)
+    printf("bank: no memory for account history\n");
+
+  if (aggregate_open(accounts, account_cnt) < 0)
+    printf("bank: no memory for balance aggregates\n");
+
+  // ATMs reading the shared ledger look balances up by account number
+  int profile = relabel_profile_len();
+  if (profile < 0)
+    printf("bank: BANKSIM_RELABEL should be a number of commands; not relabeling\n");
+  else if (profile > 0 && shared)
+    printf("bank: not relabeling accounts, ATMs read the shared ledger\n");
+  else if (profile > 0 && relabel_open(account_cnt, profile) < 0)
+    printf("bank: no memory for the account profile\n");
 }
 
 // Closes a bank.
 
-void bank_close() { free(accounts); }
+void bank_close()
+{
+  long long held = 0;
+  for (int i = 0; i < account_count; ++i)
+    held += accounts[i];
+  stats_held(held);
+
+  changelog_close();
+  relabel_close();
+  stm_close();
+  stm_batches = false;
+  velocity_close();
+  history_close();
+  aggregate_close();
+  if (accounts == ledger_balances())
+    ledger_close();
+  else
+    pages_free(accounts, &account_pages);
+}
+
+// All balance changes go through here, so that ATMs reading balances
+// from the shared ledger never see one half-made, and so that the
+// aggregates follow every change.
+static void account_add(int acc, int delta)
+{
+  int slot = relabel_slot(acc);
+  ledger_write_begin(slot);
+  __atomic_store_n(&accounts[slot], accounts[slot] + delta, __ATOMIC_RELAXED);
+  ledger_write_end(slot);
+  PROBE3(apply, acc, delta, accounts[slot]);
+  changelog_append(acc, accounts[slot]);
+  aggregate_update(acc, delta);
+}
+
+// Returns the balance of an account, wherever relabeling put it.
+static int balance_of(int acc)
+{
+  return accounts[relabel_slot(acc)];
+}
 
 // Dumps out the accounts balances.
 
@@ -132,60 +280,107 @@ void bank_dump()
 {
   for (int i = 0; i < account_count; i++)
   {
-    printf("Account %d: %d\n", i, accounts[i]);
+    printf("Account %d: %d\n", i, balance_of(i));
   }
 }
 
+// An ATM speaking the compact protocol knows what it asked for, so on
+// its connection the replies that only echo the request leave the echo
+// out and come down to a status and an ATM id.
+static bool echo_dropped(int out)
+{
+  return wire_version(out) == PROTOCOL_V2;
+}
+
 // helper to prepare and send OK res
 static int OK_send(int out, int i, int initial, int final, int total)
 {
   Command outcome;
   MSG_OK(&outcome, i, initial, final, total);
-  int resultant = checked_write(out, &outcome, MESSAGE_SIZE);
+  reply_type = OK;
+  int resultant = reply_write(out, &outcome, MESSAGE_SIZE);
   return resultant == SUCCESS ? resultant : (error_print(), resultant);
 }
 
-// helper to prepare and send ACCUMKN response
-static int accunkun_send(int out, int initial, int final, int total)
+// helper to prepare and send ACCUMKN response. The ATM id is echoed
+// so an ATM process driving many logical ATMs can route the reply.
+static int accunkun_send(int out, int i, int initial, int final, int total)
 {
   Command outcome;
-  MSG_ACCUNKN(&outcome, 0, total);
-  int resultant = checked_write(out, &outcome, MESSAGE_SIZE);
+  MSG_ACCUNKN(&outcome, i, echo_dropped(out) ? -1 : total);
+  reply_type = ACCUNKN;
+  int resultant = reply_write(out, &outcome, MESSAGE_SIZE);
   return resultant == SUCCESS ? resultant : (error_print(), resultant);
 }
 
 // helper to prepare and send NOFUNDS response
-static int nofunds_send(int out, int initial, int final, int total)
+static int nofunds_send(int out, int i, int initial, int final, int total)
+{
+  Command outcome;
+  if (echo_dropped(out))
+    initial = total = -1;
+  MSG_NOFUNDS(&outcome, i, initial, total);
+  reply_type = NOFUNDS;
+  int resultant = reply_write(out, &outcome, MESSAGE_SIZE);
+  return resultant == SUCCESS ? resultant : (error_print(), resultant);
+}
+
+// helper to prepare and send LIMIT response
+static int limit_send(int out, int i, int initial, int total)
 {
   Command outcome;
-  MSG_NOFUNDS(&outcome, 0, initial, total);
-  int resultant = checked_write(out, &outcome, MESSAGE_SIZE);
+  if (echo_dropped(out))
+    initial = total = -1;
+  MSG_LIMIT(&outcome, i, initial, total);
+  reply_type = LIMIT;
+  int resultant = reply_write(out, &outcome, MESSAGE_SIZE);
   return resultant == SUCCESS ? resultant : (error_print(), resultant);
 }
 
+// helper to send the OK for a command whose reply only echoes it
+static int echo_send(int out, int i, int initial, int final, int total)
+{
+  if (echo_dropped(out))
+    initial = final = total = -1;
+  return OK_send(out, i, initial, final, total);
+}
+
 // helper to validate account for errors
-static bool is_acc_val(int id_no, int out, int initial, int final, int total, int *outcome)
+static bool is_acc_val(int id_no, int out, int i, int initial, int final, int total, int *outcome)
 {
   int auth = check_valid_account(id_no);
   bool is_correct = (auth == SUCCESS);
 
   *outcome = is_correct
                  ? SUCCESS
-                 : accunkun_send(out, initial, final, total);
+                 : accunkun_send(out, i, initial, final, total);
 
   return is_correct;
 }
 
-// // helper to manage Connection
-int conn_manage(int out, int i, int initial, int final)
+// // helper to manage Connection. An ATM asking for the compact
+// protocol gets it if its commands come through `read_command`; the
+// OK, still in the fixed format, says which version it got.
+int conn_manage(int out, int i, int initial, int final, int total)
 {
+  int version = -1;
+  if (total == PROTOCOL_V2)
+    version = command_fd >= 0 ? PROTOCOL_V2 : PROTOCOL_V1;
+
   Command res_ok;
-  MSG_OK(&res_ok, i, -1, -1, -1);
+  MSG_OK(&res_ok, i, -1, -1, version);
   cmd_dump("bank to atm", i, &res_ok);
-  printf("BANK: sending OK to ATM %d on fd %d\n", i, out);
+  log_printf("BANK: sending OK to ATM %d on fd %d\n", i, out);
+  reply_type = OK;
 
-  int outcome = checked_write(out, &res_ok, MESSAGE_SIZE);
+  int outcome = reply_write(out, &res_ok, MESSAGE_SIZE);
   bool succ = (outcome == SUCCESS);
+  if (succ && version == PROTOCOL_V2 &&
+      (wire_use(command_fd, version) < 0 || wire_use(out, version) < 0))
+  {
+    error_msg(ERR_PIPE_WRITE_ERR, "out of memory switching protocol");
+    error_print();
+  }
 
   return outcome ? SUCCESS : (error_print(), outcome);
 }
@@ -196,7 +391,7 @@ static int exit_manage(int out, int i, int initial, int final, int total, int *l
   int rem = --(*left);
   (void)rem;
 
-  int outcome = OK_send(out, i, initial, final, total);
+  int outcome = echo_send(out, i, initial, final, total);
   bool success = (outcome == SUCCESS);
 
   return success ? outcome : (error_print(), outcome);
@@ -205,10 +400,11 @@ static int exit_manage(int out, int i, int initial, int final, int total, int *l
 // helper to manage money deposition
 static int add_manage(int out, int i, int initial, int final, int total, int *outcome)
 {
-  bool val_acc = is_acc_val(final, out, initial, final, total, outcome);
+  bool val_acc = is_acc_val(final, out, i, initial, final, total, outcome);
 
   int resultant = val_acc
-                      ? (accounts[final] += total, OK_send(out, i, initial, final, total))
+                      ? (account_add(final, total), history_add(DEPOSIT, initial, final, total),
+                         echo_send(out, i, initial, final, total))
                       : *outcome;
 
   return resultant;
@@ -217,15 +413,18 @@ static int add_manage(int out, int i, int initial, int final, int total, int *ou
 // helper to manage money withdrawal
 static int minus_manage(int out, int i, int initial, int final, int total, int *outcome)
 {
-  bool val_acc = is_acc_val(initial, out, initial, final, total, outcome);
+  bool val_acc = is_acc_val(initial, out, i, initial, final, total, outcome);
   if (!val_acc)
     return *outcome;
 
-  bool has_funds = accounts[initial] >= total;
+  bool has_funds = balance_of(initial) >= total;
+  if (has_funds && !velocity_charge(initial, total))
+    return limit_send(out, i, initial, total);
 
   int resultant = has_funds
-                      ? (accounts[initial] -= total, OK_send(out, i, initial, final, total))
-                      : nofunds_send(out, initial, final, total);
+                      ? (account_add(initial, -total), history_add(WITHDRAW, initial, final, total),
+                         echo_send(out, i, initial, final, total))
+                      : nofunds_send(out, i, initial, final, total);
 
   return resultant;
 }
@@ -233,20 +432,23 @@ static int minus_manage(int out, int i, int initial, int final, int total, int *
 // helper to manage transfer of funds
 static int trans_manage(int out, int i, int initial, int final, int total, int *outcome)
 {
-  bool check_from = is_acc_val(initial, out, initial, final, total, outcome);
+  bool check_from = is_acc_val(initial, out, i, initial, final, total, outcome);
   if (!check_from)
     return *outcome;
 
-  bool check_to = is_acc_val(final, out, initial, final, total, outcome);
+  bool check_to = is_acc_val(final, out, i, initial, final, total, outcome);
   if (!check_to)
     return *outcome;
 
-  bool funds_enough = accounts[initial] >= total;
+  bool funds_enough = balance_of(initial) >= total;
+  if (funds_enough && !velocity_charge(initial, total))
+    return limit_send(out, i, initial, total);
 
   int resultant = funds_enough
-                      ? (accounts[initial] -= total,
-                         accounts[final] += total, OK_send(out, i, initial, final, total))
-                      : nofunds_send(out, initial, final, total);
+                      ? (account_add(initial, -total),
+                         account_add(final, total), history_add(TRANSFER, initial, final, total),
+                         echo_send(out, i, initial, final, total))
+                      : nofunds_send(out, i, initial, final, total);
 
   return resultant;
 }
@@ -254,8 +456,8 @@ static int trans_manage(int out, int i, int initial, int final, int total, int *
 // helper to manage inquiry of balance
 static int left_money_check(int out, int i, int initial, int final, int total, int *outcome)
 {
-  bool is_ok = is_acc_val(initial, out, initial, final, total, outcome);
-  int rem = accounts[initial];
+  bool is_ok = is_acc_val(initial, out, i, initial, final, total, outcome);
+  int rem = is_ok ? balance_of(initial) : 0;
 
   int resultant = is_ok
                       ? OK_send(out, i, initial, final, rem)
@@ -264,12 +466,330 @@ static int left_money_check(int out, int i, int initial, int final, int total, i
   return resultant;
 }
 
+// helper to run the end-of-day job. No other command is taken while
+// it sweeps the accounts, and ATMs reading the shared ledger wait for
+// it to finish.
+static int eod_manage(int out, int i)
+{
+  EodTotals totals;
+  ledger_write_all_begin();
+  eod_sweep(accounts, account_count, &eod_rules_in_force, eod_thread_count, &totals);
+  ledger_write_all_end();
+  aggregate_rebuild();
+  for (int acc = 0; acc < account_count; ++acc)
+    changelog_append(acc, balance_of(acc));
+
+  printf("bank: end of day over %d accounts in %.3f ms (%.0f accounts/s, %d threads): "
+         "interest %lld, fees %lld\n",
+         totals.accounts, totals.secs * 1e3, totals.accounts / totals.secs,
+         totals.threads, totals.interest, totals.fees);
+  fflush(stdout);
+
+  return OK_send(out, i, -1, totals.accounts, -1);
+}
+
+// helper to send the last entries of an account's history
+static int statement_manage(int out, int i, int initial, int final, int total, int *outcome)
+{
+  static Command entries[STATEMENT_MAX_ENTRIES];
+
+  if (!is_acc_val(initial, out, i, initial, final, total, outcome))
+    return *outcome;
+
+  int wanted = total < 0 ? 0 : total > STATEMENT_MAX_ENTRIES ? STATEMENT_MAX_ENTRIES : total;
+  int got = history_last(initial, wanted, entries);
+
+  // the entries are a message of their own, as a batch's bitmap is
+  int resultant = OK_send(out, i, initial, got, balance_of(initial));
+  if (resultant == SUCCESS && got > 0)
+  {
+    resultant = reply_write(out, entries, got * MESSAGE_SIZE);
+    if (resultant != SUCCESS)
+      error_print();
+  }
+  return resultant;
+}
+
+// helper to send the accounts with the largest balances
+static int topk_manage(int out, int i, int total)
+{
+  static int top[TOPK_MAX];
+  static Command entries[TOPK_MAX];
+
+  int wanted = total < 0 ? 0 : total > TOPK_MAX ? TOPK_MAX : total;
+  int got = aggregate_top(wanted, top);
+  for (int k = 0; k < got; k++)
+  {
+    MSG_OK(&entries[k], k, top[k], -1, balance_of(top[k]));
+  }
+
+  int resultant = OK_send(out, i, -1, got, -1);
+  if (resultant == SUCCESS && got > 0)
+  {
+    resultant = reply_write(out, entries, got * MESSAGE_SIZE);
+    if (resultant != SUCCESS)
+      error_print();
+  }
+  return resultant;
+}
+
+// helper to send the total balance of a range of accounts
+static int rangesum_manage(int out, int i, int initial, int final, int total, int *outcome)
+{
+  if (!is_acc_val(initial, out, i, initial, final, total, outcome) ||
+      !is_acc_val(final, out, i, initial, final, total, outcome))
+    return *outcome;
+  if (initial > final)
+  {
+    error_msg(ERR_UNKNOWN_ACCOUNT, "empty account range");
+    return accunkun_send(out, i, initial, final, total);
+  }
+
+  long long sum = aggregate_range_sum(initial, final);
+  return OK_send(out, i, (int)(sum >> 32), (int)(unsigned)sum, final - initial + 1);
+}
+
+// helper to apply one leg of a batch, returning the reply type the
+// leg would have had as a command of its own
+static cmd_t leg_apply(Command *leg, int *undo_acc, int *undo_amt, int *undo_cnt)
+{
+  cmd_t c;
+  int i, f, t, a;
+  cmd_unpack(leg, &c, &i, &f, &t, &a);
+
+  bool from_ok = 0 <= f && f < account_count;
+  bool to_ok = 0 <= t && t < account_count;
+
+  switch (c)
+  {
+  case DEPOSIT:
+    if (!to_ok)
+      return ACCUNKN;
+    account_add(t, a);
+    undo_acc[*undo_cnt] = t, undo_amt[(*undo_cnt)++] = a;
+    return OK;
+
+  case WITHDRAW:
+    if (!from_ok)
+      return ACCUNKN;
+    if (balance_of(f) < a)
+      return NOFUNDS;
+    if (!velocity_charge(f, a))
+      return LIMIT;
+    account_add(f, -a);
+    undo_acc[*undo_cnt] = f, undo_amt[(*undo_cnt)++] = -a;
+    return OK;
+
+  case TRANSFER:
+    if (!from_ok || !to_ok)
+      return ACCUNKN;
+    if (balance_of(f) < a)
+      return NOFUNDS;
+    if (!velocity_charge(f, a))
+      return LIMIT;
+    account_add(f, -a);
+    account_add(t, a);
+    undo_acc[*undo_cnt] = f, undo_amt[(*undo_cnt)++] = -a;
+    undo_acc[*undo_cnt] = t, undo_amt[(*undo_cnt)++] = a;
+    return OK;
+
+  default:
+    // only money movements may be batched
+    return ACCUNKN;
+  }
+}
+
+// helper to commit one leg of a batch whose outcome has been worked
+// out already, returning that outcome
+static cmd_t leg_commit(Command *leg, cmd_t outcome)
+{
+  cmd_t c;
+  int i, f, t, a;
+  cmd_unpack(leg, &c, &i, &f, &t, &a);
+  if (outcome != OK)
+    return outcome;
+  if (c == DEPOSIT)
+    account_add(t, a);
+  else
+    account_add(f, -a);
+  if (c == TRANSFER)
+    account_add(t, a);
+  return OK;
+}
+
+// helper to manage a batch of legs, which follow the BATCH command in
+// memory. All legs are applied in one pass; an atomic batch that hits
+// a failing leg is rolled back from the undo log. Long batches are
+// first worked out speculatively on several threads, which leaves only
+// the commits to do here, in order, and tells an atomic batch that it
+// fails before anything is applied.
+static int batch_manage(int out, int i, int legs, int mode, Command *leg)
+{
+  static int undo_acc[2 * BATCH_MAX_LEGS];
+  static int undo_amt[2 * BATCH_MAX_LEGS];
+  static cmd_t outcome[BATCH_MAX_LEGS];
+  unsigned bits[3 * BATCH_FRAMES(BATCH_MAX_LEGS)] = {0};
+  int undo_cnt = 0;
+
+  cmd_t status = OK;
+  int failed = -1;
+  int applied = 0;
+
+  bool worked_out = stm_batches && legs >= STM_MIN_LEGS &&
+                    stm_run(leg, legs, accounts, account_count, outcome) > 0;
+  for (int k = 0; worked_out && mode == BATCH_ATOMIC && k < legs; k++)
+  {
+    if (outcome[k] != OK)
+    {
+      status = outcome[k];
+      failed = k;
+      break;
+    }
+  }
+
+  for (int k = 0; k < legs && failed < 0; k++)
+  {
+    cmd_t leg_status = worked_out ? leg_commit(&leg[k], outcome[k])
+                                  : leg_apply(&leg[k], undo_acc, undo_amt, &undo_cnt);
+    if (leg_status == OK)
+    {
+      bits[k / 32] |= 1u << (k % 32);
+      applied++;
+    }
+    else if (mode == BATCH_ATOMIC)
+    {
+      status = leg_status;
+      failed = k;
+      break;
+    }
+  }
+
+  if (status != OK)
+  {
+    while (undo_cnt > 0)
+    {
+      undo_cnt--;
+      account_add(undo_acc[undo_cnt], -undo_amt[undo_cnt]);
+      // debits are the legs the velocity limits counted
+      if (undo_amt[undo_cnt] < 0)
+        velocity_refund(undo_acc[undo_cnt], -undo_amt[undo_cnt]);
+    }
+    memset(bits, 0, sizeof(bits));
+    applied = 0;
+  }
+  else
+  {
+    for (int k = 0; k < legs; k++)
+    {
+      if (bits[k / 32] & (1u << (k % 32)))
+      {
+        cmd_t c;
+        int id, f, t, a;
+        cmd_unpack(&leg[k], &c, &id, &f, &t, &a);
+        history_add(c, f, t, a);
+      }
+    }
+  }
+
+  Command reply[1 + BATCH_FRAMES(BATCH_MAX_LEGS)];
+  cmd_pack(&reply[0], status, i, legs, applied, failed);
+  int frames = BATCH_FRAMES(legs);
+  for (int j = 0; j < frames; j++)
+  {
+    MSG_OK(&reply[1 + j], i, bits[3 * j], bits[3 * j + 1], bits[3 * j + 2]);
+  }
+  reply_type = status;
+
+  // the header and the bitmap are separate messages, as the legs are
+  int resultant = reply_write(out, &reply[0], MESSAGE_SIZE);
+  if (resultant == SUCCESS)
+    resultant = reply_write(out, &reply[1], frames * MESSAGE_SIZE);
+  return resultant == SUCCESS ? resultant : (error_print(), resultant);
+}
+
 // The `bank` function processes commands received from an ATM.  It
 // processes the commands and makes the appropriate changes to the
 // designated accounts if necessary.  For example, if it receives a
 // DEPOSIT message it will update the `to` account with the deposit
 // amount.  It then communicates back to the ATM with success or
-// failure.
+// failure. The frames that follow a command on the wire (see
+// `cmd_tail_frames`) must follow it in memory as well.
+
+// set by SIGUSR1 to ask for a snapshot of the accounts
+static volatile sig_atomic_t snapshot_requested = 0;
+
+static void note_snapshot(int sig)
+{
+  (void)sig;
+  snapshot_requested = 1;
+}
+
+// Takes a snapshot if one was asked for. This is called between
+// commands, where the accounts are consistent.
+static void snapshot_if_requested()
+{
+  if (!snapshot_requested)
+    return;
+  snapshot_requested = 0;
+  bool shared = accounts == ledger_balances();
+  snapshot_take(accounts, account_count, shared, io_transactions);
+}
+
+// Lets SIGUSR1 ask for snapshots. It interrupts a waiting poll, so an
+// idle bank takes the snapshot right away; reads and writes it
+// interrupts are restarted.
+static void set_up_snapshots()
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = note_snapshot;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  printf("bank: pid %d, send SIGUSR1 for a snapshot\n", (int)getpid());
+  fflush(stdout);
+}
+
+// helper to count the accounts a command touches while the relabeling
+// profile is taken, and to pack the hottest accounts together once it
+// is complete
+static void relabel_profile(cmd_t c, int f, int t, Command *leg)
+{
+  if (!relabel_profiling())
+    return;
+
+  if (c == BATCH)
+  {
+    for (int k = 0; k < f && k < BATCH_MAX_LEGS; k++)
+    {
+      cmd_t lc;
+      int li, lf, lt, la;
+      cmd_unpack(&leg[k], &lc, &li, &lf, &lt, &la);
+      relabel_count(lc == DEPOSIT ? lt : lf);
+      if (lc == TRANSFER)
+        relabel_count(lt);
+    }
+  }
+  else if (c == DEPOSIT || c == WITHDRAW || c == TRANSFER || c == BALANCE || c == STATEMENT)
+  {
+    relabel_count(c == DEPOSIT ? t : f);
+    if (c == TRANSFER)
+      relabel_count(t);
+  }
+  if (!relabel_command())
+    return;
+
+  // a snapshot being written reads the balances where they are
+  snapshot_finish();
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  double share = 0;
+  int hot = relabel_build(accounts, &share);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("bank: relabeled %d hot accounts to the front in %.3f ms; they had %.1f%% of the uses\n",
+         hot, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+         share * 100);
+  fflush(stdout);
+}
 
 int bank(int atm_out_fd[], Command *cmd, int *atms_remaining)
 {
@@ -277,17 +797,25 @@ int bank(int atm_out_fd[], Command *cmd, int *atms_remaining)
   int i, f, t, a;
   Command bankcmd;
 
+  snapshot_if_requested();
   cmd_unpack(cmd, &c, &i, &f, &t, &a);
   cmd_dump("bank rec from atm", i, cmd);
+  io_transactions++;
+  relabel_profile(c, f, t, cmd + 1);
 
   // int result = SUCCESS;
 
   // TODO: your code here
   int result = check_valid_atm(i);
   if (result != SUCCESS)
+  {
+    stats_count(STATS_BANK, c, ATMUNKN);
     return ERR_UNKNOWN_ATM;
+  }
 
   int out = atm_out_fd[i];
+  stats_served(i);
+  PROBE5(dispatch, i, c, f, t, a);
 
   switch (c)
   {
@@ -300,7 +828,7 @@ int bank(int atm_out_fd[], Command *cmd, int *atms_remaining)
     break;
 
   case CONNECT:
-    result = conn_manage(out, i, f, t);
+    result = conn_manage(out, i, f, t, a);
     break;
 
   case TRANSFER:
@@ -315,11 +843,35 @@ int bank(int atm_out_fd[], Command *cmd, int *atms_remaining)
     result = add_manage(out, i, f, t, a, &result);
     break;
 
+  case BATCH:
+    result = batch_manage(out, i, f, t, cmd + 1);
+    break;
+
+  case EOD:
+    result = eod_manage(out, i);
+    break;
+
+  case STATEMENT:
+    result = statement_manage(out, i, f, t, a, &result);
+    break;
+
+  case TOPK:
+    result = topk_manage(out, i, a);
+    break;
+
+  case RANGESUM:
+    result = rangesum_manage(out, i, f, t, a, &result);
+    break;
+
   default:
     error_msg(ERR_UNKNOWN_CMD, "invalid cmd received");
     result = ERR_UNKNOWN_CMD;
   }
 
+  stats_count(STATS_BANK, c, result == SUCCESS ? reply_type : (cmd_t)-1);
+  PROBE4(reply, i, c, reply_type, result);
+  if (result == SUCCESS && (c == CONNECT || c == EXIT))
+    stats_active(c == CONNECT ? 1 : -1);
   return result;
 }
 
@@ -327,12 +879,94 @@ static int scanner = -1; // this scans ATMs circularly, for fairness
 
 static struct pollfd *pollfds; // the fds and conditions to await
 
+static int poll_count = 0; // the number of entries in pollfds
+
+static int ready_left = 0; // fds found ready by the last poll not yet served
+
+// set by SIGINT/SIGTERM to ask a bank server to shut down
+static volatile sig_atomic_t stop_requested = 0;
+
+// With BANKSIM_IDLE_MS set, every ATM slot has a timer that each
+// command from it re-arms. An ATM that sends nothing for that long is
+// sent a TIMEOUT and dropped, so a hung ATM cannot hold its slot, or
+// keep the bank from finishing, forever.
+static int idle_ms = 0;
+
+static TimerWheel idle_wheel; // ticks are CLOCK_MONOTONIC milliseconds
+
+static Timer *idle_timers = NULL; // one per slot
+
+static unsigned long long idle_clock; // the time of the last poll, in ms
+
+// find_ready_atm returns this when an idle timer may have expired
+#define IDLE_CHECK -2
+
+static unsigned long long clock_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void set_up_idle(int slots)
+{
+  char *eval = getenv("BANKSIM_IDLE_MS");
+  idle_ms = eval ? atoi(eval) : 0;
+  if (idle_ms <= 0)
+  {
+    idle_ms = 0;
+    return;
+  }
+
+  idle_timers = (Timer *)malloc(sizeof(Timer) * slots);
+  idle_clock = clock_ms();
+  timer_wheel_init(&idle_wheel, idle_clock);
+  for (int i = 0; i < slots; ++i)
+    timer_init(&idle_timers[i], i);
+}
+
+static void tear_down_idle()
+{
+  free(idle_timers);
+  idle_timers = NULL;
+  idle_ms = 0;
+}
+
+// restarts the idle timer of a slot. The clock is read once per poll
+// round, not once per command.
+static void idle_touch(int slot)
+{
+  if (idle_ms)
+    timer_arm(&idle_wheel, &idle_timers[slot], idle_clock + idle_ms);
+}
+
+static void idle_forget(int slot)
+{
+  if (idle_ms)
+    timer_cancel(&idle_wheel, &idle_timers[slot]);
+}
+
+// returns the slots whose timers expired, chained by next
+static Timer *idle_expired()
+{
+  return idle_ms ? timer_advance(&idle_wheel, clock_ms()) : NULL;
+}
+
+static int idle_timeout_send(int fd, int atm)
+{
+  Command res;
+  MSG_TIMEOUT(&res, atm);
+  stats_count(STATS_BANK, TIMEOUT, TIMEOUT);
+  return wire_write(fd, &res, 1);
+}
+
 // sets up an fd_set holding the fds on which we may receive
 // messages from ATMs
 static void set_up_poll(int bank_in_fd[])
 {
-  pollfds = (struct pollfd *)(malloc(sizeof(struct pollfd) * atm_count));
-  for (int i = 0; i < atm_count; ++i)
+  poll_count = chan_count;
+  pollfds = (struct pollfd *)(malloc(sizeof(struct pollfd) * poll_count));
+  for (int i = 0; i < poll_count; ++i)
   {
     pollfds[i].fd = bank_in_fd[i];
     pollfds[i].events = POLLIN; // Note: can also return POLLHUP
@@ -345,71 +979,178 @@ static void set_up_poll(int bank_in_fd[])
 static void note_atm_closed(int atm, int bank_in_fd[])
 {
   pollfds[atm].fd = -1; // causes poll to ignore it
+  wire_forget(bank_in_fd[atm]);
   close(bank_in_fd[atm]);
 }
 
+// marks the fds with compact messages waiting in their buffers as
+// ready and returns how many there are
+static int mark_buffered()
+{
+  int n = 0;
+  for (int j = 0; j < poll_count; ++j)
+  {
+    if (pollfds[j].fd >= 0 && wire_buffered(pollfds[j].fd))
+    {
+      pollfds[j].revents = POLLIN;
+      n++;
+    }
+  }
+  return n;
+}
+
+// With fair scheduling, the ms until a queued command can be served,
+// or -1 if none is queued (see `run_bank_fair`)
+static long fair_wait = -1;
+
+// how long find_ready_atm may wait for input: until the next idle
+// timer or queued command is due, or for ever
+static int poll_timeout()
+{
+  long wait = idle_ms ? timer_wait(&idle_wheel) : -1;
+  if (fair_wait >= 0 && (wait < 0 || fair_wait < wait))
+    wait = fair_wait;
+  return (int)wait;
+}
+
 // Using scanner as a roving number of an ATM to check for input,
 // tries to find a fd whose bit is set in in_fds and return the
-// corresponding ATM number.
+// corresponding ATM number. Every fd found ready by one poll is
+// served once before polling again, so a busy bank makes one poll
+// call per round of ready ATMs rather than one per command.
 static int find_ready_atm()
 {
   while (1)
   {
-    int result = poll(pollfds, atm_count, -1);
+    // find next ready one circularly
+    for (int j = poll_count; ready_left > 0 && --j >= 0;)
+    {
+      ++scanner;
+      scanner %= poll_count;
+      if (pollfds[scanner].revents)
+      {
+        // some event happened on this fd
+        pollfds[scanner].revents = 0;
+        ready_left--;
+        return scanner;
+      }
+    }
+    if (ready_left > 0)
+    {
+      // if we get here, we checked poll_count fds, so there is a problem
+      printf("find_ready_atm: no ready fd when there should be one\n");
+      ready_left = 0;
+    }
+
+    // compact messages already read in are served before polling, as
+    // poll cannot see them
+    if (wire_backlog() > 0 && (ready_left = mark_buffered()) > 0)
+      continue;
+
+    // replicas see the changes made so far before the bank waits
+    changelog_publish();
+    int result = poll(pollfds, poll_count, poll_timeout());
+    io_syscalls++;
+    if (idle_ms)
+      idle_clock = clock_ms();
 
     if (result < 0)
     {
+      // a bank server is interrupted by the signal asking it to stop
+      if (errno == EINTR)
+      {
+        if (stop_requested)
+          return result;
+        snapshot_if_requested();
+        continue;
+      }
+
       // error value returned by select
       printf("poll had an error ... stopping\n");
       return result;
     }
 
-    if (result == 0)
-    {
-      // returned "early" -- ignore
-      continue;
-    }
-
-    // at least one fd ready; find next one circularly
-    for (int j = atm_count; --j >= 0;)
+    // result == 0 means poll returned "early" -- nothing to serve,
+    // but an idle timer or a rate-limited command may be due
+    if (result == 0 && (idle_ms || fair_wait >= 0))
+      return IDLE_CHECK;
+    ready_left = result;
+    if (result > 0)
     {
-      ++scanner;
-      scanner %= atm_count;
-      if (pollfds[scanner].revents)
-      {
-        // some event happened on this fd
-        return scanner;
-      }
+      PROBE1(wakeup, result);
+      stats_wakeup(result);
     }
-    // if we get here, we checked atm_count fds, so there is a problem
-    printf("find_ready_atm: no ready fd when there should be one\n");
   }
 }
 
-// This simply repeatedly tries to read another command from the
-// bank input fd (coming from any of the atms) and calls the bank
-// function to process the message and develop and send a reply.
-// It stops when there are no active atms.
-
-int run_bank(int bank_in_fd[], int atm_out_fd[])
+// These are used just for benchmarking: they run `find_ready_atm`
+// over `chan_cnt` descriptors without the rest of the bank loop.
+void bench_poll_open(int chan_cnt, int bank_in_fd[])
 {
-  Command cmd;
+  chan_count = chan_cnt;
+  scanner = -1;
+  ready_left = 0;
+  set_up_poll(bank_in_fd);
+}
 
+int bench_find_ready_atm() { return find_ready_atm(); }
+
+void bench_poll_close()
+{
+  free(pollfds);
+  pollfds = NULL;
+  poll_count = 0;
+  chan_count = 0;
+}
+
+// drops the ATMs whose idle timers expired, as if they had sent EXIT.
+// Idle eviction needs one ATM per channel, so the TIMEOUT reaches the
+// ATM that hung and no other.
+static void evict_idle_atms(int bank_in_fd[], int atm_out_fd[], int *atms_remaining)
+{
+  for (Timer *t = idle_expired(); t != NULL; t = t->next)
+  {
+    int atm = t->id;
+    printf("bank: ATM %d idle for %d ms, dropping it\n", atm, idle_ms);
+    idle_timeout_send(atm_out_fd[atm], atm);
+    note_atm_closed(atm, bank_in_fd);
+    (*atms_remaining)--;
+  }
+}
+
+// This simply repeatedly tries to read another command from the
+// bank input fd (coming from any of the atms) and calls the bank
+// function to process the message and develop and send a reply.
+// It stops when there are no active atms.
+
+static int run_bank_poll(int bank_in_fd[], int atm_out_fd[])
+{
   int result = 0;
   int atms_remaining = atm_count;
 
   set_up_poll(bank_in_fd);
+  if (chan_count == atm_count)
+    set_up_idle(chan_count);
+  for (int i = 0; i < chan_count; ++i)
+    idle_touch(i);
 
   while (atms_remaining != 0)
   {
+    evict_idle_atms(bank_in_fd, atm_out_fd, &atms_remaining);
+    if (atms_remaining == 0)
+      break;
+
     int found = find_ready_atm();
+    if (found == IDLE_CHECK)
+      continue;
     if (found < 0)
       return found;
 
     // read input from (apparently) ready atm
-    result = checked_read(bank_in_fd[found], &cmd, MESSAGE_SIZE);
+    result = read_command(bank_in_fd[found]);
     if (result == ERR_ATM_CLOSED)
     {
+      idle_forget(found);
       note_atm_closed(found, bank_in_fd);
       continue;
     }
@@ -417,7 +1158,16 @@ int run_bank(int bank_in_fd[], int atm_out_fd[])
     if (result != SUCCESS)
       return result;
 
-    result = bank(atm_out_fd, &cmd, &atms_remaining);
+    // an ATM that has exited must not time out before its pipe closes
+    cmd_t c;
+    int i, f, t, a;
+    cmd_unpack(frames, &c, &i, &f, &t, &a);
+    if (c == EXIT)
+      idle_forget(found);
+    else
+      idle_touch(found);
+
+    result = bank(atm_out_fd, frames, &atms_remaining);
 
     if (result == ERR_UNKNOWN_ATM)
     {
@@ -434,3 +1184,666 @@ int run_bank(int bank_in_fd[], int atm_out_fd[])
 
   return SUCCESS;
 }
+
+// With BANKSIM_FAIR set, the bank reads every command that has
+// arrived on a ready channel into a queue per channel, and serves the
+// queues in the order fair.h lays down: by priority class, then deficit
+// round-robin by weight, within the rate limits. Replies to a channel
+// still go out in the order its commands came in, which an ATM worker
+// driving several logical ATMs relies on, so the weights and rates are
+// those of a channel, that is, of an ATM unless workers are used.
+
+// commands read from a channel at a time, so that one flooding ATM
+// cannot keep the bank reading
+#define FAIR_DRAIN 64
+
+// commands served between looks for new ones
+#define FAIR_BURST 8
+
+// reads the commands waiting on a channel into its queue
+static int fair_intake(int chan, int bank_in_fd[])
+{
+  int fd = bank_in_fd[chan];
+  int avail = 0; // bytes known to be waiting on fd
+  // a channel found ready has at least one command. Only one that is
+  // sending faster than it is served is drained, so a closed-loop ATM,
+  // which waits for each reply, costs no extra system call.
+  int drain = fair_waiting(chan) > 0 ? FAIR_DRAIN : 1;
+  for (int n = 0; n < drain || (n < FAIR_DRAIN && wire_buffered(fd)); ++n)
+  {
+    // after the first command, only read what is there, so as not to
+    // block
+    if (n > 0 && !wire_buffered(fd) && avail < (int)MESSAGE_SIZE)
+    {
+      io_syscalls++;
+      if (ioctl(fd, FIONREAD, &avail) < 0 || avail == 0)
+        break;
+    }
+
+    int result = read_command(fd);
+    if (result == ERR_ATM_CLOSED)
+    {
+      idle_forget(chan);
+      note_atm_closed(chan, bank_in_fd);
+      return SUCCESS;
+    }
+    if (result != SUCCESS)
+      return result;
+
+    // an ATM that has exited must not time out before its pipe closes
+    cmd_t c;
+    int i, f, t, a;
+    cmd_unpack(frames, &c, &i, &f, &t, &a);
+    if (c == EXIT)
+      idle_forget(chan);
+    else
+      idle_touch(chan);
+
+    // compact messages vary in length, so what is left is unknown
+    int tail = cmd_tail_frames(frames);
+    avail = wire_version(fd) == PROTOCOL_V1 ? avail - MESSAGE_SIZE * (1 + tail) : 0;
+
+    if (fair_push(chan, frames, tail) < 0)
+    {
+      error_msg(ERR_PIPE_READ_ERR, "no memory to queue a command");
+      return ERR_PIPE_READ_ERR;
+    }
+  }
+  return SUCCESS;
+}
+
+static int run_bank_fair(int bank_in_fd[], int atm_out_fd[])
+{
+  int result = SUCCESS;
+  int atms_remaining = atm_count;
+
+  set_up_poll(bank_in_fd);
+  if (chan_count == atm_count)
+    set_up_idle(chan_count);
+  for (int i = 0; i < chan_count; ++i)
+    idle_touch(i);
+
+  while (atms_remaining != 0)
+  {
+    // serve what the queues allow, once every ready channel is read
+    for (int n = 0; ready_left == 0 && n < FAIR_BURST; ++n)
+    {
+      int chan;
+      Command *cmd = fair_pop(&chan);
+      if (cmd == NULL)
+        break;
+      // a CONNECT switches the protocol of the fd it came in on
+      command_fd = bank_in_fd[chan];
+      result = bank(atm_out_fd, cmd, &atms_remaining);
+      if (result == ERR_UNKNOWN_ATM)
+        printf("received message from unknown ATM. Ignoring...\n");
+      else if (result != SUCCESS)
+        break;
+    }
+    if (result != SUCCESS && result != ERR_UNKNOWN_ATM)
+      break;
+
+    evict_idle_atms(bank_in_fd, atm_out_fd, &atms_remaining);
+    if (atms_remaining == 0)
+      break;
+
+    fair_wait = fair_wait_ms();
+    int found = find_ready_atm();
+    if (found == IDLE_CHECK)
+      continue;
+    if (found < 0)
+    {
+      result = found;
+      break;
+    }
+
+    result = fair_intake(found, bank_in_fd);
+    if (result != SUCCESS)
+      break;
+  }
+
+  fair_wait = -1;
+  fair_print();
+  return atms_remaining == 0 ? SUCCESS : result;
+}
+
+// The io_uring backend keeps a read posted on every bank_in_fd and
+// collects the replies produced while reaping one batch of
+// completions into a per-ATM outbox, which is then written with a
+// single request. Submitting the reposted reads and the reply writes
+// and waiting for the next batch is one io_uring_enter call, so under
+// load the bank makes far fewer than one system call per transaction.
+
+#define URING_READ (1ULL << 32)
+#define URING_WRITE (2ULL << 32)
+#define URING_MAX_ENTRIES 32768
+
+// Replies waiting to be written to one ATM. The first `inflight` bytes
+// have been handed to the kernel; anything after them is queued.
+typedef struct outbox
+{
+  byte *buf;
+  int len;
+  int cap;
+  int inflight;
+  bool dirty;
+} Outbox;
+
+static Uring ring;
+
+static Command **in_cmd; // the command being read from each channel
+
+static int *in_cap; // frames in_cmd has room for
+
+static int *in_got; // bytes of in_cmd received so far
+
+static int *in_need; // bytes in_cmd needs, growing if it has a tail
+
+static Outbox *outboxes; // indexed by ATM output fd
+
+static int outbox_count = 0;
+
+static int *dirty_fds; // outboxes with unsent replies
+
+static int dirty_count = 0;
+
+static int writes_pending = 0; // outboxes holding bytes not yet written
+
+static void mark_dirty(int fd)
+{
+  if (!outboxes[fd].dirty)
+  {
+    outboxes[fd].dirty = true;
+    dirty_fds[dirty_count++] = fd;
+  }
+}
+
+// queues a reply in the outbox of fd instead of writing it
+static int uring_reply(int fd, void *data, int n)
+{
+  Outbox *box = &outboxes[fd];
+  if (box->len + n > box->cap)
+  {
+    box->cap = 2 * (box->len + n);
+    box->buf = (byte *)realloc(box->buf, box->cap);
+  }
+  memcpy(box->buf + box->len, data, n);
+  if (box->len == 0)
+    writes_pending++;
+  box->len += n;
+  if (box->inflight == 0)
+    mark_dirty(fd);
+  return SUCCESS;
+}
+
+// queues a request, submitting what is queued if the ring is full
+static void uring_queue(int write, int fd, void *buf, int n,
+                        unsigned long long data)
+{
+  while ((write ? uring_prep_write(&ring, fd, buf, n, data)
+                : uring_prep_read(&ring, fd, buf, n, data)) < 0)
+  {
+    uring_submit(&ring, 0);
+  }
+}
+
+static void post_read(int atm, int bank_in_fd[])
+{
+  uring_queue(0, bank_in_fd[atm], (byte *)in_cmd[atm] + in_got[atm],
+              in_need[atm] - in_got[atm], URING_READ | atm);
+}
+
+// starts one write per ATM with queued replies
+static void flush_replies()
+{
+  for (int j = 0; j < dirty_count; ++j)
+  {
+    int fd = dirty_fds[j];
+    Outbox *box = &outboxes[fd];
+    box->dirty = false;
+    if (box->inflight == 0 && box->len > 0)
+    {
+      box->inflight = box->len;
+      uring_queue(1, fd, box->buf, box->len, URING_WRITE | fd);
+    }
+  }
+  dirty_count = 0;
+}
+
+// handles a finished reply write, keeping anything queued behind it
+static int reply_written(int fd, int res)
+{
+  Outbox *box = &outboxes[fd];
+  if (res < 0)
+  {
+    error_msg(ERR_PIPE_WRITE_ERR, "could not write message to atm");
+    return ERR_PIPE_WRITE_ERR;
+  }
+
+  io_bytes += res;
+  box->len -= res;
+  memmove(box->buf, box->buf + res, box->len);
+  box->inflight = 0;
+  if (box->len > 0)
+    mark_dirty(fd);
+  else
+    writes_pending--;
+  return SUCCESS;
+}
+
+static int set_up_uring(int bank_in_fd[], int atm_out_fd[])
+{
+  unsigned entries = 2 * chan_count + 2;
+  if (entries > URING_MAX_ENTRIES)
+    entries = URING_MAX_ENTRIES;
+  if (uring_init(&ring, entries) < 0)
+    return -1;
+
+  int max_fd = 0;
+  for (int i = 0; i < atm_count; ++i)
+  {
+    if (atm_out_fd[i] > max_fd)
+      max_fd = atm_out_fd[i];
+  }
+
+  in_cmd = (Command **)calloc(chan_count, sizeof(Command *));
+  in_cap = (int *)calloc(chan_count, sizeof(int));
+  in_got = (int *)calloc(chan_count, sizeof(int));
+  in_need = (int *)malloc(sizeof(int) * chan_count);
+  outbox_count = max_fd + 1;
+  outboxes = (Outbox *)calloc(outbox_count, sizeof(Outbox));
+  dirty_fds = (int *)malloc(sizeof(int) * outbox_count);
+  reply_write = uring_reply;
+  // commands come in through the ring, so ATMs keep the fixed format
+  command_fd = -1;
+
+  for (int i = 0; i < chan_count; ++i)
+  {
+    frames_fit(&in_cmd[i], &in_cap[i], 1);
+    in_need[i] = MESSAGE_SIZE;
+    post_read(i, bank_in_fd);
+  }
+  return 0;
+}
+
+static void tear_down_uring()
+{
+  uring_exit(&ring);
+  io_syscalls += ring.enters;
+  reply_write = reply_wire;
+
+  for (int fd = 0; fd < outbox_count; ++fd)
+  {
+    free(outboxes[fd].buf);
+  }
+  free(outboxes);
+  free(dirty_fds);
+  for (int i = 0; i < chan_count; ++i)
+  {
+    free(in_cmd[i]);
+  }
+  free(in_cmd);
+  free(in_cap);
+  free(in_got);
+  free(in_need);
+}
+
+// handles a finished read from an ATM, running the bank on a complete
+// command and posting the next read
+static int command_read(int atm, int res, int bank_in_fd[], int atm_out_fd[],
+                        int *atms_remaining)
+{
+  if (res == 0)
+  {
+    close(bank_in_fd[atm]);
+    return SUCCESS;
+  }
+
+  if (res < 0)
+  {
+    error_msg(ERR_PIPE_READ_ERR, "could not read message from atm");
+    return ERR_PIPE_READ_ERR;
+  }
+
+  in_got[atm] += res;
+  io_bytes += res;
+
+  // once the header is in, the read grows to take the frames after it
+  int tail = in_got[atm] == MESSAGE_SIZE ? cmd_tail_frames(in_cmd[atm]) : 0;
+  if (tail < 0)
+  {
+    error_msg(ERR_UNKNOWN_CMD, "malformed command received");
+    return ERR_UNKNOWN_CMD;
+  }
+  if (tail > 0 && in_need[atm] == MESSAGE_SIZE)
+  {
+    frames_fit(&in_cmd[atm], &in_cap[atm], 1 + tail);
+    in_need[atm] = (1 + tail) * MESSAGE_SIZE;
+  }
+
+  if (in_got[atm] == in_need[atm])
+  {
+    PROBE2(receive, bank_in_fd[atm], in_cmd[atm]->cmd[0]);
+    in_got[atm] = 0;
+    in_need[atm] = MESSAGE_SIZE;
+    int result = bank(atm_out_fd, in_cmd[atm], atms_remaining);
+    if (result == ERR_UNKNOWN_ATM)
+      printf("received message from unknown ATM. Ignoring...\n");
+    else if (result != SUCCESS)
+      return result;
+  }
+
+  post_read(atm, bank_in_fd);
+  return SUCCESS;
+}
+
+static int run_bank_uring(int bank_in_fd[], int atm_out_fd[])
+{
+  int result = SUCCESS;
+  int atms_remaining = atm_count;
+
+  // the last EXIT replies must still be written after the last EXIT
+  while (result == SUCCESS && (atms_remaining != 0 || writes_pending != 0))
+  {
+    changelog_publish();
+    flush_replies();
+    if (uring_submit(&ring, 1) < 0)
+    {
+      error_msg(ERR_PIPE_READ_ERR, "io_uring_enter failed");
+      return ERR_PIPE_READ_ERR;
+    }
+
+    unsigned long before = io_transactions;
+    struct io_uring_cqe *cqe;
+    while (result == SUCCESS && (cqe = uring_peek(&ring)) != NULL)
+    {
+      unsigned long long data = cqe->user_data;
+      int res = cqe->res;
+      uring_seen(&ring);
+
+      int id = (int)(data & 0xffffffff);
+      result = (data & URING_WRITE)
+                   ? reply_written(id, res)
+                   : command_read(id, res, bank_in_fd, atm_out_fd,
+                                  &atms_remaining);
+    }
+    stats_wakeup(io_transactions - before);
+  }
+
+  return result;
+}
+
+// Runs the bank with the I/O backend named by the `BANKSIM_IO`
+// environment variable: "poll" (the default) or "uring". If io_uring
+// is not available the poll backend is used instead. When
+// `BANKSIM_IO_STATS` is set the number of system calls per
+// transaction is printed, so the backends can be compared:
+//
+// $ BANKSIM_IO=uring BANKSIM_IO_STATS=1 ./banksim 10_10_100.trace
+
+int run_bank_channels(int chan_cnt, int bank_in_fd[], int atm_out_fd[])
+{
+  chan_count = chan_cnt;
+
+  const char *backend = getenv("BANKSIM_IO");
+  bool use_uring = backend != NULL && strcmp(backend, "uring") == 0;
+
+  if (use_uring && set_up_uring(bank_in_fd, atm_out_fd) < 0)
+  {
+    printf("bank: io_uring unavailable, using poll\n");
+    use_uring = false;
+  }
+
+  set_up_snapshots();
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // a write to an ATM that has gone away fails rather than killing us
+  signal(SIGPIPE, SIG_IGN);
+
+  int fair = use_uring ? 0 : fair_open(chan_cnt);
+  if (fair < 0)
+    printf("bank: BANKSIM_FAIR should be a quantum, BANKSIM_WEIGHTS weights, "
+           "BANKSIM_CLASSES CMD:class pairs and BANKSIM_RATE rate,burst[,atm...]; "
+           "not scheduling fairly\n");
+
+  int result = use_uring ? run_bank_uring(bank_in_fd, atm_out_fd)
+               : fair > 0 ? run_bank_fair(bank_in_fd, atm_out_fd)
+                          : run_bank_poll(bank_in_fd, atm_out_fd);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (use_uring)
+    tear_down_uring();
+  tear_down_idle();
+  fair_close();
+  snapshot_finish();
+
+  if (getenv("BANKSIM_IO_STATS") != NULL)
+  {
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+    unsigned long txns = io_transactions ? io_transactions : 1;
+    printf("bank io: backend=%s transactions=%lu syscalls=%lu "
+           "syscalls_per_txn=%.3f bytes_per_txn=%.1f txn_per_sec=%.0f\n",
+           use_uring ? "uring" : "poll", io_transactions, io_syscalls,
+           (double)io_syscalls / txns, (double)io_bytes / txns,
+           io_transactions / secs);
+  }
+
+  return result;
+}
+
+int run_bank(int bank_in_fd[], int atm_out_fd[])
+{
+  return run_bank_channels(atm_count, bank_in_fd, atm_out_fd);
+}
+
+// Bank server state. The first atm_count entries of pollfds are
+// connection slots (fd -1 when free) and the last one is the listening
+// socket. A connection is bound to an ATM id by its CONNECT command.
+
+static int listen_fd = -1;
+
+static int *slot_atm; // the ATM id bound to each connection slot, or -1
+
+static int *server_out_fd; // the connection fd of each ATM id, or -1
+
+static void note_stop(int sig)
+{
+  (void)sig;
+  stop_requested = 1;
+}
+
+// creates the listening SOCK_SEQPACKET socket at path. Each message is
+// a single record, so one read always returns exactly one command.
+static int server_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    error_msg(ERR_SOCKET_ERR, "socket path too long");
+    return ERR_SOCKET_ERR;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0)
+  {
+    error_msg(ERR_SOCKET_ERR, "could not create bank socket");
+    return ERR_SOCKET_ERR;
+  }
+
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, SOMAXCONN) < 0)
+  {
+    perror("bind/listen");
+    error_msg(ERR_SOCKET_ERR, "could not listen on bank socket");
+    close(listen_fd);
+    listen_fd = -1;
+    return ERR_SOCKET_ERR;
+  }
+  return SUCCESS;
+}
+
+static void set_up_server_poll()
+{
+  poll_count = atm_count + 1;
+  pollfds = (struct pollfd *)(malloc(sizeof(struct pollfd) * poll_count));
+  slot_atm = (int *)malloc(sizeof(int) * atm_count);
+  server_out_fd = (int *)malloc(sizeof(int) * atm_count);
+  for (int i = 0; i < atm_count; ++i)
+  {
+    pollfds[i].fd = -1;
+    pollfds[i].events = POLLIN;
+    slot_atm[i] = -1;
+    server_out_fd[i] = -1;
+  }
+  pollfds[atm_count].fd = listen_fd;
+  pollfds[atm_count].events = POLLIN;
+}
+
+// accepts a new ATM connection into a free slot
+static void server_accept()
+{
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  for (int i = 0; i < atm_count; ++i)
+  {
+    if (pollfds[i].fd == -1)
+    {
+      pollfds[i].fd = fd;
+      slot_atm[i] = -1;
+      idle_touch(i);
+      return;
+    }
+  }
+
+  printf("BANK: no free ATM slot, refusing connection\n");
+  close(fd);
+}
+
+// releases a connection slot and unbinds its ATM id
+static void server_drop(int slot)
+{
+  int atm = slot_atm[slot];
+  if (atm >= 0 && server_out_fd[atm] == pollfds[slot].fd)
+    server_out_fd[atm] = -1;
+  idle_forget(slot);
+  wire_forget(pollfds[slot].fd);
+  close(pollfds[slot].fd);
+  pollfds[slot].fd = -1;
+  slot_atm[slot] = -1;
+}
+
+// checks that a command arriving on a connection slot comes from the
+// ATM bound to it, binding the ATM on CONNECT. Anything else is
+// answered with ATMUNKN so the ATM does not wait forever.
+static int server_bind(int slot, Command *cmd)
+{
+  cmd_t c;
+  int i, f, t, a;
+  cmd_unpack(cmd, &c, &i, &f, &t, &a);
+
+  int fd = pollfds[slot].fd;
+  bool known = check_valid_atm(i) == SUCCESS;
+
+  if (known && c == CONNECT &&
+      (server_out_fd[i] == -1 || server_out_fd[i] == fd))
+  {
+    server_out_fd[i] = fd;
+    slot_atm[slot] = i;
+    return SUCCESS;
+  }
+
+  if (known && slot_atm[slot] == i)
+    return SUCCESS;
+
+  Command res;
+  MSG_ATMUNKN(&res, i);
+  stats_count(STATS_BANK, c, ATMUNKN);
+  wire_write(fd, &res, 1);
+  return ERR_UNKNOWN_ATM;
+}
+
+// This runs the bank as a daemon. ATMs connect to the socket at path
+// at any time and are served until they disconnect; the bank itself
+// keeps running until it receives SIGINT or SIGTERM.
+
+int run_bank_server(const char *path)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = note_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  set_up_snapshots();
+
+  int result = server_listen(path);
+  if (result != SUCCESS)
+    return result;
+
+  set_up_server_poll();
+  set_up_idle(atm_count);
+
+  // a daemon never runs out of ATMs, EXIT only ends one session
+  int sessions = atm_count;
+
+  while (!stop_requested)
+  {
+    for (Timer *t = idle_expired(); t != NULL; t = t->next)
+    {
+      printf("bank: connection %d idle for %d ms, dropping it\n", t->id, idle_ms);
+      idle_timeout_send(pollfds[t->id].fd, slot_atm[t->id]);
+      server_drop(t->id);
+    }
+
+    int found = find_ready_atm();
+    if (found == IDLE_CHECK)
+      continue;
+    if (found < 0)
+      break;
+
+    if (found == atm_count)
+    {
+      server_accept();
+      continue;
+    }
+
+    result = read_command(pollfds[found].fd);
+    if (result != SUCCESS)
+    {
+      server_drop(found);
+      continue;
+    }
+
+    idle_touch(found);
+    if (server_bind(found, frames) != SUCCESS)
+      continue;
+
+    result = bank(server_out_fd, frames, &sessions);
+    if (result == ERR_PIPE_WRITE_ERR)
+    {
+      server_drop(found);
+      continue;
+    }
+  }
+
+  for (int i = 0; i < atm_count; ++i)
+  {
+    if (pollfds[i].fd != -1)
+      server_drop(i);
+  }
+  tear_down_idle();
+  close(listen_fd);
+  unlink(path);
+  snapshot_finish();
+
+  return stop_requested ? SUCCESS : ERR_SOCKET_ERR;
+}
@@ -0,0 +1,271 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "stats.h"
+
+// banksim-top watches the live stats segment of a running simulation
+// and shows transaction rates and their trend. It only reads the
+// segment, so the bank and ATMs are never paused.
+
+extern const char *cmd_strings[];
+
+// How many past intervals the trend line shows.
+#define TREND_LEN 40
+
+// How many of the busiest ATMs are listed.
+#define TOP_ATMS 10
+
+static const char *outcome_strings[] = {"OK",      "NOFUNDS", "ACCUNKN",
+                                        "ATMUNKN", "ERROR",   "LIMIT"};
+
+// A copy of the counters taken at one point in time.
+typedef struct sample {
+  double when;
+  int active;
+  unsigned long wakeups;
+  unsigned long drained;
+  unsigned long drain_hist[STATS_DRAIN_BUCKETS];
+  unsigned long by_cmd[STATS_CMDS];
+  unsigned long by_outcome[STATS_OUTCOMES];
+  unsigned long total;
+  unsigned long latency[STATS_LAT_BUCKETS]; // over all ATMs
+  unsigned long *served;
+} Sample;
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// maps the segment read-only, returning NULL if it does not exist (yet)
+
+static StatsHeader *attach(const char *name, size_t *size) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  StatsHeader *h = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(StatsHeader)) {
+    h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) h = NULL;
+    *size = st.st_size;
+  }
+  close(fd);
+
+  if (h != NULL && LOAD(&h->magic) != STATS_MAGIC) {
+    munmap(h, *size);
+    h = NULL;
+  }
+  return h;
+}
+
+static void take(StatsHeader *h, Sample *s) {
+  StatsSlot *bank = (StatsSlot *)(h + 1);
+  unsigned long *served = (unsigned long *)(bank + h->atm_cnt + 1);
+
+  s->when = now();
+  s->active = LOAD(&h->active_atms);
+  s->wakeups = LOAD(&h->wakeups);
+  s->drained = LOAD(&h->drained);
+  for (int b = 0; b < STATS_DRAIN_BUCKETS; b++)
+    s->drain_hist[b] = LOAD(&h->drain_hist[b]);
+
+  memset(s->by_cmd, 0, sizeof(s->by_cmd));
+  memset(s->by_outcome, 0, sizeof(s->by_outcome));
+  s->total = 0;
+  for (int c = 0; c < STATS_CMDS; c++) {
+    for (int o = 0; o < STATS_OUTCOMES; o++) {
+      unsigned long n = LOAD(&bank->count[c][o]);
+      s->by_cmd[c] += n;
+      s->by_outcome[o] += n;
+      s->total += n;
+    }
+  }
+  for (int i = 0; i < h->atm_cnt; i++) s->served[i] = LOAD(&served[i]);
+
+  memset(s->latency, 0, sizeof(s->latency));
+  for (int i = 1; i <= h->atm_cnt; i++)
+    for (int b = 0; b < STATS_LAT_BUCKETS; b++)
+      s->latency[b] += LOAD(&bank[i].latency[b]);
+}
+
+// prints percentiles of the latencies recorded between two samples, if
+// the run is an open-loop replay
+
+static void latency(Sample *prev, Sample *cur) {
+  unsigned long n = 0;
+  for (int b = 0; b < STATS_LAT_BUCKETS; b++)
+    n += cur->latency[b] - prev->latency[b];
+  if (n == 0) return;
+
+  double q[] = {0.5, 0.9, 0.99, 0.999};
+  const char *names[] = {"p50", "p90", "p99", "p99.9"};
+  unsigned long seen = 0;
+  int next = 0;
+  printf("latency (us):");
+  for (int b = 0; b < STATS_LAT_BUCKETS && next < 4; b++) {
+    seen += cur->latency[b] - prev->latency[b];
+    while (next < 4 && seen > 0 && seen >= q[next] * n) {
+      printf(" %s %.1f", names[next++], stats_latency_bound(b) / 1e3);
+    }
+  }
+  printf("\n");
+}
+
+// draws a rate history as a line of increasingly dense characters
+
+static void trend(double *hist, int len) {
+  static const char shades[] = " .:-=+*#%@";
+  double top = 0;
+  for (int i = 0; i < len; i++)
+    if (hist[i] > top) top = hist[i];
+  for (int i = 0; i < len; i++) {
+    int level = top > 0 ? (int)(hist[i] / top * 9 + 0.5) : 0;
+    putchar(shades[level]);
+  }
+}
+
+static void show(const char *name, int atm_cnt, Sample *prev, Sample *cur,
+                 double start, double *hist, int hist_len, int clear) {
+  double dt = cur->when - prev->when;
+  if (dt <= 0) dt = 1e-9;
+
+  if (clear) printf("\033[H\033[J");
+  printf("banksim-top  %s  atms %d  active %d  uptime %.1fs\n", name, atm_cnt,
+         cur->active, cur->when - start);
+  printf("transactions %12.0f/s  total %lu  trend [",
+         (cur->total - prev->total) / dt, cur->total);
+  trend(hist, hist_len);
+  printf("]\n\n");
+
+  printf("%-10s %12s %12s\n", "command", "rate/s", "total");
+  for (int c = 0; c < STATS_CMDS; c++) {
+    if (cur->by_cmd[c] == 0) continue;
+    printf("%-10s %12.0f %12lu\n", cmd_strings[c],
+           (cur->by_cmd[c] - prev->by_cmd[c]) / dt, cur->by_cmd[c]);
+  }
+  printf("\n%-10s %12s %12s\n", "outcome", "rate/s", "total");
+  for (int o = 0; o < STATS_OUTCOMES; o++) {
+    printf("%-10s %12.0f %12lu\n", outcome_strings[o],
+           (cur->by_outcome[o] - prev->by_outcome[o]) / dt, cur->by_outcome[o]);
+  }
+  printf("\n");
+  latency(prev, cur);
+
+  unsigned long wakeups = cur->wakeups - prev->wakeups;
+  unsigned long drained = cur->drained - prev->drained;
+  printf("bank wake-ups %.0f/s, drained per wake-up %.2f\n", wakeups / dt,
+         wakeups ? (double)drained / wakeups : 0.0);
+  printf("drained histogram:");
+  for (int b = 0; b < STATS_DRAIN_BUCKETS; b++) {
+    unsigned long n = cur->drain_hist[b] - prev->drain_hist[b];
+    if (n > 0) printf(" [%d+]=%lu", 1 << b, n);
+  }
+  printf("\n\n");
+
+  // the busiest ATMs over the last interval
+  int top[TOP_ATMS];
+  int shown = 0;
+  for (int i = 0; i < atm_cnt; i++) {
+    unsigned long d = cur->served[i] - prev->served[i];
+    int at;
+    if (shown < TOP_ATMS) {
+      at = shown++;
+    } else {
+      int last = top[TOP_ATMS - 1];
+      if (d <= cur->served[last] - prev->served[last]) continue;
+      at = TOP_ATMS - 1;
+    }
+    while (at > 0 &&
+           cur->served[top[at - 1]] - prev->served[top[at - 1]] < d) {
+      top[at] = top[at - 1];
+      at--;
+    }
+    top[at] = i;
+  }
+  printf("%-10s %12s %12s\n", "atm", "rate/s", "total");
+  for (int k = 0; k < shown; k++) {
+    int i = top[k];
+    printf("%-10d %12.0f %12lu\n", i, (cur->served[i] - prev->served[i]) / dt,
+           cur->served[i]);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  int interval_ms = 1000;
+  int count = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+    switch (opt) {
+      case 'i':
+        interval_ms = atoi(optarg);
+        break;
+      case 'n':
+        count = atoi(optarg);
+        break;
+      default:
+        printf("usage: %s [-i interval_ms] [-n updates] [segment]\n", argv[0]);
+        exit(1);
+    }
+  }
+  const char *name = optind < argc ? argv[optind] : getenv("BANKSIM_STATS");
+  if (name == NULL) name = STATS_SEGMENT;
+
+  size_t size = 0;
+  StatsHeader *h;
+  while ((h = attach(name, &size)) == NULL) {
+    printf("waiting for %s ...\n", name);
+    sleep(1);
+  }
+
+  int atm_cnt = h->atm_cnt;
+  Sample a, b;
+  a.served = calloc(atm_cnt, sizeof(unsigned long));
+  b.served = calloc(atm_cnt, sizeof(unsigned long));
+  Sample *prev = &a, *cur = &b;
+
+  double hist[TREND_LEN];
+  int hist_len = 0;
+  int clear = isatty(STDOUT_FILENO);
+
+  take(h, prev);
+  double start = prev->when;
+
+  for (int n = 0; count < 0 || n < count; n++) {
+    usleep(interval_ms * 1000);
+    take(h, cur);
+
+    double rate = (cur->total - prev->total) / (cur->when - prev->when);
+    if (hist_len == TREND_LEN) {
+      memmove(hist, hist + 1, sizeof(double) * (TREND_LEN - 1));
+      hist_len--;
+    }
+    hist[hist_len++] = rate;
+
+    show(name, atm_cnt, prev, cur, start, hist, hist_len, clear);
+
+    Sample *t = prev;
+    prev = cur;
+    cur = t;
+
+    if (!LOAD(&h->running)) {
+      printf("run finished\n");
+      break;
+    }
+  }
+
+  munmap(h, size);
+  free(a.served);
+  free(b.served);
+  return 0;
+}
@@ -0,0 +1,197 @@
+#include "changelog.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef struct changelog_header {
+  unsigned magic;
+  int account_cnt;
+  int reader_cnt;
+  int capacity;
+  int retired[CHANGELOG_MAX_READERS]; // set once a replica stops applying
+} __attribute__((aligned(64))) ChangelogHeader;
+
+// A counter on a cache line of its own, so the bank and the replicas
+// do not slow each other down by updating neighbours.
+typedef struct counter {
+  long long value;
+} __attribute__((aligned(64))) Counter;
+
+// The segment is the header, the published and written counters, a
+// counter of changes applied per replica, and the ring.
+typedef struct changelog {
+  ChangelogHeader header;
+  Counter published;
+  Counter written;
+  Counter applied[CHANGELOG_MAX_READERS];
+  Change ring[];
+} Changelog;
+
+static Changelog *log_map = NULL;
+static unsigned long region_size = 0;
+static long long mask = 0;
+static int writable = 0;
+static int reader = 0;
+
+// the bank's side
+static long long written = 0;   // the last change appended
+static long long published = 0; // the last change published
+static long long room = 0;      // the last change the ring has room for
+
+// the replica's side
+static long long applied = 0;
+
+static unsigned long changelog_size(int capacity) {
+  return sizeof(Changelog) + sizeof(Change) * (unsigned long)capacity;
+}
+
+int changelog_capacity() {
+  char *eval = getenv("BANKSIM_REPLICA_LOG");
+  int cap = eval ? atoi(eval) : 0;
+  return cap > 0 ? cap : CHANGELOG_DEFAULT_CAP;
+}
+
+int changelog_create(const char *name, int account_cnt, int reader_cnt,
+                     int capacity) {
+  if (reader_cnt <= 0 || reader_cnt > CHANGELOG_MAX_READERS) return -1;
+  int cap = CHANGELOG_BATCH;
+  while (cap < capacity && cap < 1 << 30) cap <<= 1;
+
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) return -1;
+
+  unsigned long size = changelog_size(cap);
+  Changelog *l = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    l = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (l == MAP_FAILED) {
+    shm_unlink(name);
+    return -1;
+  }
+
+  // the segment starts zeroed; only the header needs filling in
+  l->header.account_cnt = account_cnt;
+  l->header.reader_cnt = reader_cnt;
+  l->header.capacity = cap;
+  __atomic_store_n(&l->header.magic, CHANGELOG_MAGIC, __ATOMIC_RELEASE);
+  munmap(l, size);
+  return 1;
+}
+
+int changelog_open(const char *name, int rw, int which) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) return -1;
+
+  Changelog *l = mmap(NULL, sizeof(Changelog), PROT_READ, MAP_SHARED, fd, 0);
+  if (l == MAP_FAILED ||
+      __atomic_load_n(&l->header.magic, __ATOMIC_ACQUIRE) != CHANGELOG_MAGIC ||
+      (!rw && (which < 0 || which >= l->header.reader_cnt))) {
+    if (l != MAP_FAILED) munmap(l, sizeof(Changelog));
+    close(fd);
+    return -1;
+  }
+  int cap = l->header.capacity;
+  munmap(l, sizeof(Changelog));
+
+  // a replica writes the count of changes it has applied
+  unsigned long size = changelog_size(cap);
+  l = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (l == MAP_FAILED) return -1;
+
+  log_map = l;
+  region_size = size;
+  mask = cap - 1;
+  writable = rw;
+  reader = which;
+  written = published = applied = 0;
+  room = cap;
+  return 1;
+}
+
+void changelog_close() {
+  if (log_map == NULL) return;
+  if (writable) changelog_publish();
+  else __atomic_store_n(&log_map->header.retired[reader], 1, __ATOMIC_RELEASE);
+  munmap(log_map, region_size);
+  log_map = NULL;
+  writable = 0;
+}
+
+void changelog_retire(const char *name, int which) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) return;
+  Changelog *l = mmap(NULL, sizeof(Changelog), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (l == MAP_FAILED) return;
+  if (which >= 0 && which < CHANGELOG_MAX_READERS)
+    __atomic_store_n(&l->header.retired[which], 1, __ATOMIC_RELEASE);
+  munmap(l, sizeof(Changelog));
+}
+
+void changelog_unlink(const char *name) { shm_unlink(name); }
+
+void changelog_publish() {
+  if (!writable || published == written) return;
+  published = written;
+  __atomic_store_n(&log_map->published.value, published, __ATOMIC_RELEASE);
+}
+
+// waits until the slowest replica still applying changes has applied
+// enough of them for change `seq` to fit in the ring
+static void changelog_wait(long long seq) {
+  changelog_publish();
+  while (1) {
+    long long slowest = written;
+    for (int r = 0; r < log_map->header.reader_cnt; r++) {
+      if (__atomic_load_n(&log_map->header.retired[r], __ATOMIC_ACQUIRE))
+        continue;
+      long long a = __atomic_load_n(&log_map->applied[r].value, __ATOMIC_ACQUIRE);
+      if (a < slowest) slowest = a;
+    }
+    room = slowest + mask + 1;
+    if (seq <= room) return;
+    sched_yield();
+  }
+}
+
+void changelog_append(int account, int balance) {
+  if (!writable) return;
+  long long seq = written + 1;
+  if (seq > room) changelog_wait(seq);
+
+  Change *c = &log_map->ring[seq & mask];
+  c->seq = seq;
+  c->account = account;
+  c->balance = balance;
+  written = seq;
+  __atomic_store_n(&log_map->written.value, seq, __ATOMIC_RELAXED);
+  if (written - published >= CHANGELOG_BATCH) changelog_publish();
+}
+
+int changelog_apply(int *balances) {
+  if (log_map == NULL || writable) return 0;
+  long long last = __atomic_load_n(&log_map->published.value, __ATOMIC_ACQUIRE);
+  for (long long s = applied + 1; s <= last; s++) {
+    Change *c = &log_map->ring[s & mask];
+    balances[c->account] = c->balance;
+  }
+
+  int n = last - applied;
+  applied = last;
+  __atomic_store_n(&log_map->applied[reader].value, last, __ATOMIC_RELEASE);
+  return n;
+}
+
+long long changelog_applied() { return applied; }
+
+long long changelog_written() {
+  if (log_map == NULL) return 0;
+  return __atomic_load_n(&log_map->written.value, __ATOMIC_RELAXED);
+}
@@ -1,4 +1,7 @@
 #include "command.h"
+#include <endian.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,7 +10,9 @@
 // An array of strings that corresponds to each of the command types.
 const char *cmd_strings[] = {"OK",       "CONNECT",  "EXIT",    "DEPOSIT",
                              "WITHDRAW", "TRANSFER", "BALANCE", "NOFUNDS",
-                             "ATMUNKN",  "ACCUNKN"};
+                             "ATMUNKN",  "ACCUNKN",  "BATCH",   "EOD",
+                             "LIMIT",    "STATEMENT", "TOPK",   "RANGESUM",
+                             "TIMEOUT"};
 
 // converts an int to packed byte form
 
@@ -40,6 +45,188 @@ void cmd_unpack(Command *cmd, cmd_t *c, int *id, int *from, int *to, int *amt) {
   *amt = unpack_int(cmd->amt);
 }
 
+// The optional fields of a compact message, in the order they follow
+// the id, and the opcode bit that says each one is there.
+static const struct {
+  size_t offset;
+  byte bit;
+} wire_fields[] = {
+    {offsetof(Command, from), 0x20},
+    {offsetof(Command, to), 0x40},
+    {offsetof(Command, amt), 0x80},
+};
+
+#define WIRE_TYPE_MASK 0x1f
+#define WIRE_ABSENT 0xffffffffu
+
+// With this many bytes to look at, a whole message is decoded without
+// checking for the end of the input at every field.
+#define WIRE_FAST_LEN 40
+
+// The length of a varint by the leading zeros of its value, and the
+// continuation bits of a varint by its length.
+static const byte varint_len[32] = {5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4,
+                                    3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2,
+                                    2, 2, 2, 1, 1, 1, 1, 1, 1, 1};
+static const unsigned long long varint_cont[6] = {
+    0, 0, 0x80, 0x8080, 0x808080, 0x80808080};
+
+static unsigned load_be(const byte *in) {
+  unsigned v;
+  memcpy(&v, in, sizeof(v));
+  return be32toh(v);
+}
+
+static void store_be(unsigned v, byte *out) {
+  v = htobe32(v);
+  memcpy(out, &v, sizeof(v));
+}
+
+// writes the varint of `v` at `out`, which has room for 8 bytes, and
+// returns its length: the 7-bit groups are spread over a word and the
+// word is stored whole
+static inline int put_varint(byte *out, unsigned v) {
+  int n = varint_len[__builtin_clz(v | 1)];
+  unsigned long long x = v;
+  unsigned long long w = (x & 0x7f) | (x << 1 & 0x7f00) | (x << 2 & 0x7f0000) |
+                         (x << 3 & 0x7f000000) | (x << 4 & 0xf00000000ull);
+  w = htole64(w | varint_cont[n]);
+  memcpy(out, &w, sizeof(w));
+  return n;
+}
+
+// The low n bytes of a word.
+static const unsigned long long byte_mask[8] = {
+    0, 0xff, 0xffff, 0xffffff, 0xffffffff, 0xffffffffffull, 0xffffffffffffull,
+    0xffffffffffffffull};
+
+static unsigned long long load_le64(const byte *in) {
+  unsigned long long w;
+  memcpy(&w, in, sizeof(w));
+  return le64toh(w);
+}
+
+// a bit for each of the 8 bytes of `w` whose top bit is clear, which
+// ends a varint
+static inline unsigned varint_ends(unsigned long long w) {
+  return (~w & 0x8080808080808080ull) * 0x0002040810204081ull >> 56;
+}
+
+// the value of the `n`-byte varint at `in`, which has 8 bytes to look
+// at, with its 7-bit groups gathered from a whole word
+static inline unsigned varint_value(const byte *in, int n) {
+  unsigned long long w = load_le64(in) & byte_mask[n & 7];
+  return (w & 0x7f) | (w >> 1 & 0x3f80) | (w >> 2 & 0x1fc000) |
+         (w >> 3 & 0xfe00000) | (w >> 4 & 0xf0000000);
+}
+
+// reads a varint of at most 5 bytes near the end of the input; returns
+// its length, 0 if it is cut short, or -1 if it is too long
+static int get_varint(const byte *in, int len, unsigned *v) {
+  unsigned x = 0;
+  int most = len < 5 ? len : 5;
+  for (int k = 0; k < most; k++) {
+    x |= (unsigned)(in[k] & 0x7f) << (7 * k);
+    if (!(in[k] & 0x80)) {
+      *v = x;
+      return k + 1;
+    }
+  }
+  return len < 5 ? 0 : -1;
+}
+
+int cmd_encode(Command *cmd, byte *out) {
+  if (cmd->cmd[0] > WIRE_TYPE_MASK) return 0;
+  byte op = cmd->cmd[0];
+  int n = 1 + put_varint(out + 1, load_be(cmd->id));
+
+  // every field is encoded; an absent one is written over by the next
+  for (int f = 0; f < 3; f++) {
+    unsigned v = load_be((byte *)cmd + wire_fields[f].offset);
+    int present = -(v != WIRE_ABSENT);
+    op |= wire_fields[f].bit & present;
+    n += put_varint(out + n, (v << 1) ^ -(v >> 31)) & present;
+  }
+  out[0] = op;
+  return n;
+}
+
+// decodes a message that may run past the end of the input
+static int decode_checked(const byte *in, int len, Command *cmd) {
+  if (len < 2) return 0;
+  byte op = in[0];
+  unsigned v;
+  int n = 1;
+  int got = get_varint(in + n, len - n, &v);
+  if (got <= 0) return got;
+  n += got;
+  cmd->cmd[0] = op & WIRE_TYPE_MASK;
+  store_be(v, cmd->id);
+
+  for (int f = 0; f < 3; f++) {
+    unsigned x = WIRE_ABSENT;
+    if (op & wire_fields[f].bit) {
+      got = get_varint(in + n, len - n, &v);
+      if (got <= 0) return got;
+      n += got;
+      x = (v >> 1) ^ -(v & 1);
+    }
+    store_be(x, (byte *)cmd + wire_fields[f].offset);
+  }
+  return n;
+}
+
+int cmd_decode(const byte *in, int len, Command *cmd) {
+  if (len < WIRE_FAST_LEN) return decode_checked(in, len, cmd);
+
+  // where every varint ends, found at once; a field's end is then the
+  // lowest end left, and the sentinels past the longest message stand
+  // for the ends of varints that are too long
+  unsigned ends = varint_ends(load_le64(in)) |
+                  varint_ends(load_le64(in + 8)) << 8 |
+                  varint_ends(load_le64(in + 16)) << 16;
+  ends = (ends | 0xfu << 24) & ~1u;
+
+  byte op = in[0];
+  cmd->cmd[0] = op & WIRE_TYPE_MASK;
+  int n = __builtin_ctz(ends);
+  bool too_long = n > 5;
+  store_be(varint_value(in + 1, n), cmd->id);
+  ends &= ends - 1;
+  n++;
+
+  // an absent field takes no bytes and reads as -1
+  for (int f = 0; f < 3; f++) {
+    int present = -((op & wire_fields[f].bit) != 0);
+    int got = (__builtin_ctz(ends) + 1 - n) & present;
+    unsigned v = varint_value(in + n, got);
+    too_long |= got > 5;
+    ends &= ends - (present & 1);
+    n += got;
+    store_be(((v >> 1) ^ -(v & 1)) | ~present, (byte *)cmd + wire_fields[f].offset);
+  }
+  return too_long ? -1 : n;
+}
+
+int cmd_is_request(cmd_t c) {
+  return (c >= CONNECT && c <= BALANCE) || c == BATCH || c == EOD ||
+         c == STATEMENT || c == TOPK || c == RANGESUM;
+}
+
+int cmd_tail_frames(Command *cmd) {
+  if (cmd->cmd[0] != BATCH) return 0;
+  int legs = unpack_int(cmd->from);
+  return (legs < 1 || legs > BATCH_MAX_LEGS) ? -1 : legs;
+}
+
+int cmd_reply_frames(Command *req, Command *reply) {
+  // a request from an unknown ATM is refused without being looked at
+  if (reply->cmd[0] == ATMUNKN) return 0;
+  if (req->cmd[0] == STATEMENT || req->cmd[0] == TOPK)
+    return reply->cmd[0] == OK ? (int)unpack_int(reply->to) : 0;
+  return req->cmd[0] == BATCH ? BATCH_FRAMES(unpack_int(req->from)) : 0;
+}
+
 void cmd_dump(const char *msg, int id, Command *cmd) {
   // We use an environment variable to toggle debug printing. If the
   // environment variable `BANKSIM_DEBUG` is set then commands will be
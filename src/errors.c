@@ -12,7 +12,10 @@ const char *error_strings[] = {"SUCCESS",
                                "ERR_UNKNOWN_ATM",
                                "ERR_BAD_TRACE_FILE",
                                "ERR_NOFUNDS",
-                               "ERR_ATM_CLOSED"};
+                               "ERR_ATM_CLOSED",
+                               "ERR_SOCKET_ERR",
+                               "ERR_LIMIT",
+                               "ERR_TIMEOUT"};
 
 // The maximum size of the error character buffer.
 #define ERROR_BUFFER_SIZE 200
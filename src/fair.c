@@ -0,0 +1,360 @@
+#include "fair.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+// A queued command and the frames that follow it.
+typedef struct fair_cmd {
+  struct fair_cmd *next;
+  long long arrived; // ns
+  int cost;
+  int cls;
+  Command cmds[]; // the command, then its frames
+} FairCmd;
+
+typedef struct fair_atm {
+  FairCmd *head;
+  FairCmd *tail;
+  int waiting;
+  long deficit;
+  int weight;
+  int fresh;       // its turn has not started yet
+  double tokens;   // with a rate limit
+  long long refilled;
+  int limited;
+} FairAtm;
+
+// The ATMs with commands queued in one class, in the order of their
+// turns; the first one is having its turn.
+typedef struct ring {
+  int *atms;
+  int first;
+  int count;
+} Ring;
+
+static FairAtm *atms = NULL;
+static int atm_count = 0;
+static Ring rings[FAIR_CLASSES];
+static int queued = 0;
+static long quantum = 1;
+static double rate = 0, burst = 0;
+static FairCmd *served = NULL;
+
+// The class of each command type.
+static int classes[CMD_COUNT];
+
+// The time commands spent queued, per class.
+static unsigned long delay[FAIR_CLASSES][STATS_LAT_BUCKETS];
+static unsigned long delay_max[FAIR_CLASSES];
+
+static const char *class_names[FAIR_CLASSES] = {"control", "money", "queries"};
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void default_classes() {
+  for (int c = 0; c < CMD_COUNT; c++) classes[c] = 2;
+  classes[CONNECT] = classes[EXIT] = 0;
+  classes[DEPOSIT] = classes[WITHDRAW] = classes[TRANSFER] = classes[BATCH] = 1;
+}
+
+// reads BANKSIM_CLASSES; returns -1 if it is malformed
+static int read_classes() {
+  char *eval = getenv("BANKSIM_CLASSES");
+  if (eval == NULL) return 1;
+  char *list = strdup(eval), *save = NULL;
+  int ok = list != NULL;
+  for (char *item = ok ? strtok_r(list, ",", &save) : NULL; item;
+       item = strtok_r(NULL, ",", &save)) {
+    char *colon = strchr(item, ':');
+    int c = 0, cls;
+    if (colon) *colon = '\0';
+    while (c < CMD_COUNT && (colon == NULL || strcmp(item, cmd_strings[c]) != 0))
+      c++;
+    if (c == CMD_COUNT || sscanf(colon + 1, "%d", &cls) != 1 || cls < 0 ||
+        cls >= FAIR_CLASSES) {
+      ok = 0;
+      break;
+    }
+    classes[c] = cls;
+  }
+  free(list);
+  return ok ? 1 : -1;
+}
+
+// reads BANKSIM_WEIGHTS; returns -1 if it is malformed
+static int read_weights() {
+  for (int a = 0; a < atm_count; a++) atms[a].weight = 1;
+  char *eval = getenv("BANKSIM_WEIGHTS");
+  if (eval == NULL) return 1;
+  char *end = eval;
+  for (int a = 0; *end != '\0'; a++) {
+    long w = strtol(eval, &end, 10);
+    if (end == eval || w < 1 || (*end != ',' && *end != '\0')) return -1;
+    if (a < atm_count) atms[a].weight = w;
+    eval = *end == ',' ? end + 1 : end;
+  }
+  return 1;
+}
+
+// reads BANKSIM_RATE; returns -1 if it is malformed
+static int read_rate() {
+  char *eval = getenv("BANKSIM_RATE");
+  if (eval == NULL) return 1;
+  int n = 0;
+  if (sscanf(eval, "%lf,%lf%n", &rate, &burst, &n) != 2 || rate <= 0 || burst < 1)
+    return -1;
+  eval += n;
+  int listed = *eval == ',';
+  for (int a = 0; a < atm_count; a++) atms[a].limited = !listed;
+  while (*eval == ',') {
+    char *end;
+    long a = strtol(eval + 1, &end, 10);
+    if (end == eval + 1 || a < 0) return -1;
+    if (a < atm_count) atms[a].limited = 1;
+    eval = end;
+  }
+  if (*eval != '\0') return -1;
+
+  long long now = now_ns();
+  for (int a = 0; a < atm_count; a++) {
+    atms[a].tokens = burst;
+    atms[a].refilled = now;
+  }
+  return 1;
+}
+
+int fair_open(int atm_cnt) {
+  fair_close();
+  char *eval = getenv("BANKSIM_FAIR");
+  if (eval == NULL) return 0;
+  char *end;
+  quantum = strtol(eval, &end, 10);
+  if (end == eval || *end != '\0' || quantum < 1) return -1;
+
+  atms = calloc(atm_cnt, sizeof(FairAtm));
+  for (int c = 0; c < FAIR_CLASSES; c++)
+    rings[c] = (Ring){malloc(sizeof(int) * (atm_cnt > 0 ? atm_cnt : 1)), 0, 0};
+  atm_count = atm_cnt;
+  int ok = atms != NULL;
+  for (int c = 0; c < FAIR_CLASSES; c++) ok = ok && rings[c].atms != NULL;
+  default_classes();
+  rate = burst = 0;
+  if (!ok || read_classes() < 0 || read_weights() < 0 || read_rate() < 0) {
+    fair_close();
+    return -1;
+  }
+  for (int a = 0; a < atm_count; a++) atms[a].fresh = 1;
+  memset(delay, 0, sizeof(delay));
+  memset(delay_max, 0, sizeof(delay_max));
+  return 1;
+}
+
+void fair_close() {
+  for (int a = 0; atms && a < atm_count; a++) {
+    while (atms[a].head) {
+      FairCmd *q = atms[a].head;
+      atms[a].head = q->next;
+      free(q);
+    }
+  }
+  free(served);
+  free(atms);
+  for (int c = 0; c < FAIR_CLASSES; c++) {
+    free(rings[c].atms);
+    rings[c] = (Ring){NULL, 0, 0};
+  }
+  served = NULL;
+  atms = NULL;
+  atm_count = 0;
+  queued = 0;
+}
+
+int fair_class(cmd_t c) { return c < CMD_COUNT ? classes[c] : FAIR_CLASSES - 1; }
+
+static void ring_add(Ring *r, int atm) {
+  r->atms[(r->first + r->count++) % atm_count] = atm;
+}
+
+static void ring_drop_first(Ring *r) {
+  r->first = (r->first + 1) % atm_count;
+  r->count--;
+}
+
+// the next ATM has its turn
+static void ring_rotate(Ring *r) {
+  int atm = r->atms[r->first];
+  ring_drop_first(r);
+  ring_add(r, atm);
+}
+
+int fair_push(int atm, Command *cmds, int frames) {
+  FairCmd *q = malloc(sizeof(FairCmd) + sizeof(Command) * (1 + frames));
+  if (q == NULL) return -1;
+  memcpy(q->cmds, cmds, sizeof(Command) * (1 + frames));
+  q->next = NULL;
+  q->arrived = now_ns();
+  q->cost = 1 + frames;
+  q->cls = fair_class(cmds->cmd[0]);
+
+  FairAtm *m = &atms[atm];
+  if (m->head == NULL) {
+    m->head = q;
+    ring_add(&rings[q->cls], atm);
+  } else {
+    m->tail->next = q;
+  }
+  m->tail = q;
+  m->waiting++;
+  queued++;
+  return 1;
+}
+
+int fair_queued() { return queued; }
+
+int fair_waiting(int atm) { return atms[atm].waiting; }
+
+// refills the bucket of an ATM with a rate limit
+static void refill(FairAtm *m, long long now) {
+  m->tokens += rate * (now - m->refilled) / 1e9;
+  if (m->tokens > burst) m->tokens = burst;
+  m->refilled = now;
+}
+
+// whether an ATM has the tokens for its next command; a command
+// costing more than a full bucket goes when the bucket is full
+static int has_tokens(FairAtm *m) {
+  if (!m->limited) return 1;
+  double need = m->head->cost < burst ? m->head->cost : burst;
+  return m->tokens >= need;
+}
+
+// the ns until an ATM has the tokens for its next command
+static long long tokens_in(FairAtm *m) {
+  double need = m->head->cost < burst ? m->head->cost : burst;
+  return (need - m->tokens) / rate * 1e9 + 1;
+}
+
+// picks the ATM to serve from class `c`, or -1 if every ATM queued in
+// it is out of tokens
+static int pick(int c, long long now) {
+  Ring *r = &rings[c];
+  while (1) {
+    // one pass over the ring: the first ATM whose deficit covers its
+    // next command is served; the others end their turns
+    int open = 0;
+    for (int k = 0; k < r->count; k++) {
+      int atm = r->atms[r->first];
+      FairAtm *m = &atms[atm];
+      if (m->limited) refill(m, now);
+      if (has_tokens(m)) {
+        open++;
+        if (m->fresh) {
+          m->deficit += quantum * m->weight;
+          m->fresh = 0;
+        }
+        if (m->deficit >= m->head->cost) return atm;
+      }
+      m->fresh = 1;
+      ring_rotate(r);
+    }
+    if (open == 0) return -1;
+
+    // nobody could go: give every open ATM the turns the nearest of
+    // them needs at once, rather than pass after pass; the next pass
+    // gives the last one
+    long rounds = -1;
+    for (int k = 0; k < r->count; k++) {
+      FairAtm *m = &atms[r->atms[(r->first + k) % atm_count]];
+      if (!has_tokens(m)) continue;
+      long step = quantum * m->weight;
+      long need = (m->head->cost - m->deficit - 1) / step;
+      if (rounds < 0 || need < rounds) rounds = need;
+    }
+    for (int k = 0; rounds > 0 && k < r->count; k++) {
+      FairAtm *m = &atms[r->atms[(r->first + k) % atm_count]];
+      if (has_tokens(m)) m->deficit += rounds * quantum * m->weight;
+    }
+  }
+}
+
+long fair_wait_ms() {
+  if (queued == 0) return -1;
+  long long now = now_ns(), soonest = -1;
+  for (int c = 0; c < FAIR_CLASSES; c++) {
+    Ring *r = &rings[c];
+    for (int k = 0; k < r->count; k++) {
+      FairAtm *m = &atms[r->atms[(r->first + k) % atm_count]];
+      if (m->limited) refill(m, now);
+      if (has_tokens(m)) return 0;
+      long long in = tokens_in(m);
+      if (soonest < 0 || in < soonest) soonest = in;
+    }
+  }
+  return (soonest + 999999) / 1000000;
+}
+
+Command *fair_pop(int *from) {
+  free(served);
+  served = NULL;
+
+  long long now = now_ns();
+  int atm = -1, c;
+  for (c = 0; c < FAIR_CLASSES && atm < 0; c++)
+    if (rings[c].count > 0) atm = pick(c, now);
+  if (atm < 0) return NULL;
+  c--;
+
+  FairAtm *m = &atms[atm];
+  FairCmd *q = m->head;
+  m->deficit -= q->cost;
+  if (m->limited) m->tokens -= q->cost;
+  m->head = q->next;
+  m->waiting--;
+  queued--;
+
+  // an ATM leaves the ring when its queue empties, and moves to the
+  // ring of its next command's class, starting a new turn there
+  if (m->head == NULL || m->head->cls != c) {
+    ring_drop_first(&rings[c]);
+    m->fresh = 1;
+    if (m->head == NULL) m->deficit = 0;
+    else ring_add(&rings[m->head->cls], atm);
+  }
+
+  long long waited = now - q->arrived;
+  delay[c][stats_latency_bucket(waited)]++;
+  if ((unsigned long)waited > delay_max[c]) delay_max[c] = waited;
+  served = q;
+  *from = atm;
+  return q->cmds;
+}
+
+// the bound of the bucket holding the `p`-th part of `count` delays
+static unsigned long percentile(unsigned long *hist, unsigned long count,
+                                double p) {
+  unsigned long want = count * p, seen = 0;
+  for (int b = 0; b < STATS_LAT_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > want) return stats_latency_bound(b);
+  }
+  return stats_latency_bound(STATS_LAT_BUCKETS - 1);
+}
+
+void fair_print() {
+  for (int c = 0; c < FAIR_CLASSES; c++) {
+    unsigned long count = 0;
+    for (int b = 0; b < STATS_LAT_BUCKETS; b++) count += delay[c][b];
+    if (count == 0) continue;
+    printf("bank fair: class %d (%s) served=%lu queue_delay_us p50=%.1f "
+           "p99=%.1f p999=%.1f max=%.1f\n",
+           c, class_names[c], count, percentile(delay[c], count, 0.5) / 1e3,
+           percentile(delay[c], count, 0.99) / 1e3,
+           percentile(delay[c], count, 0.999) / 1e3, delay_max[c] / 1e3);
+  }
+}
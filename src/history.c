@@ -0,0 +1,185 @@
+#include "history.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How an entry changed its account.
+#define ENTRY_DEPOSIT 0
+#define ENTRY_WITHDRAW 1
+#define ENTRY_SENT 2     // the from side of a transfer
+#define ENTRY_RECEIVED 3 // the to side of a transfer
+
+// An entry keeps the other account of a transfer in 30 bits, which is
+// far more accounts than a bank can hold in memory.
+typedef struct entry {
+  unsigned seq;
+  int amt;
+  int other : 30;
+  unsigned kind : 2;
+} Entry;
+
+// A block is exactly four cache lines.
+typedef struct block {
+  int older; // the next older block of the account, or -1
+  int newer; // the next newer one, or -1
+  int fill;  // entries used
+  int pad;
+  Entry entries[HISTORY_BLOCK_ENTRIES];
+} Block;
+
+// The chain of one account: its newest and oldest blocks, and how
+// many blocks it holds.
+typedef struct chain {
+  int newest;
+  int oldest;
+  int blocks;
+} Chain;
+
+static Block *arena = NULL;
+static int arena_len = 0; // blocks handed out so far
+static int arena_cap = 0;
+
+static Chain *chains = NULL;
+static int chain_cnt = 0;
+static int max_blocks = 0; // per account
+static int keep = 0;       // the entries a statement may return
+
+static unsigned next_seq = 0;
+static long entry_cnt = 0;
+
+int history_cap() {
+  char *eval = getenv("BANKSIM_HISTORY");
+  if (eval == NULL) return HISTORY_DEFAULT_CAP;
+  char *end;
+  long cap = strtol(eval, &end, 10);
+  return (*eval == '\0' || *end != '\0' || cap < 0 || cap > 1 << 24) ? -1
+                                                                      : cap;
+}
+
+int history_open(int account_cnt, int cap) {
+  history_close();
+  if (cap <= 0) return 0;
+
+  chains = malloc(sizeof(Chain) * account_cnt);
+  if (chains == NULL) return -1;
+  for (int i = 0; i < account_cnt; i++) {
+    chains[i].newest = chains[i].oldest = -1;
+    chains[i].blocks = 0;
+  }
+  chain_cnt = account_cnt;
+  keep = cap;
+  // one block more than the cap needs, so that recycling the oldest
+  // block never leaves fewer than `cap` entries; the extra ones are
+  // never returned
+  max_blocks = (cap + HISTORY_BLOCK_ENTRIES - 1) / HISTORY_BLOCK_ENTRIES + 1;
+  return 1;
+}
+
+void history_close() {
+  free(arena);
+  free(chains);
+  arena = NULL;
+  chains = NULL;
+  arena_len = arena_cap = chain_cnt = 0;
+  keep = 0;
+  entry_cnt = 0;
+}
+
+// takes a block from the arena, growing it if need be
+
+static int block_new() {
+  if (arena_len == arena_cap) {
+    int cap = arena_cap ? 2 * arena_cap : 1024;
+    Block *grown = realloc(arena, sizeof(Block) * cap);
+    if (grown == NULL) return -1;
+    arena = grown;
+    arena_cap = cap;
+  }
+  return arena_len++;
+}
+
+// appends an entry to account `acc`
+
+static void append(int acc, unsigned seq, int kind, int other, int amt) {
+  if (chains == NULL || acc < 0 || acc >= chain_cnt) return;
+  Chain *ch = &chains[acc];
+
+  if (ch->newest < 0 || arena[ch->newest].fill == HISTORY_BLOCK_ENTRIES) {
+    int b;
+    if (ch->blocks == max_blocks) {
+      // reuse the oldest block
+      b = ch->oldest;
+      ch->oldest = arena[b].newer;
+      arena[ch->oldest].older = -1;
+      entry_cnt -= arena[b].fill;
+    } else {
+      b = block_new();
+      if (b < 0) return;
+      ch->blocks++;
+      if (ch->oldest < 0) ch->oldest = b;
+    }
+    arena[b].older = ch->newest;
+    arena[b].newer = -1;
+    arena[b].fill = 0;
+    if (ch->newest >= 0) arena[ch->newest].newer = b;
+    ch->newest = b;
+  }
+
+  Block *blk = &arena[ch->newest];
+  Entry *e = &blk->entries[blk->fill++];
+  e->seq = seq;
+  e->amt = amt;
+  e->other = other;
+  e->kind = kind;
+  entry_cnt++;
+}
+
+void history_add(cmd_t c, int from, int to, int amt) {
+  if (chains == NULL) return;
+  unsigned seq = next_seq++;
+  switch (c) {
+    case DEPOSIT:
+      append(to, seq, ENTRY_DEPOSIT, -1, amt);
+      break;
+    case WITHDRAW:
+      append(from, seq, ENTRY_WITHDRAW, -1, amt);
+      break;
+    case TRANSFER:
+      append(from, seq, ENTRY_SENT, to, amt);
+      append(to, seq, ENTRY_RECEIVED, from, amt);
+      break;
+  }
+}
+
+int history_last(int acc, int n, Command *out) {
+  if (chains == NULL || acc < 0 || acc >= chain_cnt) return 0;
+  if (n > keep) n = keep;
+
+  int got = 0;
+  for (int b = chains[acc].newest; b >= 0 && got < n; b = arena[b].older) {
+    Block *blk = &arena[b];
+    for (int k = blk->fill - 1; k >= 0 && got < n; k--) {
+      Entry *e = &blk->entries[k];
+      Command *cmd = &out[got++];
+      switch (e->kind) {
+        case ENTRY_DEPOSIT:
+          MSG_DEPOSIT(cmd, e->seq, acc, e->amt);
+          break;
+        case ENTRY_WITHDRAW:
+          MSG_WITHDRAW(cmd, e->seq, acc, e->amt);
+          break;
+        case ENTRY_SENT:
+          MSG_TRANSFER(cmd, e->seq, acc, e->other, e->amt);
+          break;
+        default:
+          MSG_TRANSFER(cmd, e->seq, e->other, acc, e->amt);
+      }
+    }
+  }
+  return got;
+}
+
+void history_usage(long *entries, long *bytes) {
+  *entries = entry_cnt;
+  *bytes = (long)sizeof(Block) * arena_len + (long)sizeof(Chain) * chain_cnt;
+}
@@ -0,0 +1,79 @@
+#include "io.h"
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "errors.h"
+
+unsigned long io_syscalls = 0;
+unsigned long io_bytes = 0;
+
+// Performs a `write` call, checking for errors and handlings
+// partial writes. A write interrupted by a signal is retried. If there
+// was an error it returns ERR_PIPE_WRITE_ERR.
+// Note: data is void * since the actual type being written does not matter.
+
+int checked_write(int fd, void *data, int n)
+{
+  char *d = (char *)data;
+  while (n > 0)
+  {
+    int result = write(fd, d, n);
+    io_syscalls++;
+    if (result >= 0)
+    {
+      io_bytes += result;
+      // this approach handles both complete and partial writes
+      d += result;
+      n -= result;
+    }
+    else if (errno == EINTR)
+    {
+      continue;
+    }
+    else
+    {
+      error_msg(ERR_PIPE_WRITE_ERR, "could not write message");
+      perror("write");
+
+      return ERR_PIPE_WRITE_ERR;
+    }
+  }
+  return SUCCESS;
+}
+
+// Performs a `read` call, checking for errors and handlings
+// partial read. A read interrupted by a signal is retried. If there
+// was an error it returns ERR_PIPE_READ_ERR.
+// Note: data is void * since the actual type being read does not matter.
+
+int checked_read(int fd, void *data, int n)
+{
+  char *d = (char *)data;
+  while (n > 0)
+  {
+    int result = read(fd, d, n);
+    io_syscalls++;
+
+    if (result > 0)
+    {
+      io_bytes += result;
+      // this approach handles both complete and partial reads
+      d += result;
+      n -= result;
+      continue;
+    }
+
+    if (result == 0)
+    {
+      // indicates EOF
+      return ERR_ATM_CLOSED;
+    }
+
+    if (errno == EINTR)
+      continue;
+
+    error_msg(ERR_PIPE_READ_ERR, "could not read message");
+    return ERR_PIPE_READ_ERR;
+  }
+  return SUCCESS;
+}
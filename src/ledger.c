@@ -0,0 +1,151 @@
+#include "ledger.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Spinning readers let the writer's core finish its change.
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+typedef struct ledger_header {
+  unsigned magic;
+  int account_cnt;
+  int ready;
+} LedgerHeader;
+
+// A sequence number, odd while its accounts are being changed.
+typedef struct stripe {
+  unsigned seq;
+} __attribute__((aligned(64))) Stripe;
+
+static LedgerHeader *header = NULL;
+static Stripe *stripes = NULL;
+static int *balances = NULL;
+static int writable = 0;
+static unsigned long region_size = 0;
+
+static unsigned long ledger_size(int account_cnt) {
+  return sizeof(Stripe) + sizeof(Stripe) * LEDGER_STRIPES +
+         sizeof(int) * account_cnt;
+}
+
+int ledger_create(const char *name, int account_cnt) {
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) return -1;
+
+  unsigned long size = ledger_size(account_cnt);
+  LedgerHeader *h = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    shm_unlink(name);
+    return -1;
+  }
+
+  // the segment starts zeroed; only the header needs filling in
+  h->account_cnt = account_cnt;
+  __atomic_store_n(&h->magic, LEDGER_MAGIC, __ATOMIC_RELEASE);
+  munmap(h, size);
+  return 1;
+}
+
+int ledger_open(const char *name, int rw) {
+  int fd = shm_open(name, rw ? O_RDWR : O_RDONLY, 0);
+  if (fd < 0) return -1;
+
+  int prot = rw ? PROT_READ | PROT_WRITE : PROT_READ;
+  LedgerHeader *h = mmap(NULL, sizeof(Stripe), prot, MAP_SHARED, fd, 0);
+  if (h == MAP_FAILED ||
+      __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != LEDGER_MAGIC) {
+    if (h != MAP_FAILED) munmap(h, sizeof(Stripe));
+    close(fd);
+    return -1;
+  }
+  unsigned long size = ledger_size(h->account_cnt);
+  munmap(h, sizeof(Stripe));
+
+  h = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) return -1;
+
+  header = h;
+  stripes = (Stripe *)((char *)h + sizeof(Stripe));
+  balances = (int *)(stripes + LEDGER_STRIPES);
+  writable = rw;
+  region_size = size;
+  return 1;
+}
+
+void ledger_close() {
+  if (header == NULL) return;
+  munmap(header, region_size);
+  header = NULL;
+  stripes = NULL;
+  balances = NULL;
+}
+
+void ledger_unlink(const char *name) { shm_unlink(name); }
+
+int *ledger_balances() { return writable ? balances : NULL; }
+
+void ledger_ready() {
+  if (header != NULL && writable)
+    __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+}
+
+// The bank is the only writer, so the sequence number needs no atomic
+// increment; the fences order it against the balance stores.
+
+void ledger_write_begin(int acc) {
+  if (stripes == NULL) return;
+  unsigned *seq = &stripes[acc % LEDGER_STRIPES].seq;
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void ledger_write_end(int acc) {
+  if (stripes == NULL) return;
+  unsigned *seq = &stripes[acc % LEDGER_STRIPES].seq;
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+void ledger_write_all_begin() {
+  if (stripes == NULL) return;
+  for (int s = 0; s < LEDGER_STRIPES; s++)
+    __atomic_store_n(&stripes[s].seq, stripes[s].seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void ledger_write_all_end() {
+  if (stripes == NULL) return;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (int s = 0; s < LEDGER_STRIPES; s++)
+    __atomic_store_n(&stripes[s].seq, stripes[s].seq + 1, __ATOMIC_RELAXED);
+}
+
+int ledger_read(int acc, int *balance) {
+  if (header == NULL || !__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE))
+    return -1;
+  if (acc < 0 || acc >= header->account_cnt) return 0;
+
+  unsigned *seq = &stripes[acc % LEDGER_STRIPES].seq;
+  while (1) {
+    unsigned before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      cpu_relax();
+      continue;
+    }
+    int value = __atomic_load_n(&balances[acc], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before) {
+      *balance = value;
+      return 1;
+    }
+  }
+}
@@ -0,0 +1,119 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// The size of each of the two log buffers. While the writer thread
+// writes one out, messages are appended to the other.
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+// The longest single message; longer messages are truncated.
+#define LOG_LINE_SIZE 256
+
+// The writer thread writes a buffer out once it is half full, or at
+// the latest after this many milliseconds.
+#define LOG_FLUSH_MS 10
+
+static bool enabled = false;
+static bool stopping = false;
+
+static char buffers[2][LOG_BUFFER_SIZE];
+static int filling = 0; // the buffer messages are appended to
+static int used = 0;    // bytes used in that buffer
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;  // writer has work
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;  // buffer swapped
+
+// writes all of a buffer, retrying partial writes
+
+static void write_all(const char *buf, int n) {
+  while (n > 0) {
+    int result = write(STDOUT_FILENO, buf, n);
+    if (result < 0) return;
+    buf += result;
+    n -= result;
+  }
+}
+
+// The writer thread swaps out the full buffer and writes it while new
+// messages go into the other one.
+
+static void *log_writer(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&lock);
+  while (1) {
+    if (used < LOG_BUFFER_SIZE / 2 && !stopping) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += LOG_FLUSH_MS * 1000000L;
+      if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&wake, &lock, &until);
+    }
+    if (used == 0) {
+      if (stopping) break;
+      continue;
+    }
+
+    int full = filling;
+    int n = used;
+    filling = 1 - filling;
+    used = 0;
+    pthread_cond_broadcast(&room);
+
+    pthread_mutex_unlock(&lock);
+    write_all(buffers[full], n);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void log_open() {
+  enabled = getenv("BANKSIM_VERBOSE") != NULL;
+  if (!enabled) return;
+
+  // anything printf'd before must come out before the log messages
+  fflush(stdout);
+  stopping = false;
+  used = 0;
+  if (pthread_create(&writer, NULL, log_writer, NULL) != 0) enabled = false;
+}
+
+void log_close() {
+  if (!enabled) return;
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+  enabled = false;
+}
+
+void log_printf(const char *fmt, ...) {
+  if (!enabled) return;
+
+  char line[LOG_LINE_SIZE];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line, LOG_LINE_SIZE, fmt, args);
+  va_end(args);
+  if (n < 0) return;
+  if (n >= LOG_LINE_SIZE) n = LOG_LINE_SIZE - 1;
+
+  pthread_mutex_lock(&lock);
+  // wait for the writer if both buffers are busy
+  while (used + n > LOG_BUFFER_SIZE) pthread_cond_wait(&room, &lock);
+  for (int i = 0; i < n; i++) buffers[filling][used + i] = line[i];
+  used += n;
+  if (used >= LOG_BUFFER_SIZE / 2) pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
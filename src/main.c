@@ -1,14 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
 
 #include "hw.h"
+#include "changelog.h"
+#include "ledger.h"
+#include "log.h"
+#include "relay.h"
+#include "replica.h"
+#include "schedule.h"
+#include "stats.h"
 #define P_READ 0
 #define P_WRITE 1
 
+// the most offered loads one open-loop run can sweep
+#define MAX_LOADS 32
+
 // helper to make pipe || exit
 void pipe_init(int p[2])
 {
@@ -40,10 +52,19 @@ void filedes_close(int f)
            : (void)0;
 }
 
+// helper to tell whether balances are read from the shared ledger
+bool local_balance()
+{
+    return getenv("BANKSIM_LOCAL_BALANCE") != NULL;
+}
+
 // helper to manage the ATM child
 void manage_achild(const char *original, int initial, int final, int id)
 {
+    local_balance() ? (void)ledger_open(LEDGER_SEGMENT, 0) : (void)0;
+    log_open();
     int outcome = atm_run(original, initial, final, id);
+    log_close();
     bool succ = (outcome == SUCCESS);
 
     succ ? (void)0
@@ -53,12 +74,42 @@ void manage_achild(const char *original, int initial, int final, int id)
     exit(0);
 }
 
+// helper to manage an ATM worker child driving many logical ATMs
+void manage_wchild(const char *original, int initial, int final, int first, int count)
+{
+    local_balance() ? (void)ledger_open(LEDGER_SEGMENT, 0) : (void)0;
+    log_open();
+    int outcome = atm_run_many(original, initial, final, first, count);
+    log_close();
+    bool succ = (outcome == SUCCESS);
+
+    succ ? (void)0
+         : error_print();
+    printf("atms %d-%d: exit\n", first, first + count - 1);
+
+    exit(0);
+}
+
+// helper to manage a read replica child
+void manage_rchild(int id, int sum_acc, int sum_chan, int in[], int out[])
+{
+    int outcome = replica_run(id, sum_acc, sum_chan, in, out);
+    outcome == SUCCESS ? (void)0 : error_print();
+
+    exit(0);
+}
+
 // helper to manage the child logic
-void manage_bchild(int sum_atm, int sum_acc, int in[], int out[])
+void manage_bchild(int sum_atm, int sum_acc, int sum_chan, int in[], int out[],
+                   bool logged)
 {
+    local_balance() ? (void)ledger_open(LEDGER_SEGMENT, 1) : (void)0;
+    logged ? (void)changelog_open(CHANGELOG_SEGMENT, 1, 0) : (void)0;
     bank_open(sum_atm, sum_acc);
+    log_open();
 
-    int sim_success = run_bank(in, out);
+    int sim_success = run_bank_channels(sum_chan, in, out);
+    log_close();
     bool pass = (sim_success == SUCCESS);
 
     pass ? (void)0 : error_print();
@@ -70,37 +121,175 @@ void manage_bchild(int sum_atm, int sum_acc, int in[], int out[])
     exit(0);
 }
 
-// This is the main driver file for the bank simulation.
-// The `main` function takes one argument, the name of a
-// trace file to use.  The test directory contains a
-// short sample trace that exercises at least one interesting
-// case.
+// helper to put a relay process between the ATMs and the bank (see
+// relay.h). The bank gets new pipes to the relay in place of its ends
+// of the ATMs' pipes: link 2i carries the requests of channel i, and
+// link 2i + 1 its replies.
+void relay_channels(const RelayPlan *plan, int chan_cnt, int bank_in_fd[],
+                    int atm_cnt, int atm_out_fd[])
+{
+    int in[2 * chan_cnt], out[2 * chan_cnt];
+    for (int i = 0; i < chan_cnt; i++)
+    {
+        int up[2], down[2];
+        pipe_init(up);
+        pipe_init(down);
 
-int main(int argc, char *argv[])
+        // every ATM of a channel writes to the same pipe
+        int bank_w = atm_out_fd[(long)i * atm_cnt / chan_cnt];
+        for (int j = 0; j < atm_cnt; j++)
+        {
+            atm_out_fd[j] = atm_out_fd[j] == bank_w ? down[P_WRITE] : atm_out_fd[j];
+        }
+
+        in[2 * i] = bank_in_fd[i];
+        out[2 * i] = up[P_WRITE];
+        in[2 * i + 1] = down[P_READ];
+        out[2 * i + 1] = bank_w;
+        bank_in_fd[i] = up[P_READ];
+    }
+
+    printf("fork relay for %d links\n", 2 * chan_cnt);
+    pid_t p_r = apply_fork();
+    if (p_r == 0)
+    {
+        for (int i = 0; i < chan_cnt; i++)
+        {
+            filedes_close(bank_in_fd[i]);
+            filedes_close(atm_out_fd[(long)i * atm_cnt / chan_cnt]);
+        }
+        int outcome = relay_run(plan, 2 * chan_cnt, in, out);
+        outcome == SUCCESS ? (void)0 : error_print();
+        exit(0);
+    }
+
+    for (int k = 0; k < 2 * chan_cnt; k++)
+    {
+        filedes_close(in[k]);
+        filedes_close(out[k]);
+    }
+}
+
+// helper to name the shared memory segment the live stats are
+// published in, which `banksim-top` reads
+const char *stats_segment()
+{
+    const char *name = getenv("BANKSIM_STATS");
+    return name != NULL ? name : STATS_SEGMENT;
+}
+
+// helper to run the bank as a socket daemon sized by the trace header
+int serve_bank(const char *sock, int sum_atm, int sum_acc)
 {
-    if (argc != 2)
+    printf("bank: listening on %s for up to %d ATMs\n", sock, sum_atm);
+    bool shared = local_balance() && ledger_create(LEDGER_SEGMENT, sum_acc) == 1;
+    shared ? (void)ledger_open(LEDGER_SEGMENT, 1) : (void)0;
+    bank_open(sum_atm, sum_acc);
+    stats_open(sum_atm, stats_segment());
+    log_open();
+
+    int outcome = run_bank_server(sock);
+    log_close();
+    bool pass = (outcome == SUCCESS);
+
+    pass ? (void)0 : error_print();
+    printf("bank: dump and close\n");
+
+    bank_dump();
+    bank_close();
+    shared ? ledger_unlink(LEDGER_SEGMENT) : (void)0;
+    stats_print();
+    stats_close();
+    return pass ? 0 : 1;
+}
+
+// helper to fork `count` ATM clients starting at `first`, each with
+// its own connection to the bank server. An open-loop client runs as a
+// single logical ATM so that it can send on schedule.
+int connect_atms(const char *sock, const char *t_file, int first, int count,
+                 bool open_loop, StatsLatency *lat)
+{
+    stats_open(first + count, NULL);
+    for (int i = first; i < first + count; i++)
     {
-        printf("usage: %s trace_file\n", argv[0]);
-        exit(1);
+        pid_t p_c = apply_fork();
+        if (p_c == 0)
+        {
+            int fd = atm_connect(sock);
+            fd < 0 ? (error_print(), exit(1)) : (void)0;
+            open_loop ? manage_wchild(t_file, fd, fd, i, 1)
+                      : manage_achild(t_file, fd, fd, i);
+        }
     }
 
-    int result = 0;
-    int atm_count = 0;
-    int account_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        wait(NULL);
+    }
+    stats_print();
+    stats_latency_summary(lat);
+    stats_close();
+    return 0;
+}
 
-    // open the trace file
-    result = trace_open(argv[1]);
-    if (result == -1)
+void usage(const char *prog)
+{
+    printf("usage: %s [-w workers] trace_file\n", prog);
+    printf("       %s -S socket trace_file\n", prog);
+    printf("       %s -C socket trace_file [first_atm [atm_count]]\n", prog);
+    printf("options: -o rate[,rate...] replays open-loop at each total rate\n");
+    printf("         -a fixed|poisson|bursty sets the arrival schedule\n");
+    printf("trace_file may be soak:atms,accounts,commands[,secs[,seed]] to\n");
+    printf("generate the commands in memory instead\n");
+}
+
+// helper to read a comma separated list of offered loads, returning
+// how many there are or -1 if one is not a positive number
+int parse_loads(char *list, double loads[])
+{
+    int n = 0;
+    for (char *r = strtok(list, ","); r != NULL; r = strtok(NULL, ","))
     {
-        printf("%s: could not open file %s\n", argv[0], argv[1]);
-        exit(1);
+        if (n == MAX_LOADS || (loads[n] = atof(r)) <= 0)
+        {
+            return -1;
+        }
+        n++;
     }
+    return n;
+}
 
-    // Get the number of ATMs and accounts:
-    atm_count = trace_atm_count();
-    account_count = trace_account_count();
-    trace_close();
-    printf("Main: ATM count = %d, Account count = %d\n", atm_count, account_count);
+double now_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// helper to print the latency of an open-loop sweep against the load
+// offered and the load the bank achieved at each step
+void load_report(const char *kind, int n, double offered[], double secs[],
+                 StatsLatency lat[])
+{
+    printf("==== latency vs offered load (%s arrivals, us) ====\n", kind);
+    printf("%12s %12s %10s %10s %10s %10s %10s\n", "offered/s", "achieved/s",
+           "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < n; i++)
+    {
+        printf("%12.0f %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               offered[i], lat[i].count / secs[i], lat[i].p50 / 1e3,
+               lat[i].p90 / 1e3, lat[i].p99 / 1e3, lat[i].p999 / 1e3,
+               lat[i].max / 1e3);
+    }
+}
+
+// helper to run the ATMs of the trace against a forked bank, each ATM
+// its own process or spread over `workers` worker processes
+int run_simulation(const char *t_file, int atm_count, int account_count,
+                   int workers, StatsLatency *lat)
+{
+    // Without workers every ATM is its own process.
+    int proc_count = (workers > 0 && workers < atm_count) ? workers : atm_count;
 
     // This is a table of atm_out file descriptors. It will be used by
     // the bank process to communicate to each of the ATM processes.
@@ -110,13 +299,40 @@ int main(int argc, char *argv[])
     // the bank process to receive communication from each of the ATM processes.
     int bank_in_fd[atm_count];
 
-    // TODO: ATM PROCESS FORKING
+    // The ATMs and the bank count outcomes into a shared segment that
+    // banksim-top can watch live and that is printed once everything
+    // is done.
+    stats_open(atm_count, stats_segment());
+
+    // With BANKSIM_LOCAL_BALANCE the bank keeps its accounts in a shared
+    // ledger that the ATMs map read-only to answer BALANCE themselves.
+    bool shared = local_balance() && ledger_create(LEDGER_SEGMENT, account_count) == 1;
+
+    // With BANKSIM_REPLICAS, ATMs send BALANCE to read replicas the
+    // bank feeds through its change log. Replicas are paired with ATM
+    // processes, so workers cannot use them.
+    int replicas = workers == 0 ? replica_count() : 0;
+    if (workers > 0 && replica_count() > 0)
+        printf("Main: replicas need a process per ATM, not using them\n");
+    bool logged = replicas > 0 &&
+                  changelog_create(CHANGELOG_SEGMENT, account_count, replicas,
+                                   changelog_capacity()) == 1;
+    replicas = logged ? replicas : 0;
+
+    // the replica's ends of the pipes to and from each ATM
+    int replica_in_fd[atm_count];
+    int replica_out_fd[atm_count];
 
-    const char *t_file = argv[1];
+    // TODO: ATM PROCESS FORKING
 
-    for (int i = 0; i < atm_count; i++)
+    for (int i = 0; i < proc_count; i++)
     {
-        printf("fork atm %d\n", i);
+        // the ATM ids run by this process
+        int first = (int)((long)i * atm_count / proc_count);
+        int count = (int)((long)(i + 1) * atm_count / proc_count) - first;
+
+        workers > 0 ? printf("fork worker %d for atms %d-%d\n", i, first, first + count - 1)
+                    : printf("fork atm %d\n", i);
         int atm_p[2];
         int bank_p[2];
 
@@ -129,7 +345,20 @@ int main(int argc, char *argv[])
         int bank_w = bank_p[P_WRITE];
         int bank_r = atm_p[P_READ];
 
-        atm_out_fd[i] = bank_w;
+        int req_p[2] = {-1, -1};
+        int rep_p[2] = {-1, -1};
+        if (replicas > 0)
+        {
+            pipe_init(req_p);
+            pipe_init(rep_p);
+            replica_in_fd[i] = req_p[P_READ];
+            replica_out_fd[i] = rep_p[P_WRITE];
+        }
+
+        for (int j = first; j < first + count; j++)
+        {
+            atm_out_fd[j] = bank_w;
+        }
         bank_in_fd[i] = bank_r;
 
         pid_t p_c = apply_fork();
@@ -145,32 +374,211 @@ int main(int argc, char *argv[])
             printf("atm %d: child process forked\n", i);
             filedes_close(atm_p[P_READ]);
             filedes_close(bank_p[P_WRITE]);
-            manage_achild(t_file, atm_w, atm_r, i);
+            if (replicas > 0)
+            {
+                filedes_close(req_p[P_READ]);
+                filedes_close(rep_p[P_WRITE]);
+                atm_use_replica(req_p[P_WRITE], rep_p[P_READ]);
+            }
+            workers > 0 ? manage_wchild(t_file, atm_w, atm_r, first, count)
+                        : manage_achild(t_file, atm_w, atm_r, i);
             break;
 
         default: // parent process
             filedes_close(atm_p[P_WRITE]);
             filedes_close(bank_p[P_READ]);
+            if (replicas > 0)
+            {
+                filedes_close(req_p[P_WRITE]);
+                filedes_close(rep_p[P_READ]);
+            }
             break;
         }
     }
 
+    // Replica r serves ATMs r, r + replicas, ...
+    for (int r = 0; r < replicas; r++)
+    {
+        int in[atm_count], out[atm_count], n = 0;
+        for (int j = r; j < atm_count; j += replicas)
+        {
+            in[n] = replica_in_fd[j];
+            out[n++] = replica_out_fd[j];
+        }
+        printf("fork replica %d for %d atms\n", r, n);
+        pid_t p_r = apply_fork();
+        if (p_r == 0)
+        {
+            manage_rchild(r, account_count, n, in, out);
+        }
+    }
+    for (int j = 0; j < atm_count && replicas > 0; j++)
+    {
+        filedes_close(replica_in_fd[j]);
+        filedes_close(replica_out_fd[j]);
+    }
+
+    // With BANKSIM_LINK, what crosses the pipes is held back as a WAN
+    // link would.
+    RelayPlan plan;
+    int linked = relay_plan(&plan);
+    if (linked < 0)
+        printf("Main: BANKSIM_LINK should be delay_ms[,jitter_ms[,mbit_per_s]]; "
+               "not emulating a link\n");
+    if (linked > 0)
+        relay_channels(&plan, proc_count, bank_in_fd, atm_count, atm_out_fd);
+
     // TODO: BANK PROCESS FORKING
     printf("fork bank proc\n");
     pid_t pid_b = apply_fork();
     if (pid_b == 0)
     {
-        manage_bchild(atm_count, account_count, bank_in_fd, atm_out_fd);
+        manage_bchild(atm_count, account_count, proc_count, bank_in_fd, atm_out_fd,
+                      logged);
+    }
+
+    // the relay sees the bank close its ends of the pipes only once
+    // ours are closed too
+    for (int i = 0; linked > 0 && i < proc_count; i++)
+    {
+        filedes_close(bank_in_fd[i]);
+        filedes_close(atm_out_fd[(long)i * atm_count / proc_count]);
     }
 
     // Wait for each of the child processes to complete. We include
-    // atm_count to include the bank process (i.e., this is not a
+    // proc_count to include the bank process (i.e., this is not a
     // fence post error!)
-    printf("Main: waiting for %d children (ATMs + bank)...\n", atm_count + 1);
-    for (int i = 0; i <= atm_count; i++)
+    printf("Main: waiting for %d children (ATMs + bank)...\n", proc_count + 1);
+    for (int i = 0; i <= proc_count + replicas + (linked > 0); i++)
     {
         wait(NULL);
     }
+    shared ? ledger_unlink(LEDGER_SEGMENT) : (void)0;
+    logged ? changelog_unlink(CHANGELOG_SEGMENT) : (void)0;
+    stats_print();
+    stats_latency_summary(lat);
+    stats_close();
     printf("Main: all children finished. Exiting.\n");
     return 0;
 }
+
+// This is the main driver file for the bank simulation.
+// The `main` function takes one argument, the name of a
+// trace file to use.  The test directory contains a
+// short sample trace that exercises at least one interesting
+// case.
+//
+// With -S the bank runs alone as a daemon on a Unix socket, sized by
+// the trace header. With -C the ATMs of the trace (or a range of them)
+// connect to such a daemon instead of being paired with a forked bank.
+// With -w the ATMs are spread over that many worker processes, each
+// running its share as logical ATMs over a single pipe pair. With -o
+// the ATMs replay open-loop, once for each offered load given, and the
+// latency measured at each load is reported at the end.
+
+int main(int argc, char *argv[])
+{
+    const char *serve_sock = NULL;
+    const char *client_sock = NULL;
+    int workers = 0;
+    double loads[MAX_LOADS];
+    int load_count = 0;
+    const char *kind_name = "poisson";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "S:C:w:o:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'o':
+            load_count = parse_loads(optarg, loads);
+            break;
+        case 'a':
+            kind_name = optarg;
+            break;
+        case 'S':
+            serve_sock = optarg;
+            break;
+        case 'C':
+            client_sock = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    int extra = argc - optind - 1;
+    bool bad_args = extra < 0 || (serve_sock && client_sock) ||
+                    (!client_sock && extra != 0) || extra > 2 ||
+                    load_count < 0 || schedule_kind(kind_name) < 0;
+    if (bad_args)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    int result = 0;
+    int atm_count = 0;
+    int account_count = 0;
+
+    // open the trace file
+    const char *t_file = argv[optind];
+    result = trace_open(t_file);
+    if (result == -1)
+    {
+        printf("%s: could not open file %s\n", argv[0], t_file);
+        exit(1);
+    }
+
+    // Get the number of ATMs and accounts:
+    atm_count = trace_atm_count();
+    account_count = trace_account_count();
+    trace_close();
+    printf("Main: ATM count = %d, Account count = %d\n", atm_count, account_count);
+
+    if (serve_sock)
+    {
+        return serve_bank(serve_sock, atm_count, account_count);
+    }
+
+    // A closed-loop run is a single run with nothing to report.
+    StatsLatency lat[MAX_LOADS];
+    double secs[MAX_LOADS];
+    int runs = load_count > 0 ? load_count : 1;
+
+    for (int r = 0; r < runs; r++)
+    {
+        // the offered load is spread evenly over all ATMs of the trace
+        if (load_count > 0)
+        {
+            printf("Main: offering %.0f commands/s\n", loads[r]);
+            atm_open_loop(schedule_kind(kind_name), loads[r] / atm_count);
+        }
+
+        double start = now_secs();
+        if (client_sock)
+        {
+            int first = extra > 0 ? atoi(argv[optind + 1]) : 0;
+            int count = extra > 1 ? atoi(argv[optind + 2]) : atm_count - first;
+            connect_atms(client_sock, t_file, first, count, load_count > 0,
+                         &lat[r]);
+        }
+        else
+        {
+            // open-loop ATMs are logical ATMs, one per worker by default
+            int procs = (load_count > 0 && workers == 0) ? atm_count : workers;
+            run_simulation(t_file, atm_count, account_count, procs, &lat[r]);
+        }
+        secs[r] = now_secs() - start;
+    }
+
+    if (load_count > 0)
+    {
+        load_report(kind_name, load_count, loads, secs, lat);
+    }
+    return 0;
+}
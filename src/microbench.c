@@ -0,0 +1,801 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "aggregate.h"
+#include "bank.h"
+#include "command.h"
+#include "eod.h"
+#include "errors.h"
+#include "fair.h"
+#include "history.h"
+#include "io.h"
+#include "pages.h"
+#include "relabel.h"
+#include "stm.h"
+#include "timer.h"
+#include "trace.h"
+#include "velocity.h"
+
+// microbench times the building blocks of the simulator on their own:
+// packing commands, reading traces, the pipe round trip and the bank's
+// poll scan. Every benchmark is run a few times to warm up, then
+// repeated, and summarized as nanoseconds per operation, one line per
+// benchmark and parameter so runs can be compared with a diff or a
+// script:
+//
+//   bench=cmd_pack param=0 reps=10 ops=1000000 min_ns=... median_ns=...
+//
+// With -c the same fields are printed as CSV instead.
+
+// Each benchmark runs `ops` operations for a parameter and returns the
+// seconds they took, or a negative value if it could not run.
+typedef double (*BenchFn)(int param, int ops);
+
+typedef struct bench {
+  const char *name;
+  BenchFn fn;
+  int base_ops;     // operations per repetition at scale 1
+  int scale_down;   // divide base_ops by the parameter
+  int params[8];    // parameters to run with, ending with -1
+} Bench;
+
+// Results are stored here so the compiler cannot drop the work.
+static volatile int sink;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The commands the pack benchmarks cycle through.
+#define CMD_RING 64
+
+// packs commands with changing fields
+
+static double bench_cmd_pack(int param, int ops) {
+  (void)param;
+  static Command cmds[CMD_RING];
+  double start = now();
+  for (int i = 0; i < ops; i++)
+    cmd_pack(&cmds[i % CMD_RING], DEPOSIT + i % 3, i & 0xff, i, i + 1, i & 0xfff);
+  double secs = now() - start;
+  sink = cmds[ops % CMD_RING].id[0];
+  return secs;
+}
+
+// unpacks previously packed commands
+
+static double bench_cmd_unpack(int param, int ops) {
+  (void)param;
+  static Command cmds[CMD_RING];
+  for (int i = 0; i < CMD_RING; i++)
+    MSG_TRANSFER(&cmds[i], i, i * 7, i * 13, i * 100);
+
+  int sum = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    cmd_t c;
+    int id, from, to, amt;
+    cmd_unpack(&cmds[i % CMD_RING], &c, &id, &from, &to, &amt);
+    sum += c + id + from + to + amt;
+  }
+  double secs = now() - start;
+  sink = sum;
+  return secs;
+}
+
+// the commands the wire benchmarks cycle through: status-only replies
+// (param 0) or transfers with every field
+static void wire_ring(Command *cmds, int param) {
+  for (int i = 0; i < CMD_RING; i++)
+    if (param == 0)
+      MSG_NOFUNDS(&cmds[i], i, -1, -1);
+    else
+      MSG_TRANSFER(&cmds[i], i, i * 7, i * 13, i * 100);
+}
+
+// encodes commands in the compact protocol
+
+static double bench_wire_encode(int param, int ops) {
+  static Command cmds[CMD_RING];
+  static byte out[CMD_RING * CMD_WIRE_MAX];
+  wire_ring(cmds, param);
+
+  int len = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    if (i % CMD_RING == 0) len = 0;
+    len += cmd_encode(&cmds[i % CMD_RING], out + len);
+  }
+  double secs = now() - start;
+  sink = len + out[0];
+  return secs;
+}
+
+// decodes previously encoded commands
+
+static double bench_wire_decode(int param, int ops) {
+  static Command cmds[CMD_RING];
+  static byte in[CMD_RING * CMD_WIRE_MAX];
+  wire_ring(cmds, param);
+  int len = 0;
+  for (int i = 0; i < CMD_RING; i++) len += cmd_encode(&cmds[i], in + len);
+
+  Command c;
+  int at = 0, sum = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    if (at == len) at = 0;
+    at += cmd_decode(in + at, len - at, &c);
+    sum += c.amt[3];
+  }
+  double secs = now() - start;
+  sink = sum;
+  return secs;
+}
+
+// writes a trace of `cmd_cnt` commands to a temporary file, returning
+// its name (to be unlinked by the caller) or NULL
+
+static char *make_trace(int cmd_cnt) {
+  static char path[] = "/tmp/microbench-XXXXXX";
+  strcpy(path + strlen(path) - 6, "XXXXXX");
+  int fd = mkstemp(path);
+  if (fd < 0) return NULL;
+
+  byte header[8] = {0, 0, 0, 1, 0, 0, 0, 100};
+  Command *cmds = malloc(sizeof(Command) * cmd_cnt);
+  for (int i = 0; i < cmd_cnt; i++) MSG_DEPOSIT(&cmds[i], 0, i % 100, i);
+  int ok = write(fd, header, sizeof(header)) == sizeof(header) &&
+           checked_write(fd, cmds, sizeof(Command) * cmd_cnt) == SUCCESS;
+  free(cmds);
+  close(fd);
+  if (!ok) {
+    unlink(path);
+    return NULL;
+  }
+  return path;
+}
+
+// reads a trace one command at a time (param 1), as the ATMs used to,
+// or `param` commands per call
+
+static double bench_trace_read(int param, int ops) {
+  char *path = make_trace(ops);
+  if (path == NULL || trace_open(path) == -1) return -1;
+
+  Command *cmds = malloc(sizeof(Command) * param);
+  int got = 0;
+  double start = now();
+  if (param == 1) {
+    while (trace_read_cmd(cmds) == MESSAGE_SIZE) got++;
+  } else {
+    int n;
+    while ((n = trace_read_cmds(cmds, param)) > 0) got += n;
+  }
+  double secs = now() - start;
+
+  sink = cmds[0].cmd[0];
+  free(cmds);
+  trace_close();
+  unlink(path);
+  return got == ops ? secs : -1;
+}
+
+// times round trips of `param`-frame messages to a child process that
+// echoes them back over a pipe pair
+
+static double bench_pingpong(int param, int ops) {
+  int to_child[2], to_parent[2];
+  if (pipe(to_child) == -1 || pipe(to_parent) == -1) return -1;
+
+  int n = param * MESSAGE_SIZE;
+  Command *msg = calloc(param, sizeof(Command));
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(to_child[1]);
+    close(to_parent[0]);
+    while (checked_read(to_child[0], msg, n) == SUCCESS)
+      if (checked_write(to_parent[1], msg, n) != SUCCESS) break;
+    exit(0);
+  }
+  close(to_child[0]);
+  close(to_parent[1]);
+
+  double secs = -1;
+  if (pid > 0) {
+    int i = 0;
+    double start = now();
+    for (; i < ops; i++) {
+      MSG_BALANCE(msg, 0, i);
+      if (checked_write(to_child[1], msg, n) != SUCCESS ||
+          checked_read(to_parent[0], msg, n) != SUCCESS)
+        break;
+    }
+    if (i == ops) secs = now() - start;
+  }
+
+  close(to_child[1]);
+  close(to_parent[0]);
+  if (pid > 0) waitpid(pid, NULL, 0);
+  free(msg);
+  return secs;
+}
+
+// times the bank's `find_ready_atm` over `param` pipes, with input
+// waiting on all of them (so one poll serves many calls) or on one
+
+static double find_ready(int param, int ops, int all_ready) {
+  int *fds = malloc(sizeof(int) * 2 * param);
+  int made = 0;
+  while (made < param && pipe(&fds[2 * made]) == 0) made++;
+
+  double secs = -1;
+  if (made == param) {
+    int *in_fd = malloc(sizeof(int) * param);
+    char b = 0;
+    for (int i = 0; i < param; i++) {
+      in_fd[i] = fds[2 * i];
+      if ((all_ready || i == param - 1) && write(fds[2 * i + 1], &b, 1) != 1)
+        break;
+    }
+
+    // the input is never read, so every poll finds the same fds ready
+    bench_poll_open(param, in_fd);
+    int sum = 0;
+    double start = now();
+    for (int i = 0; i < ops; i++) sum += bench_find_ready_atm();
+    secs = now() - start;
+    sink = sum;
+    bench_poll_close();
+    free(in_fd);
+  }
+
+  for (int i = 0; i < 2 * made; i++) close(fds[i]);
+  free(fds);
+  return secs;
+}
+
+static double bench_find_ready_all(int param, int ops) {
+  return find_ready(param, ops, 1);
+}
+
+static double bench_find_ready_one(int param, int ops) {
+  return find_ready(param, ops, 0);
+}
+
+// the balance the end-of-day rules leave, worked out one account at
+// a time, to check the sweep against
+
+static int eod_reference(int b, const EodRules *rules) {
+  long long held = b > 0 ? b : 0;
+  if (b < rules->min_balance)
+    return b - (held < rules->fee ? held : rules->fee);
+  long long earns = held * rules->interest_bp / 10000;
+  return earns < INT_MAX - held ? b + earns : INT_MAX;
+}
+
+// the balance of account i before a sweep: a mix of accounts that earn
+// interest and accounts that pay fees, many of them exact multiples of
+// 100 and a few close to INT_MAX
+static int eod_balance(int i) {
+  if (i % 97 == 0) return INT_MAX - i % 1000;
+  return i % 3 == 0 ? (i % 5000) * 100 : (i * 7919) % 5000;
+}
+
+// times the end-of-day sweep over `ops` accounts on `param` threads at
+// 1% interest; ops_per_sec is then accounts per second. It fails if
+// any balance differs from the one the rules give.
+
+static double bench_eod_sweep(int param, int ops) {
+  int *accounts = malloc(sizeof(int) * ops);
+  if (accounts == NULL) return -1;
+  for (int i = 0; i < ops; i++) accounts[i] = eod_balance(i);
+
+  EodRules rules = {100, EOD_FEE, EOD_MIN_BALANCE};
+  EodTotals totals;
+  eod_sweep(accounts, ops, &rules, param, &totals);
+  int exact = 1;
+  for (int i = 0; i < ops && exact; i++)
+    exact = accounts[i] == eod_reference(eod_balance(i), &rules);
+  sink = accounts[ops / 2];
+  free(accounts);
+  return totals.threads == param && exact ? totals.secs : -1;
+}
+
+// times the velocity limit check a debit goes through, spread over
+// `param` accounts, or with no limits set for param 0; the difference
+// is what the limits add to a transaction
+
+static double bench_velocity(int param, int ops) {
+  VelocityLimits limits = {VELOCITY_MAX_COUNT, 2000000000, 1000};
+  if (velocity_open(param > 0 ? &limits : NULL, param) < 0) return -1;
+
+  int n = param > 0 ? param : 1;
+  int sum = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++)
+    sum += velocity_charge((unsigned)(i * 2654435761u) % n, 1);
+  double secs = now() - start;
+  sink = sum;
+  velocity_close();
+  return secs;
+}
+
+// times appending to the history of `param` accounts
+
+static double bench_history_add(int param, int ops) {
+  if (history_open(param, HISTORY_DEFAULT_CAP) < 0) return -1;
+  double start = now();
+  for (int i = 0; i < ops; i++)
+    history_add(DEPOSIT, -1, (unsigned)(i * 2654435761u) % param, i);
+  double secs = now() - start;
+  history_close();
+  return secs;
+}
+
+// The history the statement benchmark reads: HISTORY_ACCOUNTS
+// accounts holding HISTORY_PER_ACCOUNT entries each, over 16M in all.
+#define HISTORY_ACCOUNTS (1 << 17)
+#define HISTORY_PER_ACCOUNT 128
+
+// times a STATEMENT of the last `param` entries of a random account.
+// The history is built on first use and reported on standard error.
+
+static double bench_statement(int param, int ops) {
+  static int built = 0;
+  if (!built) {
+    if (history_open(HISTORY_ACCOUNTS, HISTORY_PER_ACCOUNT) < 0) return -1;
+    for (int i = 0; i < HISTORY_ACCOUNTS * HISTORY_PER_ACCOUNT; i++)
+      history_add(TRANSFER, i % HISTORY_ACCOUNTS,
+                  (i + 1) % HISTORY_ACCOUNTS, i & 0xfff);
+    long entries, bytes;
+    history_usage(&entries, &bytes);
+    fprintf(stderr, "history entries=%ld bytes=%ld bytes_per_entry=%.2f\n",
+            entries, bytes, (double)bytes / entries);
+    built = 1;
+  }
+
+  Command out[STATEMENT_MAX_ENTRIES];
+  int n = param < STATEMENT_MAX_ENTRIES ? param : STATEMENT_MAX_ENTRIES;
+  int sum = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++)
+    sum += history_last((unsigned)(i * 2654435761u) % HISTORY_ACCOUNTS, n, out);
+  double secs = now() - start;
+  sink = sum + out[0].id[3];
+  return sum == ops * n ? secs : -1;
+}
+
+// The accounts the aggregate benchmarks run over, with balances
+// spread by a hash so the top accounts are scattered.
+#define AGG_ACCOUNTS (1 << 22)
+
+static int *agg_balances() {
+  static int *balances = NULL;
+  if (balances == NULL) {
+    balances = malloc(sizeof(int) * AGG_ACCOUNTS);
+    for (int i = 0; i < AGG_ACCOUNTS; i++)
+      balances[i] = (unsigned)(i * 2654435761u) % 1000000;
+  }
+  return balances;
+}
+
+// times keeping the aggregates up to date over `param` accounts
+
+static double bench_aggregate_update(int param, int ops) {
+  int *b = agg_balances();
+  if (aggregate_open(b, param) < 0) return -1;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    int acc = (unsigned)(i * 2654435761u) % param;
+    int delta = (i & 1) ? 100 : -100;
+    b[acc] += delta;
+    aggregate_update(acc, delta);
+  }
+  double secs = now() - start;
+  aggregate_close();
+  return secs;
+}
+
+// times a query of the top `param` accounts, or of a range sum over
+// `param` accounts, over AGG_ACCOUNTS accounts
+
+static double bench_topk(int param, int ops) {
+  if (aggregate_open(agg_balances(), AGG_ACCOUNTS) < 0) return -1;
+  int top[TOPK_MAX];
+  int sum = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++) sum += aggregate_top(param, top);
+  double secs = now() - start;
+  sink = sum + top[0];
+  aggregate_close();
+  return secs;
+}
+
+static double bench_range_sum(int param, int ops) {
+  if (aggregate_open(agg_balances(), AGG_ACCOUNTS) < 0) return -1;
+  long long sum = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    int lo = (unsigned)(i * 2654435761u) % (AGG_ACCOUNTS - param + 1);
+    sum += aggregate_range_sum(lo, lo + param - 1);
+  }
+  double secs = now() - start;
+  sink = sum;
+  aggregate_close();
+  return secs;
+}
+
+// times what the queries replace: one scan of AGG_ACCOUNTS balances
+// for the largest one and the total
+
+static double bench_scan(int param, int ops) {
+  (void)param;
+  int *b = agg_balances();
+  long long sum = 0;
+  int best = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    for (int j = 0; j < AGG_ACCOUNTS; j++) {
+      sum += b[j];
+      best = b[j] > b[best] ? j : best;
+    }
+  }
+  double secs = now() - start;
+  sink = sum + best;
+  return secs;
+}
+
+// times the idle timers of `param` connections as the bank keeps them:
+// every command re-arms its connection's timer 1000 ticks ahead, and
+// the clock moves on a tick every 16 commands, re-arming whatever
+// expires.
+
+static double bench_timer(int param, int ops) {
+  static TimerWheel w;
+  Timer *timers = malloc(sizeof(Timer) * param);
+  timer_wheel_init(&w, 0);
+  for (int i = 0; i < param; i++) {
+    timer_init(&timers[i], i);
+    timer_arm(&w, &timers[i], 1000);
+  }
+
+  int expired = 0;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    timer_arm(&w, &timers[(unsigned)(i * 2654435761u) % param], w.now + 1000);
+    if ((i & 15) == 15) {
+      Timer *t = timer_advance(&w, w.now + 1);
+      while (t != NULL) {
+        Timer *next = t->next; // arming relinks t
+        timer_arm(&w, t, w.now + 1000);
+        t = next;
+        expired++;
+      }
+    }
+  }
+  double secs = now() - start;
+  sink = expired;
+  free(timers);
+  return secs;
+}
+
+// times working out the outcomes of batches of BATCH_MAX_LEGS legs
+// over 1000 accounts on `param` threads, or applying them one by one
+// for param 0; ops is the number of legs. The accounts start poor
+// enough that some legs hit NOFUNDS.
+
+static double bench_stm(int param, int ops) {
+  enum { ACCOUNTS = 1000 };
+  static Command legs[BATCH_MAX_LEGS];
+  static cmd_t outcome[BATCH_MAX_LEGS];
+  static int balances[ACCOUNTS];
+  if (param > 0 && stm_open(param) < 0) return -1;
+
+  for (int k = 0; k < BATCH_MAX_LEGS; k++) {
+    unsigned r = k * 2654435761u;
+    cmd_t c = (cmd_t[]){DEPOSIT, WITHDRAW, TRANSFER}[r % 3];
+    cmd_pack(&legs[k], c, 0, (r >> 4) % ACCOUNTS, (r >> 14) % ACCOUNTS,
+             (r >> 24) % 200);
+  }
+
+  int sum = 0;
+  double start = now();
+  for (int done = 0; done < ops; done += BATCH_MAX_LEGS) {
+    for (int a = 0; a < ACCOUNTS; a++) balances[a] = 100;
+    if (param > 0) {
+      sum += stm_run(legs, BATCH_MAX_LEGS, balances, ACCOUNTS, outcome);
+      continue;
+    }
+    for (int k = 0; k < BATCH_MAX_LEGS; k++) {
+      cmd_t c;
+      int i, f, t, a;
+      cmd_unpack(&legs[k], &c, &i, &f, &t, &a);
+      if (c != DEPOSIT && balances[f] < a) continue;
+      if (c != DEPOSIT) balances[f] -= a;
+      if (c != WITHDRAW) balances[t] += a;
+      sum++;
+    }
+  }
+  double secs = now() - start;
+  sink = sum;
+  if (param > 0) stm_close();
+  return secs;
+}
+
+// times balance updates over 64M accounts where 16384 scattered
+// accounts get 95% of the updates, straight into the array for param
+// 0, and through the remap table after relabeling for param 1
+
+static double bench_relabel(int param, int ops) {
+  enum { ACCOUNTS = 1 << 26, HOT = 16384 };
+  int *balances = calloc(ACCOUNTS, sizeof(int));
+  int *ids = malloc(sizeof(int) * ops);
+  if (balances == NULL || ids == NULL) {
+    free(balances);
+    free(ids);
+    return -1;
+  }
+  unsigned r = 12345;
+  for (int i = 0; i < ops; i++) {
+    r = r * 1103515245u + 12345u;
+    unsigned pick = r >> 8;
+    ids[i] = pick % 100 < 95 ? (int)((pick / 100 % HOT) * 2654435761u % ACCOUNTS)
+                           : (int)(pick % ACCOUNTS);
+  }
+
+  if (param > 0) {
+    double share;
+    relabel_open(ACCOUNTS, ops);
+    for (int i = 0; i < ops; i++) relabel_count(ids[i]);
+    relabel_build(balances, &share);
+  }
+
+  double start = now();
+  if (param > 0)
+    for (int i = 0; i < ops; i++) balances[relabel_slot(ids[i])]++;
+  else
+    for (int i = 0; i < ops; i++) balances[ids[i]]++;
+  double secs = now() - start;
+  sink = balances[relabel_slot(ids[0])];
+  relabel_close();
+  free(balances);
+  free(ids);
+  return secs;
+}
+
+// The page benchmarks take the kind of pages as param % 4 and the
+// placement as param / 4 (see pages.h), and zero on every CPU.
+static PagePlan page_plan(int param) {
+  PagePlan plan = {param % 4, param / 4, sysconf(_SC_NPROCESSORS_ONLN)};
+  if (plan.numa != NUMA_FIRST_TOUCH && plan.pages == PAGES_MALLOC)
+    plan.pages = PAGES_SMALL;
+  return plan;
+}
+
+// times allocating and zeroing a balance array of `ops` accounts
+
+static double bench_pages_alloc(int param, int ops) {
+  PagePlan plan = page_plan(param);
+  PageReport report;
+  int *balances = pages_alloc(sizeof(int) * (unsigned long)ops, &plan, &report);
+  if (balances == NULL) return -1;
+  sink = balances[ops - 1];
+  pages_free(balances, &report);
+  return report.secs;
+}
+
+// times updates of random balances among 64M accounts, where nearly
+// every one misses the TLB on small pages
+
+static double bench_pages_random(int param, int ops) {
+  enum { ACCOUNTS = 1 << 26 };
+  PagePlan plan = page_plan(param);
+  PageReport report;
+  int *balances = pages_alloc(sizeof(int) * ACCOUNTS, &plan, &report);
+  if (balances == NULL) return -1;
+
+  unsigned x = 2463534242u;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    balances[x & (ACCOUNTS - 1)]++;
+  }
+  double secs = now() - start;
+  sink = balances[x & (ACCOUNTS - 1)];
+  pages_free(balances, &report);
+  return secs;
+}
+
+// times queueing a command and serving one through the fair
+// scheduler with `param` ATMs, each holding a few commands of mixed
+// classes
+
+static double bench_fair(int param, int ops) {
+  static const cmd_t types[] = {TRANSFER, BALANCE, DEPOSIT, STATEMENT};
+  setenv("BANKSIM_FAIR", "1", 1);
+  int on = fair_open(param);
+  unsetenv("BANKSIM_FAIR");
+  if (on < 0) return -1;
+
+  Command cmd;
+  for (int i = 0; i < 4 * param; i++) {
+    MSG_BALANCE(&cmd, i % param, 0);
+    fair_push(i % param, &cmd, 0);
+  }
+  unsigned x = 2463534242u;
+  long served = 0;
+  int from;
+  double start = now();
+  for (int i = 0; i < ops; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    cmd_pack(&cmd, types[x & 3], x % param, 0, 1, 10);
+    fair_push(x % param, &cmd, 0);
+    served += fair_pop(&from) != NULL;
+  }
+  double secs = now() - start;
+  sink = served;
+  fair_close();
+  return secs;
+}
+
+static Bench benches[] = {
+    {"cmd_pack", bench_cmd_pack, 2000000, 0, {0, -1}},
+    {"cmd_unpack", bench_cmd_unpack, 2000000, 0, {0, -1}},
+    {"wire_encode", bench_wire_encode, 2000000, 0, {0, 1, -1}},
+    {"wire_decode", bench_wire_decode, 2000000, 0, {0, 1, -1}},
+    {"trace_read", bench_trace_read, 200000, 0, {1, 64, 1024, -1}},
+    {"pingpong", bench_pingpong, 20000, 0, {1, 16, 256, -1}},
+    {"find_ready_all", bench_find_ready_all, 200000, 0,
+     {1, 16, 64, 256, 1024, 4096, -1}},
+    {"find_ready_one", bench_find_ready_one, 400000, 1,
+     {1, 16, 64, 256, 1024, 4096, -1}},
+    {"eod_sweep", bench_eod_sweep, 16 << 20, 0, {1, 2, 4, 8, -1}},
+    {"velocity", bench_velocity, 2000000, 0, {0, 100, 1 << 20, -1}},
+    {"history_add", bench_history_add, 2000000, 0, {100, 1 << 20, -1}},
+    {"statement", bench_statement, 200000, 1, {1, 16, 128, -1}},
+    {"aggregate_update", bench_aggregate_update, 2000000, 0,
+     {100, 1 << 16, AGG_ACCOUNTS, -1}},
+    {"topk", bench_topk, 200000, 1, {1, 16, 256, -1}},
+    {"range_sum", bench_range_sum, 2000000, 0, {1000, 1 << 20, -1}},
+    {"scan", bench_scan, 20, 0, {0, -1}},
+    {"timer", bench_timer, 2000000, 0, {100, 1 << 16, -1}},
+    {"relabel", bench_relabel, 1 << 22, 0, {0, 1, -1}},
+    {"stm", bench_stm, 1 << 20, 0, {0, 2, 4, 8, -1}},
+    {"pages_alloc", bench_pages_alloc, 1 << 24, 0, {0, 1, 2, 3, 6, 10, -1}},
+    {"pages_random", bench_pages_random, 1 << 22, 0, {0, 1, 2, 3, 6, 10, -1}},
+    {"fair", bench_fair, 2000000, 0, {1, 16, 1024, -1}},
+};
+
+#define BENCH_CNT (int)(sizeof(benches) / sizeof(benches[0]))
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// runs one benchmark and prints its summary line
+
+static void run(Bench *b, int param, int warmups, int reps, double scale,
+                int csv) {
+  int ops = (int)(b->base_ops * scale) / (b->scale_down ? param : 1);
+  if (ops < 1) ops = 1;
+
+  for (int i = 0; i < warmups; i++) b->fn(param, ops);
+
+  double ns[reps];
+  for (int i = 0; i < reps; i++) {
+    double secs = b->fn(param, ops);
+    if (secs < 0) {
+      printf(csv ? "%s,%d,failed\n" : "bench=%s param=%d failed\n", b->name,
+             param);
+      return;
+    }
+    ns[i] = secs * 1e9 / ops;
+  }
+
+  qsort(ns, reps, sizeof(double), cmp_double);
+  double mean = 0;
+  for (int i = 0; i < reps; i++) mean += ns[i];
+  mean /= reps;
+  double var = 0;
+  for (int i = 0; i < reps; i++) var += (ns[i] - mean) * (ns[i] - mean);
+  double stddev = reps > 1 ? sqrt(var / (reps - 1)) : 0;
+  double median = reps % 2 ? ns[reps / 2]
+                           : (ns[reps / 2 - 1] + ns[reps / 2]) / 2;
+
+  printf(csv ? "%s,%d,%d,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.0f\n"
+             : "bench=%s param=%d reps=%d ops=%d min_ns=%.2f median_ns=%.2f "
+               "mean_ns=%.2f stddev_ns=%.2f max_ns=%.2f ops_per_sec=%.0f\n",
+         b->name, param, reps, ops, ns[0], median, mean, stddev,
+         ns[reps - 1], 1e9 / median);
+  fflush(stdout);
+}
+
+static void usage(const char *prog) {
+  printf("usage: %s [-r reps] [-w warmups] [-s scale] [-p cpu] [-c] "
+         "[bench...]\n",
+         prog);
+  printf("benchmarks:");
+  for (int i = 0; i < BENCH_CNT; i++) printf(" %s", benches[i].name);
+  printf("\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int reps = 10;
+  int warmups = 2;
+  double scale = 1;
+  int cpu = -1;
+  int csv = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:w:s:p:c")) != -1) {
+    switch (opt) {
+      case 'r':
+        reps = atoi(optarg);
+        break;
+      case 'w':
+        warmups = atoi(optarg);
+        break;
+      case 's':
+        scale = atof(optarg);
+        break;
+      case 'p':
+        cpu = atoi(optarg);
+        break;
+      case 'c':
+        csv = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (reps < 1 || warmups < 0 || scale <= 0) usage(argv[0]);
+
+  // Pinning to one CPU keeps the scheduler from moving the benchmark
+  // (the ping-pong child inherits the same CPU).
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+      perror("sched_setaffinity");
+      exit(1);
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = optind; i < argc; i++) {
+    int known = 0;
+    for (int j = 0; j < BENCH_CNT; j++) known |= !strcmp(argv[i], benches[j].name);
+    if (!known) usage(argv[0]);
+  }
+
+  if (csv)
+    printf("bench,param,reps,ops,min_ns,median_ns,mean_ns,stddev_ns,max_ns,"
+           "ops_per_sec\n");
+  for (int j = 0; j < BENCH_CNT; j++) {
+    int wanted = optind == argc;
+    for (int i = optind; i < argc; i++) wanted |= !strcmp(argv[i], benches[j].name);
+    if (!wanted) continue;
+    for (int k = 0; benches[j].params[k] >= 0; k++)
+      run(&benches[j], benches[j].params[k], warmups, reps, scale, csv);
+  }
+  return 0;
+}
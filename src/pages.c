@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include "pages.h"
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HUGE_PAGE (2ul << 20)
+
+// A zeroing thread takes at least this much; below that starting a
+// thread costs more than it saves.
+#define PAGES_MIN_CHUNK (4ul << 20)
+
+#define PAGES_MAX_THREADS 256
+
+// The nodes a placement can name.
+#define MAX_NODES 1024
+#define MASK_WORDS (MAX_NODES / (8 * sizeof(unsigned long)))
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+static const char *page_names[] = {"malloc", "small", "thp", "huge"};
+static const char *numa_names[] = {"first-touch", "interleave", "local"};
+
+// The part of the array one thread zeroes.
+typedef struct span {
+  char *lo;
+  unsigned long len;
+} Span;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char *pages_name(int pages) { return page_names[pages]; }
+
+const char *numa_name(int numa) { return numa_names[numa]; }
+
+// finds `name` among the `n` names; -1 if it is not there
+static int name_index(const char *name, const char **names, int n) {
+  for (int k = 0; k < n; k++)
+    if (strcmp(name, names[k]) == 0) return k;
+  return -1;
+}
+
+int pages_plan(PagePlan *plan) {
+  plan->pages = PAGES_MALLOC;
+  plan->numa = NUMA_FIRST_TOUCH;
+  plan->threads = 1;
+  int ok = 1;
+
+  char *eval = getenv("BANKSIM_PAGES");
+  int k = eval ? name_index(eval, page_names, 4) : PAGES_MALLOC;
+  if (k < 0) ok = -1;
+  else plan->pages = k;
+
+  eval = getenv("BANKSIM_NUMA");
+  k = eval ? name_index(eval, numa_names, 3) : NUMA_FIRST_TOUCH;
+  if (k < 0) ok = -1;
+  else plan->numa = k;
+
+  // a placement is set on a mapping of its own
+  if (plan->numa != NUMA_FIRST_TOUCH && plan->pages == PAGES_MALLOC)
+    plan->pages = PAGES_SMALL;
+  return ok;
+}
+
+// reads a list such as "0-3,8" from `path` into `mask`; returns the
+// number of entries, or 0 if there is no such file
+static int read_list(const char *path, unsigned long *mask) {
+  memset(mask, 0, MASK_WORDS * sizeof(unsigned long));
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return 0;
+
+  int n = 0, lo, hi;
+  while (fscanf(f, "%d", &lo) == 1) {
+    hi = lo;
+    int c = fgetc(f);
+    if (c == '-' && fscanf(f, "%d", &hi) == 1) c = fgetc(f);
+    for (int k = lo; k <= hi && k < MAX_NODES; k++, n++)
+      mask[k / WORD_BITS] |= 1ul << (k % WORD_BITS);
+    if (c != ',') break;
+  }
+  fclose(f);
+  return n;
+}
+
+// fills `mask` with the nodes a placement spreads over and returns how
+// many there are: every node with memory, or for a local placement
+// those among them with a CPU this thread may run on
+static int node_mask(int numa, unsigned long *mask) {
+  unsigned long memory[MASK_WORDS];
+  int n = read_list("/sys/devices/system/node/has_memory", memory);
+  memcpy(mask, memory, sizeof(memory));
+  if (n == 0 || numa == NUMA_INTERLEAVE) return n;
+
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) return n;
+  memset(mask, 0, sizeof(memory));
+  n = 0;
+  char path[64];
+  for (int node = 0; node < MAX_NODES; node++) {
+    if (!(memory[node / WORD_BITS] & 1ul << (node % WORD_BITS))) continue;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &cpus)) continue;
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu,
+               node);
+      if (access(path, F_OK) == 0) {
+        mask[node / WORD_BITS] |= 1ul << (node % WORD_BITS);
+        n++;
+        break;
+      }
+    }
+  }
+  return n;
+}
+
+// sets the placement of a mapping before any of it is touched; returns
+// the number of nodes it spans, or 0 if it could not be set
+static int place(char *p, unsigned long size, int numa) {
+  unsigned long mask[MASK_WORDS];
+  int nodes = node_mask(numa, mask);
+  if (nodes == 0) return 0;
+  int mode = numa == NUMA_INTERLEAVE ? MPOL_INTERLEAVE : MPOL_BIND;
+  if (syscall(SYS_mbind, p, size, mode, mask, MAX_NODES + 1, 0) < 0) return 0;
+  return nodes;
+}
+
+// maps `size` bytes, a multiple of HUGE_PAGE, of the kind of pages in
+// `pages`, which is changed to thp if no huge pages can be had
+static char *map_pages(unsigned long size, int *pages) {
+  int prot = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (*pages == PAGES_HUGE) {
+    void *p = mmap(NULL, size, prot, flags | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return p;
+    *pages = PAGES_THP;
+  }
+  if (*pages == PAGES_SMALL) {
+    void *p = mmap(NULL, size, prot, flags, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+  }
+
+  // every 2 MB of a mapping on a huge page boundary can be one page
+  char *p = mmap(NULL, size + HUGE_PAGE, prot, flags, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  char *aligned = (char *)(((unsigned long)p + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+  if (aligned > p) munmap(p, aligned - p);
+  if (aligned < p + HUGE_PAGE) munmap(aligned + size, p + HUGE_PAGE - aligned);
+  madvise(aligned, size, MADV_HUGEPAGE);
+  return aligned;
+}
+
+static void *zero_span(void *arg) {
+  Span *s = arg;
+  memset(s->lo, 0, s->len);
+  return NULL;
+}
+
+// zeroes `bytes` at `p` on up to `threads` threads, each taking a run
+// of whole huge pages; returns the number of threads used
+static int zero(char *p, unsigned long bytes, int threads) {
+  unsigned long most = bytes / PAGES_MIN_CHUNK;
+  if ((unsigned long)threads > most) threads = most;
+  if (threads > PAGES_MAX_THREADS) threads = PAGES_MAX_THREADS;
+  if (threads < 1) threads = 1;
+
+  Span spans[threads];
+  pthread_t tids[threads];
+  int started[threads];
+  unsigned long per = (bytes / threads + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+  for (int t = 0; t < threads; t++) {
+    unsigned long lo = t * per < bytes ? t * per : bytes;
+    unsigned long hi = t == threads - 1 || (t + 1) * per > bytes ? bytes : (t + 1) * per;
+    spans[t] = (Span){p + lo, hi - lo};
+  }
+
+  // the calling thread zeroes the first span itself; if a thread
+  // cannot be started, its span is zeroed here too
+  for (int t = 1; t < threads; t++)
+    started[t] = pthread_create(&tids[t], NULL, zero_span, &spans[t]) == 0;
+  zero_span(&spans[0]);
+  for (int t = 1; t < threads; t++) {
+    if (started[t]) pthread_join(tids[t], NULL);
+    else zero_span(&spans[t]);
+  }
+  return threads;
+}
+
+// the part of the mapping holding `p` that is on transparent huge
+// pages, from /proc/self/smaps
+static unsigned long thp_bytes(void *p) {
+  FILE *f = fopen("/proc/self/smaps", "r");
+  if (f == NULL) return 0;
+  char line[256];
+  unsigned long lo, hi, kb = 0;
+  int inside = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+      inside = lo <= (unsigned long)p && (unsigned long)p < hi;
+    else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return kb << 10;
+}
+
+void *pages_alloc(unsigned long bytes, const PagePlan *plan,
+                  PageReport *report) {
+  double start = now();
+  memset(report, 0, sizeof(PageReport));
+  report->pages = plan->pages;
+  report->numa = plan->numa;
+  report->bytes = bytes;
+
+  char *p;
+  if (plan->pages == PAGES_MALLOC) {
+    p = malloc(bytes > 0 ? bytes : 1);
+    if (p == NULL) return NULL;
+  } else {
+    unsigned long size = (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    p = map_pages(size > 0 ? size : HUGE_PAGE, &report->pages);
+    if (p == NULL) return NULL;
+    if (plan->numa != NUMA_FIRST_TOUCH) report->nodes = place(p, size, plan->numa);
+  }
+  report->threads = zero(p, bytes, plan->threads);
+
+  report->huge_bytes = report->pages == PAGES_HUGE ? bytes : thp_bytes(p);
+  if (report->huge_bytes > bytes) report->huge_bytes = bytes;
+  report->secs = now() - start;
+  return p;
+}
+
+void pages_free(void *p, const PageReport *report) {
+  if (p == NULL) return;
+  if (report->pages == PAGES_MALLOC) {
+    free(p);
+    return;
+  }
+  unsigned long size = (report->bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+  munmap(p, size > 0 ? size : HUGE_PAGE);
+}
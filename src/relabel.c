@@ -0,0 +1,152 @@
+#include "relabel.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The profile: a use count per account, while it is being taken.
+static unsigned *uses = NULL;
+static int accounts = 0;
+static int commands_left = 0;
+
+// An entry of the remap table; the account and its slot share a cache
+// line. Entries whose account is -1 are free.
+typedef struct entry {
+  int acc;
+  int slot;
+} Entry;
+
+// The remap table maps the moved accounts to their slots; any account
+// not in it is in its own slot.
+static Entry *table = NULL;
+static unsigned mask = 0;
+
+typedef struct hot {
+  int acc;
+  unsigned uses;
+} Hot;
+
+int relabel_profile_len() {
+  char *eval = getenv("BANKSIM_RELABEL");
+  if (eval == NULL) return 0;
+  char *end;
+  long n = strtol(eval, &end, 10);
+  return end == eval || *end != '\0' || n <= 0 || n > 1 << 30 ? -1 : n;
+}
+
+int relabel_open(int account_cnt, int commands) {
+  relabel_close();
+  uses = calloc(account_cnt, sizeof(unsigned));
+  if (uses == NULL) return -1;
+  accounts = account_cnt;
+  commands_left = commands;
+  return 1;
+}
+
+void relabel_close() {
+  free(uses);
+  free(table);
+  uses = NULL;
+  table = NULL;
+  mask = 0;
+  commands_left = 0;
+}
+
+int relabel_profiling() { return uses != NULL; }
+
+void relabel_count(int acc) {
+  if (uses != NULL && 0 <= acc && acc < accounts) uses[acc]++;
+}
+
+int relabel_command() { return uses != NULL && --commands_left == 0; }
+
+static unsigned hash(int acc) { return (unsigned)acc * 2654435761u; }
+
+// finds the entry of `acc` in a table, or the free entry it would go in
+static Entry *probe(Entry *t, int acc) {
+  unsigned h = hash(acc) & mask;
+  while (t[h].acc != -1 && t[h].acc != acc) h = (h + 1) & mask;
+  return &t[h];
+}
+
+// a table is the identity for the accounts not in it
+static int map_get(Entry *t, int acc) {
+  Entry *e = probe(t, acc);
+  return e->acc == -1 ? acc : e->slot;
+}
+
+static void map_set(Entry *t, int acc, int to) {
+  Entry *e = probe(t, acc);
+  e->acc = acc;
+  e->slot = to;
+}
+
+int relabel_slot(int acc) { return table == NULL ? acc : map_get(table, acc); }
+
+// busiest first, then by account number
+static int cmp_hot(const void *a, const void *b) {
+  const Hot *x = a, *y = b;
+  if (x->uses != y->uses) return x->uses < y->uses ? 1 : -1;
+  return (x->acc > y->acc) - (x->acc < y->acc);
+}
+
+int relabel_build(int *balances, double *hot_share) {
+  if (uses == NULL) return 0;
+
+  // the accounts the profile saw, busiest first
+  int seen = 0;
+  unsigned long long total = 0, hot_total = 0;
+  for (int a = 0; a < accounts; a++) seen += uses[a] > 0;
+  Hot *hot = malloc(sizeof(Hot) * (seen > 0 ? seen : 1));
+  if (hot == NULL) {
+    relabel_close();
+    return 0;
+  }
+  int n = 0;
+  for (int a = 0; a < accounts; a++) {
+    if (uses[a] == 0) continue;
+    hot[n++] = (Hot){a, uses[a]};
+    total += uses[a];
+  }
+  qsort(hot, n, sizeof(Hot), cmp_hot);
+  if (n > RELABEL_MAX_HOT) n = RELABEL_MAX_HOT;
+  free(uses);
+  uses = NULL;
+
+  // every swap adds at most two accounts, and the table is kept at
+  // most half full
+  unsigned size = 16;
+  while (size < 4u * n) size <<= 1;
+  mask = size - 1;
+  // and while it is built, the inverse says which account is in a slot
+  table = malloc(sizeof(Entry) * size);
+  Entry *inverse = malloc(sizeof(Entry) * size);
+  if (table == NULL || inverse == NULL) {
+    free(hot);
+    free(inverse);
+    relabel_close();
+    return 0;
+  }
+  memset(table, -1, sizeof(Entry) * size);
+  memset(inverse, -1, sizeof(Entry) * size);
+
+  // the k-th hottest account swaps places with whichever account is in
+  // slot k; the slots before k hold the hotter ones, which stay put
+  for (int k = 0; k < n; k++) {
+    int h = hot[k].acc;
+    int from = map_get(table, h);
+    hot_total += hot[k].uses;
+    if (from == k) continue;
+    int displaced = map_get(inverse, k);
+    map_set(table, h, k);
+    map_set(inverse, k, h);
+    map_set(table, displaced, from);
+    map_set(inverse, from, displaced);
+    int b = balances[k];
+    balances[k] = balances[from];
+    balances[from] = b;
+  }
+
+  free(hot);
+  free(inverse);
+  *hot_share = total > 0 ? (double)hot_total / total : 0;
+  return n;
+}
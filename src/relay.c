@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "errors.h"
+#include "timer.h"
+
+// A chunk in flight on a link; one of length 0 closes the link.
+typedef struct chunk {
+  struct chunk *next;
+  unsigned long long arrives; // us
+  unsigned long long read_at; // us
+  int len;
+  int sent; // bytes of it written so far
+  char data[];
+} Chunk;
+
+typedef struct link {
+  int in;
+  int out;           // -1 once closed
+  Chunk *head;       // in the order they arrive
+  Chunk *tail;
+  long queued;       // bytes
+  int eof;           // the writer has closed its end
+  int blocked;       // the reader's pipe is full
+  double wire_free;  // when the link is done sending, in us
+  unsigned long long last_arrival;
+  Timer timer;       // armed for the head chunk
+} Link;
+
+static TimerWheel wheel; // ticks are CLOCK_MONOTONIC microseconds
+
+static unsigned long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// parses a number >= 0 up to `sep`
+static int parse_field(const char **p, double *out) {
+  char *end;
+  *out = strtod(*p, &end);
+  if (end == *p || *out < 0 || (*end != ',' && *end != '\0')) return -1;
+  *p = *end == ',' ? end + 1 : end;
+  return 1;
+}
+
+int relay_plan(RelayPlan *plan) {
+  *plan = (RelayPlan){0, 0, 0};
+  const char *eval = getenv("BANKSIM_LINK");
+  if (eval == NULL) return 0;
+  double *fields[] = {&plan->delay_ms, &plan->jitter_ms, &plan->mbit_per_s};
+  for (int f = 0; f < 3 && (f == 0 || *eval != '\0'); f++)
+    if (parse_field(&eval, fields[f]) < 0) return -1;
+  return *eval == '\0' ? 1 : -1;
+}
+
+// a uniform draw in [-1, 1], the same from run to run
+static double jitter_draw() {
+  static unsigned long long x = 88172645463325252ULL;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return (double)(x >> 11) / (1ULL << 52) - 1;
+}
+
+// when a chunk of `len` bytes read at `now` comes out of link `l`
+static unsigned long long arrival(const RelayPlan *plan, Link *l, int len,
+                                  unsigned long long now) {
+  double start = l->wire_free > now ? l->wire_free : now;
+  // at 1 Mbit/s a bit takes 1 us
+  l->wire_free = plan->mbit_per_s > 0 ? start + len * 8 / plan->mbit_per_s : start;
+  double at = l->wire_free + (plan->delay_ms + plan->jitter_ms * jitter_draw()) * 1e3;
+  unsigned long long due = at > now ? (unsigned long long)at : now;
+  if (due < l->last_arrival) due = l->last_arrival;
+  l->last_arrival = due;
+  return due;
+}
+
+static void free_chunks(Link *l) {
+  while (l->head) {
+    Chunk *c = l->head;
+    l->head = c->next;
+    free(c);
+  }
+  l->tail = NULL;
+  l->queued = 0;
+}
+
+// writes out the chunks of a link that have arrived by `now`, and arms
+// its timer for the next one. It returns 1 when the link is closed.
+static int deliver(Link *l, unsigned long long now) {
+  l->blocked = 0;
+  while (l->head && l->head->arrives <= now) {
+    Chunk *c = l->head;
+    if (c->len == 0) {
+      // the writer closed: so does the reader's end, once the bytes
+      // before the close are in
+      if (l->out >= 0) close(l->out);
+      l->out = -1;
+      free_chunks(l);
+      return 1;
+    }
+    if (l->out >= 0) {
+      int n = write(l->out, c->data + c->sent, c->len - c->sent);
+      if (n < 0 && errno == EAGAIN) {
+        l->blocked = 1;
+        return 0;
+      }
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        // the reader is gone; what is left is dropped until the close
+        close(l->out);
+        l->out = -1;
+      } else if ((c->sent += n) < c->len) {
+        continue;
+      }
+    }
+    l->head = c->next;
+    if (l->head == NULL) l->tail = NULL;
+    l->queued -= c->len;
+    free(c);
+  }
+  if (l->head) timer_arm(&wheel, &l->timer, l->head->arrives);
+  return 0;
+}
+
+// reads what is waiting on a link into a chunk; it returns -1 if the
+// read failed
+static int take(const RelayPlan *plan, Link *l, char *buf,
+                unsigned long long now, long long *held) {
+  int n = read(l->in, buf, RELAY_CHUNK);
+  if (n < 0) return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  Chunk *c = malloc(sizeof(Chunk) + n);
+  if (c == NULL) return -1;
+  memcpy(c->data, buf, n);
+  c->next = NULL;
+  c->len = n;
+  c->sent = 0;
+  c->read_at = now;
+  c->arrives = arrival(plan, l, n, now);
+  if (n > 0) *held += c->arrives - now;
+  if (n == 0) {
+    l->eof = 1;
+    close(l->in);
+  }
+  if (l->tail) l->tail->next = c;
+  else {
+    l->head = c;
+    timer_arm(&wheel, &l->timer, c->arrives);
+  }
+  l->tail = c;
+  l->queued += n;
+  return n;
+}
+
+int relay_run(const RelayPlan *plan, int link_cnt, int in_fd[], int out_fd[]) {
+  // a reader that has gone away fails the write instead of killing us
+  signal(SIGPIPE, SIG_IGN);
+
+  // every link may be polled for reading and for writing; `owner` is
+  // the link of each entry
+  int slots = 2 * (link_cnt > 0 ? link_cnt : 1);
+  Link *links = calloc(link_cnt > 0 ? link_cnt : 1, sizeof(Link));
+  struct pollfd *fds = malloc(sizeof(struct pollfd) * slots);
+  int *owner = malloc(sizeof(int) * slots);
+  char *buf = malloc(RELAY_CHUNK);
+  if (links == NULL || fds == NULL || owner == NULL || buf == NULL) {
+    free(links);
+    free(fds);
+    free(owner);
+    free(buf);
+    error_msg(ERR_PIPE_READ_ERR, "no memory for the relay");
+    return ERR_PIPE_READ_ERR;
+  }
+
+  timer_wheel_init(&wheel, now_us());
+  for (int k = 0; k < link_cnt; k++) {
+    links[k].in = in_fd[k];
+    links[k].out = out_fd[k];
+    timer_init(&links[k].timer, k);
+    fcntl(out_fd[k], F_SETFL, fcntl(out_fd[k], F_GETFL) | O_NONBLOCK);
+  }
+
+  int result = SUCCESS;
+  int open_cnt = link_cnt;
+  unsigned long chunks = 0;
+  unsigned long long bytes = 0;
+  long long held = 0; // us
+  long queued_max = 0;
+
+  while (result == SUCCESS && open_cnt > 0) {
+    // a link is read while it has room, and written when its reader's
+    // pipe was full
+    int n = 0;
+    for (int k = 0; k < link_cnt; k++) {
+      Link *l = &links[k];
+      if (!l->eof && l->queued < RELAY_QUEUE_MAX) {
+        owner[n] = k;
+        fds[n++] = (struct pollfd){l->in, POLLIN, 0};
+      }
+      if (l->blocked && l->out >= 0) {
+        owner[n] = k;
+        fds[n++] = (struct pollfd){l->out, POLLOUT, 0};
+      }
+    }
+
+    long wait = timer_wait(&wheel);
+    struct timespec ts = {wait / 1000000, wait % 1000000 * 1000};
+    int ready = ppoll(fds, n, wait >= 0 ? &ts : NULL, NULL);
+    if (ready < 0 && errno != EINTR) {
+      error_msg(ERR_PIPE_READ_ERR, "relay poll failed");
+      result = ERR_PIPE_READ_ERR;
+      break;
+    }
+
+    unsigned long long now = now_us();
+    for (int j = 0; ready > 0 && j < n; j++) {
+      if (fds[j].revents == 0) continue;
+      Link *l = &links[owner[j]];
+      if (fds[j].events == POLLOUT) {
+        open_cnt -= deliver(l, now);
+        continue;
+      }
+      int got = take(plan, l, buf, now, &held);
+      if (got < 0) {
+        error_msg(ERR_PIPE_READ_ERR, "relay could not read");
+        result = ERR_PIPE_READ_ERR;
+        break;
+      }
+      chunks += got > 0;
+      bytes += got;
+      if (l->queued > queued_max) queued_max = l->queued;
+    }
+
+    for (Timer *t = timer_advance(&wheel, now); t != NULL;) {
+      Timer *next = t->next; // delivering may arm it again
+      open_cnt -= deliver(&links[t->id], now);
+      t = next;
+    }
+  }
+
+  printf("relay: %d links, %.3f ms delay, %.3f ms jitter, %.1f Mbit/s: relayed %lu "
+         "chunks, %llu bytes, held %.3f ms on average, at most %ld bytes queued on a link\n",
+         link_cnt, plan->delay_ms, plan->jitter_ms, plan->mbit_per_s, chunks, bytes,
+         chunks ? held / 1e3 / chunks : 0.0, queued_max);
+
+  for (int k = 0; k < link_cnt; k++) {
+    free_chunks(&links[k]);
+    if (links[k].out >= 0) close(links[k].out);
+    if (!links[k].eof) close(links[k].in);
+  }
+  free(links);
+  free(fds);
+  free(owner);
+  free(buf);
+  return result;
+}
@@ -0,0 +1,108 @@
+#include "replica.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "changelog.h"
+#include "command.h"
+#include "errors.h"
+#include "io.h"
+
+int replica_count() {
+  char *eval = getenv("BANKSIM_REPLICAS");
+  int n = eval ? atoi(eval) : 0;
+  if (n < 0) return 0;
+  return n < CHANGELOG_MAX_READERS ? n : CHANGELOG_MAX_READERS;
+}
+
+static double replica_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// answers one command with the replica's balances
+static int replica_answer(int in, int out, int *balances, int account_cnt,
+                          long long *lag) {
+  Command cmd, res;
+  int result = checked_read(in, &cmd, MESSAGE_SIZE);
+  if (result != SUCCESS) return result;
+
+  cmd_t c;
+  int i, f, t, a;
+  cmd_unpack(&cmd, &c, &i, &f, &t, &a);
+  if (c != BALANCE || f < 0 || f >= account_cnt) {
+    MSG_ACCUNKN(&res, i, f);
+  } else {
+    MSG_OK(&res, i, f, (int)(changelog_applied() & INT_MAX), balances[f]);
+  }
+
+  *lag = changelog_written() - changelog_applied();
+  return checked_write(out, &res, MESSAGE_SIZE);
+}
+
+int replica_run(int id, int account_cnt, int chan_cnt, int in_fd[], int out_fd[]) {
+  if (changelog_open(CHANGELOG_SEGMENT, 0, id) < 0) {
+    changelog_retire(CHANGELOG_SEGMENT, id);
+    error_msg(ERR_PIPE_READ_ERR, "could not open the change log");
+    return ERR_PIPE_READ_ERR;
+  }
+
+  int *balances = calloc(account_cnt, sizeof(int));
+  struct pollfd *fds = malloc(sizeof(struct pollfd) * chan_cnt);
+  for (int k = 0; k < chan_cnt; k++) {
+    fds[k].fd = in_fd[k];
+    fds[k].events = POLLIN;
+  }
+
+  int result = SUCCESS;
+  int open_cnt = chan_cnt;
+  long answered = 0;
+  long long lag_sum = 0, lag_max = 0, applied = 0;
+  double start = replica_now();
+
+  while (result == SUCCESS && open_cnt > 0) {
+    int ready = poll(fds, chan_cnt, REPLICA_POLL_MS);
+    if (ready < 0 && errno != EINTR) {
+      error_msg(ERR_PIPE_READ_ERR, "replica poll failed");
+      result = ERR_PIPE_READ_ERR;
+      break;
+    }
+
+    // the changes are applied before every batch of reads they serve
+    applied += changelog_apply(balances);
+
+    for (int k = 0; ready > 0 && k < chan_cnt; k++) {
+      if (fds[k].fd < 0 || fds[k].revents == 0) continue;
+
+      long long lag;
+      result = replica_answer(fds[k].fd, out_fd[k], balances, account_cnt, &lag);
+      if (result == ERR_ATM_CLOSED) {
+        close(fds[k].fd);
+        fds[k].fd = -1;
+        open_cnt--;
+        result = SUCCESS;
+        continue;
+      }
+      if (result != SUCCESS) break;
+
+      answered++;
+      lag_sum += lag;
+      lag_max = lag > lag_max ? lag : lag_max;
+    }
+  }
+
+  double secs = replica_now() - start;
+  printf("replica %d: %ld balances in %.3f s (%.0f/s), %lld changes applied, "
+         "behind the bank by %.1f changes on average, %lld at most\n",
+         id, answered, secs, answered / secs, applied,
+         answered ? (double)lag_sum / answered : 0.0, lag_max);
+
+  free(fds);
+  free(balances);
+  changelog_close();
+  return result;
+}
@@ -0,0 +1,58 @@
+#include "schedule.h"
+#include <math.h>
+#include <string.h>
+
+static const char *kind_names[] = {"fixed", "poisson", "bursty"};
+
+int schedule_kind(const char *name) {
+  for (int k = SCHED_FIXED; k <= SCHED_BURSTY; k++)
+    if (strcmp(name, kind_names[k]) == 0) return k;
+  return -1;
+}
+
+// splitmix64, good enough for arrival times and cheap to seed
+
+static double uniform(Schedule *s) {
+  unsigned long long z = (s->rng += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (z >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+}
+
+static double exponential(Schedule *s, double mean) {
+  return -log(1.0 - uniform(s)) * mean;
+}
+
+void schedule_init(Schedule *s, int kind, double rate, unsigned seed) {
+  memset(s, 0, sizeof(*s));
+  s->kind = kind;
+  s->gap = 1e9 / rate;
+  s->rng = seed;
+  // the first arrival is spread out too, so ATMs do not start in step
+  s->next = uniform(s) * s->gap;
+}
+
+long schedule_next(Schedule *s) {
+  long at = (long)s->next;
+  switch (s->kind) {
+    case SCHED_FIXED:
+      s->next += s->gap;
+      break;
+    case SCHED_POISSON:
+      s->next += exponential(s, s->gap);
+      break;
+    case SCHED_BURSTY:
+      // A burst of SCHED_BURST_LEN arrivals comes at ten times the
+      // rate; the silence after it keeps the mean rate as asked.
+      if (s->burst_left == 0) s->burst_left = SCHED_BURST_LEN;
+      if (--s->burst_left > 0) {
+        s->next += s->gap / 10;
+      } else {
+        double burst = (SCHED_BURST_LEN - 1) * s->gap / 10;
+        s->next += exponential(s, SCHED_BURST_LEN * s->gap - burst);
+      }
+      break;
+  }
+  return at;
+}
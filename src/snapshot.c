@@ -0,0 +1,142 @@
+#include "snapshot.h"
+#include "relabel.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static int taken = 0; // snapshots started so far
+
+// The snapshot being written: by a child process, or by a thread.
+static pid_t writer_pid = 0;
+static pthread_t writer_thread;
+static int writer_running = 0;
+static int writer_done = 0; // set by the thread when it is finished
+
+// What the thread writes out.
+typedef struct image {
+  int *balances;
+  int account_cnt;
+  int n;
+  unsigned long commands;
+  char path[64];
+} Image;
+
+static Image image;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// writes an image and reports how fast that went. It runs in a child
+// process or a thread, so it only uses its own FILE and writes the
+// report straight to the standard output descriptor. The bank does
+// not relabel accounts while an image is being written.
+
+static void write_image(const int *balances, Image *img) {
+  const char *path = img->path;
+  double start = now();
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    dprintf(STDOUT_FILENO, "bank: snapshot %d: could not create %s\n",
+            img->n, path);
+    return;
+  }
+  fprintf(f, "# snapshot %d of %d accounts after %lu commands\n", img->n,
+          img->account_cnt, img->commands);
+  for (int i = 0; i < img->account_cnt; i++)
+    fprintf(f, "Account %d: %d\n", i, balances[relabel_slot(i)]);
+  long bytes = ftell(f);
+  int ok = fclose(f) == 0;
+  double secs = now() - start;
+
+  dprintf(STDOUT_FILENO,
+          "bank: snapshot %d %s %s: %d accounts, %ld bytes in %.2f ms "
+          "(%.1f MB/s)\n",
+          img->n, ok ? "written to" : "failed for", path, img->account_cnt,
+          bytes, secs * 1e3, bytes / 1e6 / (secs > 0 ? secs : 1e-9));
+}
+
+static void *write_copy(void *arg) {
+  Image *img = arg;
+  write_image(img->balances, img);
+  __atomic_store_n(&writer_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// checks whether the last snapshot is written, without waiting unless
+// `wait` is set
+
+static int writer_busy(int wait) {
+  if (!writer_running) return 0;
+  if (writer_pid > 0) {
+    if (waitpid(writer_pid, NULL, wait ? 0 : WNOHANG) == 0) return 1;
+    writer_pid = 0;
+  } else {
+    if (!wait && !__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE)) return 1;
+    pthread_join(writer_thread, NULL);
+    free(image.balances);
+    image.balances = NULL;
+  }
+  writer_running = 0;
+  return 0;
+}
+
+int snapshot_take(const int *accounts, int account_cnt, int shared,
+                  unsigned long commands) {
+  if (writer_busy(0)) {
+    printf("bank: snapshot dropped, snapshot %d is still being written\n",
+           taken);
+    return -1;
+  }
+
+  const char *how = getenv("BANKSIM_SNAPSHOT");
+  int copy = shared || (how != NULL && strcmp(how, "copy") == 0);
+  int n = ++taken;
+  image.account_cnt = account_cnt;
+  image.n = n;
+  image.commands = commands;
+  snprintf(image.path, sizeof(image.path), "banksim-%d-%d.snap",
+           (int)getpid(), n);
+
+  // the bank is paused from here until the image is frozen
+  double start = now();
+  if (copy) {
+    image.balances = malloc(sizeof(int) * account_cnt);
+    memcpy(image.balances, accounts, sizeof(int) * account_cnt);
+    writer_done = 0;
+    if (pthread_create(&writer_thread, NULL, write_copy, &image) != 0) {
+      free(image.balances);
+      image.balances = NULL;
+      printf("bank: snapshot %d failed, no thread to write it\n", n);
+      return -1;
+    }
+  } else {
+    writer_pid = fork();
+    if (writer_pid == 0) {
+      // the child's copy of the accounts stays as it was at the fork
+      write_image(accounts, &image);
+      _exit(0);
+    }
+    if (writer_pid < 0) {
+      writer_pid = 0;
+      perror("fork");
+      return -1;
+    }
+  }
+  double pause = now() - start;
+  writer_running = 1;
+
+  printf("bank: snapshot %d taken by %s after %lu commands, bank paused "
+         "%.1f us\n",
+         n, copy ? "copy" : "fork", commands, pause * 1e6);
+  fflush(stdout);
+  return n;
+}
+
+void snapshot_finish() { writer_busy(1); }
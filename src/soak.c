@@ -0,0 +1,173 @@
+#include "soak.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// What a generator sends next.
+#define SOAK_CONNECT 0
+#define SOAK_DEPOSIT 1
+#define SOAK_RANDOM 2
+#define SOAK_DONE 3
+
+// Commands generated between looks at the clock.
+#define SOAK_CLOCK_EVERY 4096
+
+typedef struct soak_atm {
+  unsigned long long rng;
+  long left;        // random commands still to send, or -1 for no limit
+  int next_account; // the next starter deposit
+  int phase;
+} SoakAtm;
+
+static SoakSpec soak;
+static SoakAtm *gens = NULL;
+static int gen_first = 0;
+static int gen_count = 0;
+static int gen_live = 0; // generators that have not exited
+static int gen_turn = 0; // the generators take turns
+static struct timespec deadline;
+static int until_clock = 0;
+static int time_up = 0;
+
+// splitmix64, which is fast, and good enough for any seed
+static unsigned long long soak_next(unsigned long long *s) {
+  unsigned long long z = (*s += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// returns a number in the closed interval [0, max]
+static int soak_at_most(unsigned long long *s, int max) {
+  return (int)(((soak_next(s) >> 32) * ((unsigned long long)max + 1)) >> 32);
+}
+
+int soak_parse(const char *path, SoakSpec *spec) {
+  int len = strlen(SOAK_PREFIX);
+  if (strncmp(path, SOAK_PREFIX, len) != 0) return 0;
+
+  long v[5] = {0, 0, 0, 0, 1};
+  const char *p = path + len;
+  int n = 0;
+  while (1) {
+    char *end;
+    v[n++] = strtol(p, &end, 10);
+    if (end == p) return -1;
+    p = end;
+    if (*p == '\0') break;
+    if (*p != ',' || n == 5) return -1;
+    p++;
+  }
+
+  if (n < 3 || v[0] <= 0 || v[1] <= 0 || v[2] < 0 || v[3] < 0 ||
+      v[0] > 1 << 20 || v[1] > 1 << 30 || (v[2] == 0 && v[3] == 0))
+    return -1;
+
+  spec->atm_cnt = v[0];
+  spec->account_cnt = v[1];
+  spec->commands = v[2];
+  spec->secs = v[3];
+  spec->seed = v[4];
+  return 1;
+}
+
+int soak_start(const SoakSpec *spec, int first, int count) {
+  soak_stop();
+  if (first < 0 || count <= 0 || first + count > spec->atm_cnt) return -1;
+  gens = calloc(count, sizeof(SoakAtm));
+  if (gens == NULL) return -1;
+
+  soak = *spec;
+  gen_first = first;
+  gen_count = count;
+  gen_live = count;
+  gen_turn = count - 1;
+  for (int k = 0; k < count; k++) {
+    int atm = first + k;
+    SoakAtm *g = &gens[k];
+    g->rng = ((unsigned long long)spec->seed << 32) ^ atm;
+    g->left = spec->commands == 0
+                  ? -1
+                  : spec->commands / spec->atm_cnt +
+                        (atm < spec->commands % spec->atm_cnt);
+    g->next_account = atm;
+    g->phase = SOAK_CONNECT;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += spec->secs;
+  until_clock = 0;
+  time_up = 0;
+  return 1;
+}
+
+void soak_stop() {
+  free(gens);
+  gens = NULL;
+  gen_count = 0;
+  gen_live = 0;
+}
+
+// generates one random command, as `twriter` does
+static void soak_random(SoakAtm *g, Command *cmd, int atm) {
+  int from = soak_at_most(&g->rng, soak.account_cnt - 1);
+  int to = soak_at_most(&g->rng, soak.account_cnt - 1);
+  int amount = soak_at_most(&g->rng, SOAK_MAX_AMOUNT);
+  switch (soak_at_most(&g->rng, 2) + WITHDRAW) {
+    case WITHDRAW:
+      MSG_WITHDRAW(cmd, atm, from, amount);
+      break;
+    case TRANSFER:
+      MSG_TRANSFER(cmd, atm, from, to, amount);
+      break;
+    case BALANCE:
+      MSG_BALANCE(cmd, atm, from);
+      break;
+  }
+}
+
+int soak_read(Command *cmds, int n) {
+  int got = 0;
+  while (got < n && gen_live > 0) {
+    if (soak.secs > 0 && --until_clock < 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      time_up = now.tv_sec > deadline.tv_sec ||
+                (now.tv_sec == deadline.tv_sec &&
+                 now.tv_nsec >= deadline.tv_nsec);
+      until_clock = SOAK_CLOCK_EVERY;
+    }
+
+    gen_turn = gen_turn + 1 == gen_count ? 0 : gen_turn + 1;
+    SoakAtm *g = &gens[gen_turn];
+    int atm = gen_first + gen_turn;
+    Command *cmd = &cmds[got];
+
+    switch (g->phase) {
+      case SOAK_CONNECT:
+        MSG_CONNECT(cmd, atm);
+        g->phase = g->next_account < soak.account_cnt ? SOAK_DEPOSIT
+                                                      : SOAK_RANDOM;
+        break;
+      case SOAK_DEPOSIT:
+        MSG_DEPOSIT(cmd, atm, g->next_account, SOAK_STARTER_CASH);
+        g->next_account += soak.atm_cnt;
+        if (g->next_account >= soak.account_cnt) g->phase = SOAK_RANDOM;
+        break;
+      case SOAK_RANDOM:
+        if (g->left == 0 || time_up) {
+          MSG_EXIT(cmd, atm);
+          g->phase = SOAK_DONE;
+          gen_live--;
+          break;
+        }
+        soak_random(g, cmd, atm);
+        g->left -= g->left > 0;
+        break;
+      default:
+        continue;
+    }
+    got++;
+  }
+  return got;
+}
@@ -0,0 +1,288 @@
+#include "stats.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern const char *cmd_strings[];
+
+// Every counter has one writer, so a relaxed load and store suffice:
+// readers such as banksim-top never see a torn value and the writer
+// never waits.
+#define STAT_ADD(p, n) \
+  __atomic_store_n((p), __atomic_load_n((p), __ATOMIC_RELAXED) + (n), \
+                   __ATOMIC_RELAXED)
+
+static StatsHeader *header = NULL;
+static StatsSlot *slots = NULL; // slot 0 is the bank, 1 + i is ATM i
+static unsigned long *served = NULL;
+static int slot_cnt = 0;
+static unsigned long region_size = 0;
+static char segment[256] = "";
+
+static const char *outcome_strings[] = {"OK",      "NOFUNDS", "ACCUNKN",
+                                        "ATMUNKN", "ERROR",   "LIMIT"};
+
+int stats_open(int atm_cnt, const char *name) {
+  slot_cnt = atm_cnt + 1;
+  region_size = sizeof(StatsHeader) + sizeof(StatsSlot) * slot_cnt +
+                sizeof(unsigned long) * atm_cnt;
+
+  void *region;
+  if (name == NULL) {
+    region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  } else {
+    // a segment left over by an earlier run is replaced
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, region_size) < 0) {
+      if (fd >= 0) close(fd);
+      slot_cnt = 0;
+      return -1;
+    }
+    region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                  0);
+    close(fd);
+    strncpy(segment, name, sizeof(segment) - 1);
+  }
+
+  if (region == MAP_FAILED) {
+    if (segment[0] != '\0') shm_unlink(segment);
+    segment[0] = '\0';
+    slot_cnt = 0;
+    return -1;
+  }
+
+  header = region;
+  slots = (StatsSlot *)(header + 1);
+  served = (unsigned long *)(slots + slot_cnt);
+  header->atm_cnt = atm_cnt;
+  header->running = 1;
+  __atomic_store_n(&header->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void stats_close() {
+  if (header == NULL) return;
+  __atomic_store_n(&header->running, 0, __ATOMIC_RELAXED);
+  munmap(header, region_size);
+  if (segment[0] != '\0') shm_unlink(segment);
+  segment[0] = '\0';
+  header = NULL;
+  slots = NULL;
+  served = NULL;
+  slot_cnt = 0;
+}
+
+// maps a reply type to the outcome it reports
+
+static int outcome_of(cmd_t reply) {
+  switch (reply) {
+    case OK:
+      return STATS_OK;
+    case NOFUNDS:
+      return STATS_NOFUNDS;
+    case ACCUNKN:
+      return STATS_ACCUNKN;
+    case ATMUNKN:
+      return STATS_ATMUNKN;
+    case LIMIT:
+      return STATS_LIMIT;
+    default:
+      return STATS_ERROR;
+  }
+}
+
+void stats_count(int who, cmd_t c, cmd_t reply) {
+  int slot = who + 1;
+  if (slot < 0 || slot >= slot_cnt || c >= STATS_CMDS) return;
+  STAT_ADD(&slots[slot].count[c][outcome_of(reply)], 1);
+}
+
+void stats_served(int atm) {
+  if (atm < 0 || atm >= slot_cnt - 1) return;
+  STAT_ADD(&served[atm], 1);
+}
+
+void stats_wakeup(int drained) {
+  if (header == NULL) return;
+  int bucket = 0;
+  while (bucket < STATS_DRAIN_BUCKETS - 1 && (drained >> (bucket + 1)) > 0)
+    bucket++;
+  STAT_ADD(&header->wakeups, 1);
+  STAT_ADD(&header->drained, drained);
+  STAT_ADD(&header->drain_hist[bucket], 1);
+}
+
+int stats_latency_bucket(long ns) {
+  if (ns < 1024) return 0;
+  int octave = 63 - __builtin_clzl(ns) - 10;
+  int sub = (ns >> (octave + 10 - 2)) & (STATS_LAT_SUB - 1);
+  int b = 1 + octave * STATS_LAT_SUB + sub;
+  return b < STATS_LAT_BUCKETS ? b : STATS_LAT_BUCKETS - 1;
+}
+
+unsigned long stats_latency_bound(int b) {
+  if (b == 0) return 1023;
+  if (b == STATS_LAT_BUCKETS - 1) return ~0UL;
+  int octave = (b - 1) / STATS_LAT_SUB;
+  int sub = (b - 1) % STATS_LAT_SUB;
+  return ((unsigned long)(STATS_LAT_SUB + sub + 1) << (octave + 10 - 2)) - 1;
+}
+
+void stats_latency(int atm, long ns) {
+  int slot = atm + 1;
+  if (slot < 1 || slot >= slot_cnt) return;
+  if (ns < 0) ns = 0;
+  STAT_ADD(&slots[slot].latency[stats_latency_bucket(ns)], 1);
+  if ((unsigned long)ns > slots[slot].latency_max)
+    __atomic_store_n(&slots[slot].latency_max, ns, __ATOMIC_RELAXED);
+}
+
+void stats_latency_summary(StatsLatency *sum) {
+  memset(sum, 0, sizeof(*sum));
+  unsigned long hist[STATS_LAT_BUCKETS] = {0};
+  for (int s = 1; s < slot_cnt; s++) {
+    for (int b = 0; b < STATS_LAT_BUCKETS; b++) {
+      hist[b] += slots[s].latency[b];
+      sum->count += slots[s].latency[b];
+    }
+    if (slots[s].latency_max > sum->max) sum->max = slots[s].latency_max;
+  }
+
+  // each percentile is reached once enough of the count is seen
+  double q[4] = {0.5, 0.9, 0.99, 0.999};
+  unsigned long *p[4] = {&sum->p50, &sum->p90, &sum->p99, &sum->p999};
+  unsigned long seen = 0;
+  int next = 0;
+  for (int b = 0; b < STATS_LAT_BUCKETS && next < 4; b++) {
+    seen += hist[b];
+    while (next < 4 && seen > 0 && seen >= q[next] * sum->count) {
+      unsigned long bound = stats_latency_bound(b);
+      *p[next++] = bound < sum->max ? bound : sum->max;
+    }
+  }
+}
+
+void stats_money(int who, long long deposited, long long withdrawn) {
+  int slot = who + 1;
+  if (slot < 0 || slot >= slot_cnt) return;
+  STAT_ADD(&slots[slot].deposited, deposited);
+  STAT_ADD(&slots[slot].withdrawn, withdrawn);
+}
+
+void stats_held(long long total) {
+  if (header == NULL) return;
+  header->held = total;
+  __atomic_store_n(&header->held_known, 1, __ATOMIC_RELEASE);
+}
+
+void stats_active(int delta) {
+  if (header == NULL) return;
+  STAT_ADD(&header->active_atms, delta);
+}
+
+// prints the rows of one merged table, skipping command types that
+// were never seen
+
+static void print_table(const char *who, StatsSlot *total) {
+  printf("%-8s %-9s", who, "command");
+  for (int o = 0; o < STATS_OUTCOMES; o++) printf(" %10s", outcome_strings[o]);
+  printf(" %10s\n", "total");
+
+  for (int c = 0; c < STATS_CMDS; c++) {
+    unsigned long sum = 0;
+    for (int o = 0; o < STATS_OUTCOMES; o++) sum += total->count[c][o];
+    if (sum == 0) continue;
+
+    printf("%-8s %-9s", who, cmd_strings[c]);
+    for (int o = 0; o < STATS_OUTCOMES; o++)
+      printf(" %10lu", total->count[c][o]);
+    printf(" %10lu\n", sum);
+  }
+}
+
+void stats_print() {
+  if (header == NULL) return;
+
+  StatsSlot atms;
+  memset(&atms, 0, sizeof(atms));
+
+  // the commands of each ATM: as the bank served them, or as the ATMs
+  // counted them when no bank ran here (ATM clients of a bank server)
+  unsigned long per_atm[slot_cnt > 1 ? slot_cnt - 1 : 1];
+  unsigned long by_bank = 0, by_atms = 0;
+
+  for (int s = 1; s < slot_cnt; s++) {
+    unsigned long n = 0;
+    for (int c = 0; c < STATS_CMDS; c++) {
+      for (int o = 0; o < STATS_OUTCOMES; o++) {
+        atms.count[c][o] += slots[s].count[c][o];
+        n += slots[s].count[c][o];
+      }
+    }
+    atms.deposited += slots[s].deposited;
+    atms.withdrawn += slots[s].withdrawn;
+    per_atm[s - 1] = n;
+    by_atms += n;
+    by_bank += served[s - 1];
+  }
+
+  // the busiest and the least busy ATM show how evenly load spread; a
+  // bank server's ATMs count in other processes, so only the bank's
+  // counts are seen there
+  unsigned long most = 0, least = ~0UL;
+  int most_id = -1, least_id = -1;
+  for (int a = 0; a < slot_cnt - 1 && (by_bank > 0 || by_atms > 0); a++) {
+    unsigned long n = by_bank > 0 ? served[a] : per_atm[a];
+    if (n > most || most_id < 0) most = n, most_id = a;
+    if (n < least || least_id < 0) least = n, least_id = a;
+  }
+
+  printf("==== outcome summary ====\n");
+  print_table("atms", &atms);
+  print_table("bank", &slots[0]);
+  if (most_id >= 0) {
+    printf("busiest atm %d: %lu commands, least busy atm %d: %lu commands\n",
+           most_id, most, least_id, least);
+  }
+  if (header->wakeups > 0) {
+    printf("bank wake-ups: %lu, commands drained per wake-up: %.2f\n",
+           header->wakeups, (double)header->drained / header->wakeups);
+  }
+
+  // Money is conserved if the bank holds what the ATMs saw deposited
+  // less what they saw withdrawn. The ATMs cannot tell what the legs of
+  // a batch or an EOD sweep moved, so runs with those are not checked.
+  // A bank server and its ATMs count apart, so each prints its side.
+  unsigned long opaque = 0, connects = 0;
+  for (int o = 0; o < STATS_OUTCOMES; o++) {
+    opaque += atms.count[BATCH][o] + atms.count[EOD][o];
+    connects += atms.count[CONNECT][o];
+  }
+  long long expected = atms.deposited - atms.withdrawn;
+  if (header->held_known && connects > 0) {
+    printf("money: deposited %lld, withdrawn %lld, bank holds %lld: %s\n",
+           atms.deposited, atms.withdrawn, header->held,
+           opaque ? "not checked (batches or EOD)"
+           : header->held == expected ? "conserved"
+                                      : "NOT CONSERVED");
+  } else if (header->held_known) {
+    printf("money: bank holds %lld\n", header->held);
+  } else if (connects > 0) {
+    printf("money: deposited %lld, withdrawn %lld\n", atms.deposited,
+           atms.withdrawn);
+  }
+
+  StatsLatency lat;
+  stats_latency_summary(&lat);
+  if (lat.count > 0) {
+    printf("latency from scheduled send (us): replies %lu p50 %.1f p90 %.1f "
+           "p99 %.1f p99.9 %.1f max %.1f\n",
+           lat.count, lat.p50 / 1e3, lat.p90 / 1e3, lat.p99 / 1e3,
+           lat.p999 / 1e3, lat.max / 1e3);
+  }
+  fflush(stdout);
+}
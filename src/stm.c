@@ -0,0 +1,525 @@
+#include "stm.h"
+#include "relabel.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The state of a leg's version of an account: the leg has not written
+// it (or has not run yet), has written a value, or wrote a value in a
+// run that was aborted, which stands in for what it will write next.
+#define VER_NONE 0
+#define VER_WRITTEN 1
+#define VER_ESTIMATE 2
+
+// What a leg is doing.
+#define LEG_READY 0     // waiting to run (again)
+#define LEG_EXECUTING 1
+#define LEG_EXECUTED 2
+#define LEG_ABORTING 3  // aborted, or waiting for an earlier leg
+
+// The version a read got when no earlier leg wrote the account.
+#define FROM_START (-1LL)
+
+// The tasks a thread picks up.
+#define TASK_NONE 0
+#define TASK_EXECUTE 1
+#define TASK_VALIDATE 2
+
+typedef struct task {
+  int kind;
+  int leg;
+  int incarnation;
+} Task;
+
+// A leg's version of an account. The value, the incarnation (run) of
+// the leg that made it and the state are packed into one word, so a
+// reader never sees them half-written.
+typedef struct version {
+  unsigned long long word;
+  int leg;
+} Version;
+
+typedef struct leg {
+  cmd_t cmd;
+  cmd_t outcome;    // of the last run
+  int amt;
+  int touched;      // the accounts the leg reads and writes, 0 to 2
+  int acc[2];       // their dense ids; the debited account first
+  int at[2];        // the leg's version of each, in `versions`
+  long long seen[2];  // the versions the last run read
+  bool wrote[2];    // whether the last run wrote each account
+  int lock;
+  int status;
+  int incarnation;
+  int waiters;      // the first leg waiting for this one, or -1
+  int next_waiter;  // the next leg waiting for the same one
+} Leg;
+
+// The batch. The versions of each account are together, in leg order:
+// those of dense account d are versions[first[d]] up to
+// versions[first[d + 1]].
+static Leg *legs = NULL;
+static Version *versions = NULL;
+static int *first = NULL;
+static int *start_balance = NULL; // of each dense account
+static int *keys = NULL;          // maps accounts to dense ids
+static int *ids = NULL;
+static int cap = 0;
+static int leg_cnt = 0;
+
+// The scheduler. Legs are executed and validated in order of the two
+// indexes, which go back when a leg has to run or be checked again.
+static int execution_idx = 0;
+static int validation_idx = 0;
+static int decrease_cnt = 0;
+static int active = 0; // tasks being worked on
+static int done = 0;
+static int executions = 0;
+
+// The workers wait for a new generation, work on the batch, and say
+// when they are done with it.
+static pthread_t workers[STM_MAX_THREADS];
+static int worker_cnt = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static int generation = 0;
+static int running = 0;
+static int quitting = 0;
+
+static int load(int *p) { return __atomic_load_n(p, __ATOMIC_SEQ_CST); }
+
+static unsigned long long ver_pack(int value, int incarnation, int state) {
+  return (unsigned long long)(unsigned)value << 32 |
+         (unsigned)incarnation << 2 | state;
+}
+
+static void leg_lock(Leg *l) {
+  while (__atomic_exchange_n(&l->lock, 1, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static void leg_unlock(Leg *l) { __atomic_store_n(&l->lock, 0, __ATOMIC_RELEASE); }
+
+// moves a scheduler index back to `target` if it is past it
+static void lower(int *idx, int target) {
+  int cur = load(idx);
+  while (cur > target &&
+         !__atomic_compare_exchange_n(idx, &cur, target, false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    ;
+  __atomic_add_fetch(&decrease_cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+// Reads dense account `d` as the leg whose version is at `at` sees
+// it: the value of the nearest earlier leg that wrote it, or the
+// starting balance. It returns -1, or the leg whose estimate it ran
+// into, which the reader has to wait for.
+static int read_account(int d, int at, int *value, long long *seen) {
+  for (int p = at - 1; p >= first[d]; p--) {
+    unsigned long long w = __atomic_load_n(&versions[p].word, __ATOMIC_ACQUIRE);
+    int state = w & 3;
+    if (state == VER_NONE) continue;
+    if (state == VER_ESTIMATE) return versions[p].leg;
+    *value = (int)(w >> 32);
+    *seen = (long long)versions[p].leg << 32 | (unsigned)(w >> 2 & 0x3fffffff);
+    return -1;
+  }
+  *value = start_balance[d];
+  *seen = FROM_START;
+  return -1;
+}
+
+// Runs leg `i` the way `leg_apply` in bank.c applies it and records
+// what it read and wrote. It returns -1, or the leg it has to wait for;
+// `wrote_new` tells whether it wrote an account the run before did not.
+static int execute(int i, int incarnation, bool *wrote_new) {
+  Leg *l = &legs[i];
+  int v[2];
+  long long seen[2];
+  for (int m = 0; m < l->touched; m++) {
+    int blocker = read_account(l->acc[m], l->at[m], &v[m], &seen[m]);
+    if (blocker >= 0) return blocker;
+  }
+
+  cmd_t outcome = ACCUNKN;
+  if (l->touched > 0) {
+    switch (l->cmd) {
+      case DEPOSIT:
+        outcome = OK;
+        v[0] = (int)((unsigned)v[0] + l->amt);
+        break;
+      case WITHDRAW:
+      case TRANSFER:
+        if (v[0] < l->amt) {
+          outcome = NOFUNDS;
+          break;
+        }
+        outcome = OK;
+        // a transfer to the account it is from changes nothing
+        if (l->cmd == WITHDRAW || l->touched == 2) v[0] -= l->amt;
+        if (l->touched == 2) v[1] = (int)((unsigned)v[1] + l->amt);
+        break;
+    }
+  }
+
+  bool writes = outcome == OK;
+  *wrote_new = false;
+  for (int m = 0; m < l->touched; m++) {
+    __atomic_store_n(&l->seen[m], seen[m], __ATOMIC_RELAXED);
+    __atomic_store_n(&versions[l->at[m]].word,
+                     ver_pack(writes ? v[m] : 0, incarnation,
+                              writes ? VER_WRITTEN : VER_NONE),
+                     __ATOMIC_RELEASE);
+    if (writes && !l->wrote[m]) *wrote_new = true;
+    l->wrote[m] = writes;
+  }
+  __atomic_store_n(&l->outcome, outcome, __ATOMIC_RELAXED);
+  return -1;
+}
+
+// tells whether every version leg `i` read is still the one it would
+// read now
+static bool validate(int i) {
+  Leg *l = &legs[i];
+  for (int m = 0; m < l->touched; m++) {
+    int value;
+    long long seen;
+    if (read_account(l->acc[m], l->at[m], &value, &seen) >= 0 ||
+        seen != __atomic_load_n(&l->seen[m], __ATOMIC_RELAXED))
+      return false;
+  }
+  return true;
+}
+
+static bool try_incarnate(int i, Task *t) {
+  Leg *l = &legs[i];
+  bool ok = false;
+  leg_lock(l);
+  if (l->status == LEG_READY) {
+    l->status = LEG_EXECUTING;
+    *t = (Task){TASK_EXECUTE, i, l->incarnation};
+    ok = true;
+  }
+  leg_unlock(l);
+  return ok;
+}
+
+static void check_done() {
+  int decreases = load(&decrease_cnt);
+  int exec = load(&execution_idx), valid = load(&validation_idx);
+  if ((exec < valid ? exec : valid) >= leg_cnt && load(&active) == 0 &&
+      decreases == load(&decrease_cnt))
+    __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+}
+
+// picks the next leg to validate or, if validation has caught up, the
+// next one to execute
+static Task next_task() {
+  Task t = {TASK_NONE, 0, 0};
+  bool validating = load(&validation_idx) < load(&execution_idx);
+  int *idx = validating ? &validation_idx : &execution_idx;
+  if (load(idx) >= leg_cnt) {
+    check_done();
+    return t;
+  }
+
+  __atomic_add_fetch(&active, 1, __ATOMIC_SEQ_CST);
+  int i = __atomic_fetch_add(idx, 1, __ATOMIC_SEQ_CST);
+  if (i < leg_cnt) {
+    if (validating) {
+      Leg *l = &legs[i];
+      leg_lock(l);
+      if (l->status == LEG_EXECUTED) t = (Task){TASK_VALIDATE, i, l->incarnation};
+      leg_unlock(l);
+    } else {
+      try_incarnate(i, &t);
+    }
+  }
+  if (t.kind == TASK_NONE) __atomic_sub_fetch(&active, 1, __ATOMIC_SEQ_CST);
+  return t;
+}
+
+// Makes leg `i` wait for leg `blocker` to run. It returns false if the
+// blocker has run in the meantime, so `i` can run again straight away.
+static bool wait_for(int i, int blocker) {
+  Leg *b = &legs[blocker], *l = &legs[i];
+  leg_lock(b);
+  if (b->status == LEG_EXECUTED) {
+    leg_unlock(b);
+    return false;
+  }
+  leg_lock(l);
+  l->status = LEG_ABORTING;
+  leg_unlock(l);
+  l->next_waiter = b->waiters;
+  b->waiters = i;
+  leg_unlock(b);
+  __atomic_sub_fetch(&active, 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+static Task finish_execution(int i, int incarnation, bool wrote_new) {
+  Leg *l = &legs[i];
+  leg_lock(l);
+  l->status = LEG_EXECUTED;
+  int w = l->waiters;
+  l->waiters = -1;
+  leg_unlock(l);
+
+  // the legs that waited for this one run again
+  int lowest = leg_cnt;
+  while (w >= 0) {
+    Leg *d = &legs[w];
+    int next = d->next_waiter;
+    leg_lock(d);
+    d->status = LEG_READY;
+    d->incarnation++;
+    leg_unlock(d);
+    if (w < lowest) lowest = w;
+    w = next;
+  }
+  if (lowest < leg_cnt) lower(&execution_idx, lowest);
+
+  // later legs validated against the run before must be checked again
+  // if this run wrote somewhere new; otherwise only this one
+  if (load(&validation_idx) > i) {
+    if (!wrote_new) return (Task){TASK_VALIDATE, i, incarnation};
+    lower(&validation_idx, i);
+  }
+  __atomic_sub_fetch(&active, 1, __ATOMIC_SEQ_CST);
+  return (Task){TASK_NONE, 0, 0};
+}
+
+static Task run_execution(Task t) {
+  while (1) {
+    bool wrote_new;
+    int blocker = execute(t.leg, t.incarnation, &wrote_new);
+    if (blocker < 0) {
+      __atomic_add_fetch(&executions, 1, __ATOMIC_RELAXED);
+      return finish_execution(t.leg, t.incarnation, wrote_new);
+    }
+    if (wait_for(t.leg, blocker)) return (Task){TASK_NONE, 0, 0};
+  }
+}
+
+static Task run_validation(Task t) {
+  Leg *l = &legs[t.leg];
+  bool aborted = false;
+  if (!validate(t.leg)) {
+    leg_lock(l);
+    if (l->status == LEG_EXECUTED && l->incarnation == t.incarnation) {
+      l->status = LEG_ABORTING;
+      aborted = true;
+    }
+    leg_unlock(l);
+  }
+
+  if (aborted) {
+    // what it wrote is a guess at what it will write, until it reruns
+    for (int m = 0; m < l->touched; m++) {
+      Version *v = &versions[l->at[m]];
+      if (l->wrote[m])
+        __atomic_store_n(&v->word, (v->word & ~3ULL) | VER_ESTIMATE,
+                         __ATOMIC_RELEASE);
+    }
+
+    leg_lock(l);
+    l->status = LEG_READY;
+    l->incarnation++;
+    leg_unlock(l);
+    lower(&validation_idx, t.leg + 1);
+    Task again;
+    if (load(&execution_idx) > t.leg && try_incarnate(t.leg, &again))
+      return again;
+  }
+  __atomic_sub_fetch(&active, 1, __ATOMIC_SEQ_CST);
+  return (Task){TASK_NONE, 0, 0};
+}
+
+// works on the batch until every leg has run and been validated
+static void work() {
+  Task t = {TASK_NONE, 0, 0};
+  while (!__atomic_load_n(&done, __ATOMIC_SEQ_CST)) {
+    if (t.kind == TASK_EXECUTE)
+      t = run_execution(t);
+    else if (t.kind == TASK_VALIDATE)
+      t = run_validation(t);
+    else if ((t = next_task()).kind == TASK_NONE)
+      sched_yield();
+  }
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  int seen = 0;
+  pthread_mutex_lock(&pool_lock);
+  while (1) {
+    while (generation == seen && !quitting)
+      pthread_cond_wait(&pool_start, &pool_lock);
+    if (quitting) break;
+    seen = generation;
+    pthread_mutex_unlock(&pool_lock);
+    work();
+    pthread_mutex_lock(&pool_lock);
+    if (--running == 0) pthread_cond_signal(&pool_idle);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+int stm_threads() {
+  char *eval = getenv("BANKSIM_BATCH_THREADS");
+  long n = eval ? atol(eval) : 1;
+  return n < 1 ? 1 : n > STM_MAX_THREADS ? STM_MAX_THREADS : n;
+}
+
+int stm_open(int threads) {
+  stm_close();
+  if (threads > STM_MAX_THREADS) threads = STM_MAX_THREADS;
+  for (int t = 0; t < threads - 1; t++) {
+    if (pthread_create(&workers[worker_cnt], NULL, worker, NULL) != 0) break;
+    worker_cnt++;
+  }
+  return worker_cnt > 0 ? 1 : -1;
+}
+
+void stm_close() {
+  pthread_mutex_lock(&pool_lock);
+  quitting = 1;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_lock);
+  for (int t = 0; t < worker_cnt; t++) pthread_join(workers[t], NULL);
+  worker_cnt = 0;
+  quitting = 0;
+
+  free(legs);
+  free(versions);
+  free(first);
+  free(start_balance);
+  free(keys);
+  free(ids);
+  legs = NULL;
+  versions = NULL;
+  first = start_balance = keys = ids = NULL;
+  cap = 0;
+}
+
+// makes room for a batch of n legs
+static int stm_fit(int n) {
+  if (n <= cap) return 1;
+  int c = cap > 0 ? cap : STM_MIN_LEGS;
+  while (c < n) c <<= 1;
+
+  Leg *l = realloc(legs, sizeof(Leg) * c);
+  if (l != NULL) legs = l;
+  Version *v = realloc(versions, sizeof(Version) * 2 * c);
+  if (v != NULL) versions = v;
+  int *f = realloc(first, sizeof(int) * (2 * c + 1));
+  if (f != NULL) first = f;
+  int *s = realloc(start_balance, sizeof(int) * 2 * c);
+  if (s != NULL) start_balance = s;
+  int *k = realloc(keys, sizeof(int) * 4 * c);
+  if (k != NULL) keys = k;
+  int *d = realloc(ids, sizeof(int) * 4 * c);
+  if (d != NULL) ids = d;
+  if (l == NULL || v == NULL || f == NULL || s == NULL || k == NULL || d == NULL)
+    return -1;
+  cap = c;
+  return 1;
+}
+
+// Lays the batch out: gives the accounts it touches dense ids, and
+// each of them a run of versions, one per leg touching it, in leg
+// order.
+static void prepare(const Command *cmds, int n, const int *balances,
+                    int account_cnt) {
+  int mask = 4;
+  while (mask < 4 * n) mask <<= 1;
+  mask--;
+  memset(keys, -1, sizeof(int) * (mask + 1));
+  memset(first, 0, sizeof(int) * (2 * n + 1));
+  int dense_cnt = 0;
+
+  for (int i = 0; i < n; i++) {
+    cmd_t c;
+    int id, f, t, a;
+    cmd_unpack((Command *)&cmds[i], &c, &id, &f, &t, &a);
+    bool from_ok = 0 <= f && f < account_cnt;
+    bool to_ok = 0 <= t && t < account_cnt;
+
+    Leg *l = &legs[i];
+    int touched[2];
+    l->cmd = c;
+    l->amt = a;
+    l->touched = 0;
+    if (c == DEPOSIT && to_ok)
+      touched[l->touched++] = t;
+    else if ((c == WITHDRAW && from_ok) || (c == TRANSFER && from_ok && to_ok))
+      touched[l->touched++] = f;
+    if (c == TRANSFER && l->touched == 1 && t != f) touched[l->touched++] = t;
+
+    for (int m = 0; m < l->touched; m++) {
+      unsigned h = (unsigned)touched[m] * 2654435761u & mask;
+      while (keys[h] != -1 && keys[h] != touched[m]) h = (h + 1) & mask;
+      if (keys[h] == -1) {
+        keys[h] = touched[m];
+        ids[h] = dense_cnt;
+        start_balance[dense_cnt++] = balances[relabel_slot(touched[m])];
+      }
+      l->acc[m] = ids[h];
+      first[ids[h]]++;
+      l->wrote[m] = false;
+      l->seen[m] = FROM_START;
+    }
+    l->outcome = ACCUNKN;
+    l->lock = 0;
+    l->status = LEG_READY;
+    l->incarnation = 0;
+    l->waiters = -1;
+  }
+
+  // each account's run ends where the next one starts; filling the
+  // runs from the back leaves `first` at their starts
+  int sum = 0;
+  for (int d = 0; d < dense_cnt; d++) first[d] = sum += first[d];
+  first[dense_cnt] = sum;
+  for (int i = n - 1; i >= 0; i--) {
+    Leg *l = &legs[i];
+    for (int m = 0; m < l->touched; m++) {
+      int p = --first[l->acc[m]];
+      versions[p].word = ver_pack(0, 0, VER_NONE);
+      versions[p].leg = i;
+      l->at[m] = p;
+    }
+  }
+}
+
+int stm_run(const Command *cmds, int n, const int *balances, int account_cnt,
+            cmd_t *outcome) {
+  if (worker_cnt == 0) return -1;
+  if (n <= 0) return 0;
+  if (stm_fit(n) < 0) return -1;
+  prepare(cmds, n, balances, account_cnt);
+
+  leg_cnt = n;
+  execution_idx = validation_idx = 0;
+  decrease_cnt = active = done = executions = 0;
+
+  pthread_mutex_lock(&pool_lock);
+  generation++;
+  running = worker_cnt;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_lock);
+
+  work();
+
+  // no worker may still be looking at this batch when the next starts
+  pthread_mutex_lock(&pool_lock);
+  while (running > 0) pthread_cond_wait(&pool_idle, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (int i = 0; i < n; i++) outcome[i] = legs[i].outcome;
+  return executions;
+}
@@ -0,0 +1,152 @@
+#include "timer.h"
+#include <stddef.h>
+
+// the width of a slot at `level`, in ticks, as a shift
+#define LEVEL_SHIFT(level) ((level) * TIMER_SLOT_BITS)
+
+void timer_wheel_init(TimerWheel *w, unsigned long long now) {
+  w->now = now;
+  w->count = 0;
+  for (int l = 0; l < TIMER_LEVELS; l++) {
+    w->occupied[l] = 0;
+    for (int s = 0; s < TIMER_SLOTS; s++)
+      w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+  }
+}
+
+void timer_init(Timer *t, int id) {
+  t->next = t->prev = NULL;
+  t->id = id;
+}
+
+int timer_armed(const Timer *t) { return t->prev != NULL; }
+
+static void unlink_timer(TimerWheel *w, Timer *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  Timer *head = &w->slots[t->level][t->slot];
+  if (head->next == head) w->occupied[t->level] &= ~(1ULL << t->slot);
+  t->next = t->prev = NULL;
+  w->count--;
+}
+
+// puts `t` in the slot its expiry falls in, seen from w->now. A timer
+// due now goes in the current slot, which is only right while
+// cascading, before that slot is expired.
+static void place(TimerWheel *w, Timer *t) {
+  if (t->expires < w->now) t->expires = w->now;
+  unsigned long long delta = t->expires - w->now;
+
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 &&
+         delta >= 1ULL << LEVEL_SHIFT(level + 1))
+    level++;
+  // beyond the top level the timer waits in its last slot, and is
+  // placed again when that slot comes round
+  unsigned long long at = t->expires;
+  unsigned long long span = 1ULL << LEVEL_SHIFT(TIMER_LEVELS);
+  if (delta >= span) at = w->now + span - 1;
+
+  int slot = (at >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1);
+  Timer *head = &w->slots[level][slot];
+  t->level = level;
+  t->slot = slot;
+  t->prev = head;
+  t->next = head->next;
+  head->next->prev = t;
+  head->next = t;
+  w->occupied[level] |= 1ULL << slot;
+  w->count++;
+}
+
+void timer_arm(TimerWheel *w, Timer *t, unsigned long long expires) {
+  if (t->prev != NULL) unlink_timer(w, t);
+  t->expires = expires > w->now ? expires : w->now + 1;
+  place(w, t);
+}
+
+void timer_cancel(TimerWheel *w, Timer *t) {
+  if (t->prev != NULL) unlink_timer(w, t);
+}
+
+// empties slot `slot` of `level`, returning its timers chained by next
+static Timer *take_slot(TimerWheel *w, int level, int slot) {
+  Timer *head = &w->slots[level][slot];
+  Timer *list = NULL;
+  while (head->next != head) {
+    Timer *t = head->next;
+    unlink_timer(w, t);
+    t->next = list;
+    list = t;
+  }
+  return list;
+}
+
+// moves the timers of the current slot of `level` down, after the
+// level below has wrapped around
+static void cascade(TimerWheel *w, int level) {
+  int slot = (w->now >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1);
+  if (slot == 0 && level + 1 < TIMER_LEVELS) cascade(w, level + 1);
+
+  Timer *t = take_slot(w, level, slot);
+  while (t != NULL) {
+    Timer *next = t->next;
+    place(w, t);
+    t = next;
+  }
+}
+
+Timer *timer_advance(TimerWheel *w, unsigned long long now) {
+  Timer *expired = NULL;
+  while (w->now < now) {
+    if (w->count == 0) {
+      w->now = now;
+      break;
+    }
+    // the ticks before the next one with something due are skipped
+    unsigned long long step = 1;
+    int next = (w->now + 1) & (TIMER_SLOTS - 1);
+    if (next != 0 && !(w->occupied[0] >> next & 1)) step = timer_wait(w);
+    if (w->now + step > now) {
+      w->now = now;
+      break;
+    }
+    w->now += step;
+    int slot = w->now & (TIMER_SLOTS - 1);
+    if (slot == 0) cascade(w, 1);
+
+    Timer *t = take_slot(w, 0, slot);
+    while (t != NULL) {
+      Timer *next = t->next;
+      t->next = expired;
+      expired = t;
+      t = next;
+    }
+  }
+  return expired;
+}
+
+long timer_wait(const TimerWheel *w) {
+  if (w->count == 0) return -1;
+
+  // On each level, the first busy slot after the current one (going
+  // round to the current one itself) comes round at the tick its
+  // index starts at: on level 0 its timers expire then, and on the
+  // levels above they come down, none of them expiring any earlier.
+  unsigned long long next = ~0ULL;
+  for (int l = 0; l < TIMER_LEVELS; l++) {
+    unsigned long long bits = w->occupied[l];
+    if (bits == 0) continue;
+    unsigned long long index = w->now >> LEVEL_SHIFT(l);
+    int slot = index & (TIMER_SLOTS - 1);
+    // bit k is slot slot + 1 + k, wrapping round
+    unsigned long long ahead =
+        slot == TIMER_SLOTS - 1
+            ? bits
+            : bits >> (slot + 1) | bits << (TIMER_SLOTS - 1 - slot);
+    unsigned long long at = (index + __builtin_ctzll(ahead) + 1)
+                            << LEVEL_SHIFT(l);
+    if (at < next) next = at;
+  }
+  return next - w->now;
+}
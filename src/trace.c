@@ -5,12 +5,29 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "command.h"
+#include "probes.h"
+#include "soak.h"
 
 static int tracefd = -1;
 static int atm_cnt = 0;
 static int account_cnt = 0;
 
+// a synthetic trace, when soaking is 1, and whether its generators
+// have been started
+static SoakSpec soak;
+static int soaking = 0;
+static int soak_started = 0;
+
 int trace_open(const char *path) {
+  soaking = soak_parse(path, &soak);
+  if (soaking < 0) return -1;
+  if (soaking) {
+    atm_cnt = soak.atm_cnt;
+    account_cnt = soak.account_cnt;
+    soak_started = 0;
+    return 1;
+  }
+
   tracefd = open(path, O_RDONLY);
   if (tracefd == -1) return -1;
   // First read in the ATM count.
@@ -41,8 +58,13 @@ int trace_open(const char *path) {
 }
 
 void trace_close() {
-  assert(tracefd != -1);
-  close(tracefd);
+  if (soaking) {
+    soak_stop();
+    soaking = 0;
+  } else {
+    assert(tracefd != -1);
+    close(tracefd);
+  }
   tracefd = -1;
   atm_cnt = 0;
   account_cnt = 0;
@@ -52,4 +74,46 @@ int trace_atm_count() { return atm_cnt; }
 
 int trace_account_count() { return account_cnt; }
 
-int trace_read_cmd(Command *cmd) { return read(tracefd, cmd, MESSAGE_SIZE); }
+int trace_select(int first, int count) {
+  if (!soaking) return 1;
+  soak_started = soak_start(&soak, first, count);
+  return soak_started;
+}
+
+// generates the commands of a synthetic trace, of all ATMs unless
+// `trace_select` picked some
+static int trace_soak(Command *cmds, int n) {
+  if (!soak_started) soak_started = soak_start(&soak, 0, atm_cnt);
+  if (soak_started < 0) return -1;
+  return soak_read(cmds, n);
+}
+
+int trace_read_cmd(Command *cmd) {
+  if (soaking) {
+    int got = trace_soak(cmd, 1);
+    PROBE1(trace_read, got);
+    return got > 0 ? (int)MESSAGE_SIZE : got;
+  }
+  int result = read(tracefd, cmd, MESSAGE_SIZE);
+  PROBE1(trace_read, result == MESSAGE_SIZE);
+  return result;
+}
+
+int trace_read_cmds(Command *cmds, int n) {
+  if (soaking) {
+    int got = trace_soak(cmds, n);
+    PROBE1(trace_read, got);
+    return got;
+  }
+  byte *buf = (byte *)cmds;
+  int want = n * MESSAGE_SIZE;
+  int got = 0;
+  while (got < want) {
+    int result = read(tracefd, buf + got, want - got);
+    if (result < 0) return -1;
+    if (result == 0) break;
+    got += result;
+  }
+  PROBE1(trace_read, got / MESSAGE_SIZE);
+  return got / MESSAGE_SIZE;
+}
@@ -1,19 +1,124 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "hw.h"
 
+// Exporting a trace as CSV, in the format `twriter -i` imports. The
+// lines are formatted by hand into one buffer that is written out
+// whenever it fills, as printf would spend most of the time parsing
+// its format string.
+
+#define CSV_BUF (1 << 20)
+#define CSV_LINE 64 // longest line: a name and five 11-character ints
+#define CSV_CMDS 4096
+
+static char csv_buf[CSV_BUF];
+static int csv_len = 0;
+
+static int csv_flush(int fd) {
+  char *d = csv_buf;
+  while (csv_len > 0) {
+    int result = write(fd, d, csv_len);
+    if (result < 0) {
+      perror("write");
+      return -1;
+    }
+    d += result;
+    csv_len -= result;
+  }
+  return 0;
+}
+
+// appends `v` in decimal followed by `sep`
+
+static char *csv_int(char *p, int v, char sep) {
+  char digits[12];
+  unsigned u = v < 0 ? -(unsigned)v : (unsigned)v;
+  int n = 0;
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u > 0);
+  if (v < 0) *p++ = '-';
+  while (n > 0) *p++ = digits[--n];
+  *p++ = sep;
+  return p;
+}
+
+// writes the open trace to `fd` as CSV
+
+static int csv_export(int fd) {
+  char *p = csv_buf;
+  p += sprintf(p, "banksim,%d,%d\n", trace_atm_count(), trace_account_count());
+  csv_len = p - csv_buf;
+
+  static Command cmds[CSV_CMDS];
+  int n;
+  while ((n = trace_read_cmds(cmds, CSV_CMDS)) > 0) {
+    for (int i = 0; i < n; i++) {
+      if (csv_len > CSV_BUF - CSV_LINE && csv_flush(fd) < 0) return -1;
+
+      cmd_t c;
+      int id, from, to, amt;
+      cmd_unpack(&cmds[i], &c, &id, &from, &to, &amt);
+      if (c >= CMD_COUNT) {
+        fprintf(stderr, "treader: unknown command %d\n", c);
+        return -1;
+      }
+
+      p = csv_buf + csv_len;
+      int len = strlen(cmd_strings[c]);
+      memcpy(p, cmd_strings[c], len);
+      p += len;
+      *p++ = ',';
+      p = csv_int(p, id, ',');
+      p = csv_int(p, from, ',');
+      p = csv_int(p, to, ',');
+      p = csv_int(p, amt, '\n');
+      csv_len = p - csv_buf;
+    }
+  }
+  if (n < 0) {
+    perror("read");
+    return -1;
+  }
+  return csv_flush(fd);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
+  int csv = argc >= 3 && argc <= 4 && strcmp(argv[1], "-c") == 0;
+  if (argc != 2 && !csv) {
     printf("usage: %s trace_file\n", argv[0]);
+    printf("       %s -c trace_file [file.csv]\n", argv[0]);
     exit(1);
   }
 
-  int result = trace_open(argv[1]);
+  const char *path = argv[csv ? 2 : 1];
+  int result = trace_open(path);
   if (result == -1) {
-    printf("%s: could not open %s\n", argv[0], argv[1]);
+    printf("%s: could not open %s\n", argv[0], path);
     exit(1);
   }
 
+  // treader -c trace_file [file.csv] exports the trace, to standard
+  // output without a file name.
+  if (csv) {
+    int fd = STDOUT_FILENO;
+    if (argc == 4) {
+      fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd < 0) {
+        perror(argv[3]);
+        exit(1);
+      }
+    }
+    result = csv_export(fd);
+    trace_close();
+    if (fd != STDOUT_FILENO) close(fd);
+    return result < 0;
+  }
+
   printf("number of ATMs: %d\n", trace_atm_count());
   printf("number of accounts: %d\n", trace_account_count());
 
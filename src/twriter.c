@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,10 +26,324 @@ int random_at_most(long max) {
   return x / bin_size;
 }
 
+// Writes one random DEPOSIT, WITHDRAW or TRANSFER leg of a batch.
+void random_leg(Command *cmd, int atm, int account_cnt) {
+  int rand_from_acct = random_at_most(account_cnt - 1);
+  int rand_to_acct = random_at_most(account_cnt - 1);
+  int rand_amount = random_at_most(200);
+  switch (random_at_most(2) + DEPOSIT) {
+    case DEPOSIT:
+      MSG_DEPOSIT(cmd, atm, rand_to_acct, rand_amount);
+      break;
+    case WITHDRAW:
+      MSG_WITHDRAW(cmd, atm, rand_from_acct, rand_amount);
+      break;
+    case TRANSFER:
+      MSG_TRANSFER(cmd, atm, rand_from_acct, rand_to_acct, rand_amount);
+      break;
+  }
+}
+
+// Importing a CSV trace. The input is streamed through one fixed
+// buffer and parsed in place, and the commands are collected in
+// another before being written, so no memory is allocated however big
+// the file is. The format is the one `treader -c` exports:
+//
+//   banksim,<atm_cnt>,<account_cnt>
+//   <command>,<id>,<from>,<to>,<amount>
+//   ...
+//
+// where <command> is a name such as DEPOSIT. Empty lines and lines
+// starting with # are skipped. The legs of a BATCH are the lines after
+// it, as in the binary trace. A batch is held back until all its legs
+// are in, and dropped whole if one of them is malformed, so the trace
+// never has a batch whose header and legs disagree.
+
+#define CSV_CHUNK (1 << 20) // bytes read at a time; also the longest line
+#define CSV_MAX_REPORTS 20  // malformed lines reported one by one
+
+// commands written at a time, with room for a whole batch held back
+#define CSV_OUT (2 * (BATCH_MAX_LEGS + 1))
+
+static char csv_in[CSV_CHUNK];
+static Command csv_out[CSV_OUT];
+static int csv_out_len = 0;
+
+typedef struct csv_state {
+  const char *path;
+  long line;
+  long errors;
+  int header; // whether the banksim header line was seen
+  int atm_cnt;
+  int account_cnt;
+  int legs_left; // legs of the last BATCH still to come
+  int batch_at;  // where that BATCH is in csv_out, or -1
+  int batch_bad; // whether one of its legs was malformed
+  long batches_dropped;
+  long commands;
+  int fd;
+} CsvState;
+
+static void csv_error(CsvState *st, const char *msg) {
+  if (st->errors++ < CSV_MAX_REPORTS)
+    fprintf(stderr, "%s:%ld: %s\n", st->path, st->line, msg);
+}
+
+// counts a line read as a leg of the batch being read and, after its
+// last leg, drops the batch if one of them was malformed
+
+static void csv_leg_done(CsvState *st) {
+  if (--st->legs_left > 0) return;
+  if (st->batch_bad) {
+    st->commands -= csv_out_len - st->batch_at;
+    csv_out_len = st->batch_at;
+    st->batches_dropped++;
+  }
+  st->batch_at = -1;
+  st->batch_bad = 0;
+}
+
+// reports a malformed line, which spoils the batch it is a leg of
+
+static int csv_reject(CsvState *st, const char *msg) {
+  csv_error(st, msg);
+  if (st->legs_left > 0) {
+    st->batch_bad = 1;
+    csv_leg_done(st);
+  }
+  return 0;
+}
+
+static int csv_flush(CsvState *st) {
+  byte *d = (byte *)csv_out;
+  int n = csv_out_len * MESSAGE_SIZE;
+  while (n > 0) {
+    int result = write(st->fd, d, n);
+    if (result < 0) {
+      perror("write");
+      return -1;
+    }
+    d += result;
+    n -= result;
+  }
+  csv_out_len = 0;
+  return 0;
+}
+
+// parses a decimal int field ending at a comma or `end`, advancing *p
+// past the comma. It returns 0 if the field is not a number.
+
+static int csv_int(const char **p, const char *end, int *out) {
+  const char *s = *p;
+  int neg = s < end && *s == '-';
+  s += neg;
+  if (s == end || *s < '0' || *s > '9') return 0;
+
+  long v = 0;
+  while (s < end && *s >= '0' && *s <= '9') {
+    v = v * 10 + (*s++ - '0');
+    if (v > 2147483648L) return 0;
+  }
+  if (v > 2147483647L + neg) return 0;
+  if (s < end && *s != ',') return 0;
+
+  *out = neg ? -v : v;
+  *p = s < end ? s + 1 : s;
+  return 1;
+}
+
+// returns the command type named by the field at *p, or -1
+
+static int csv_cmd(const char **p, const char *end) {
+  const char *s = *p;
+  const char *comma = memchr(s, ',', end - s);
+  if (comma == NULL) return -1;
+
+  int len = comma - s;
+  for (int c = CONNECT; c < CMD_COUNT; c++) {
+    if ((int)strlen(cmd_strings[c]) == len &&
+        memcmp(cmd_strings[c], s, len) == 0) {
+      *p = comma + 1;
+      return c;
+    }
+  }
+  return -1;
+}
+
+// parses one line, without its newline, and appends its command
+
+static int csv_line(CsvState *st, const char *s, const char *end) {
+  if (end > s && end[-1] == '\r') end--;
+  if (s == end || *s == '#') return 0;
+
+  int v[5];
+  if (!st->header) {
+    if (end - s < 8 || memcmp(s, "banksim,", 8) != 0) {
+      csv_error(st, "expected banksim,<atm_cnt>,<account_cnt>");
+      return -1;
+    }
+    const char *p = s + 8;
+    if (!csv_int(&p, end, &v[0]) || !csv_int(&p, end, &v[1]) || p != end ||
+        v[0] <= 0 || v[1] <= 0) {
+      csv_error(st, "bad ATM or account count");
+      return -1;
+    }
+    st->header = 1;
+    st->atm_cnt = v[0];
+    st->account_cnt = v[1];
+
+    byte counts[8];
+    for (int i = 0; i < 4; i++) {
+      counts[i] = st->atm_cnt >> (24 - 8 * i);
+      counts[4 + i] = st->account_cnt >> (24 - 8 * i);
+    }
+    if (write(st->fd, counts, 8) != 8) {
+      perror("write");
+      return -1;
+    }
+    return 0;
+  }
+
+  const char *p = s;
+  int c = csv_cmd(&p, end);
+  if (c < 0 || !cmd_is_request(c)) return csv_reject(st, "unknown command");
+  for (int k = 0; k < 4; k++) {
+    if (!csv_int(&p, end, &v[k])) return csv_reject(st, "bad number");
+  }
+  if (p != end) return csv_reject(st, "too many fields");
+  if (v[0] < 0 || v[0] >= st->atm_cnt)
+    return csv_reject(st, "ATM id out of range");
+
+  // the legs of a batch must be money movements
+  if (st->legs_left > 0 && c != DEPOSIT && c != WITHDRAW && c != TRANSFER)
+    return csv_reject(st, "batch leg is not a DEPOSIT, WITHDRAW or TRANSFER");
+
+  Command *cmd = &csv_out[csv_out_len];
+  cmd_pack(cmd, c, v[0], v[1], v[2], v[3]);
+  if (st->legs_left > 0) {
+    csv_out_len++;
+    st->commands++;
+    csv_leg_done(st);
+  } else if (c == BATCH) {
+    // its legs, if any follow, are then read as commands of their own
+    int legs = cmd_tail_frames(cmd);
+    if (legs < 0) return csv_reject(st, "bad batch size");
+    st->batch_at = csv_out_len++;
+    st->legs_left = legs;
+    st->commands++;
+  } else {
+    csv_out_len++;
+    st->commands++;
+  }
+
+  // a batch is only written once all of it is in
+  if (st->batch_at < 0 && csv_out_len > CSV_OUT - (BATCH_MAX_LEGS + 1))
+    return csv_flush(st);
+  return 0;
+}
+
+// converts the CSV trace `in` to the binary trace `out`
+
+static int csv_import(const char *in, const char *out) {
+  int ifd = open(in, O_RDONLY);
+  if (ifd < 0) {
+    perror(in);
+    return 1;
+  }
+  posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  CsvState st;
+  memset(&st, 0, sizeof(st));
+  st.path = in;
+  st.batch_at = -1;
+  st.fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (st.fd < 0) {
+    perror(out);
+    return 1;
+  }
+
+  // Lines are parsed straight out of the buffer; the unfinished one
+  // at its end is moved to the front before the next chunk is read.
+  int have = 0;
+  int status = 0;
+  while (status == 0) {
+    int result = read(ifd, csv_in + have, CSV_CHUNK - have);
+    if (result < 0) {
+      perror(in);
+      status = -1;
+      break;
+    }
+    int eof = result == 0;
+    have += result;
+
+    char *s = csv_in;
+    char *end = csv_in + have;
+    char *nl;
+    while (status == 0 && (nl = memchr(s, '\n', end - s)) != NULL) {
+      st.line++;
+      status = csv_line(&st, s, nl);
+      s = nl + 1;
+    }
+    have = end - s;
+    memmove(csv_in, s, have);
+
+    if (eof) {
+      if (status == 0 && have > 0) {
+        st.line++;
+        status = csv_line(&st, csv_in, csv_in + have);
+      }
+      break;
+    }
+    if (have == CSV_CHUNK) {
+      st.line++;
+      csv_error(&st, "line too long");
+      status = -1;
+    }
+  }
+
+  if (status == 0 && !st.header) csv_error(&st, "no banksim header line");
+  if (status == 0 && st.legs_left > 0) {
+    csv_error(&st, "batch cut short");
+    st.commands -= csv_out_len - st.batch_at;
+    csv_out_len = st.batch_at;
+    st.batches_dropped++;
+  }
+  if (status == 0) status = csv_flush(&st);
+  close(ifd);
+  close(st.fd);
+
+  if (st.errors > CSV_MAX_REPORTS)
+    fprintf(stderr, "%s: %ld more errors\n", in,
+            st.errors - CSV_MAX_REPORTS);
+  printf("%s: %ld commands for %d ATMs and %d accounts written to %s\n", in,
+         st.commands, st.atm_cnt, st.account_cnt, out);
+  if (st.errors > 0)
+    printf("%s: %ld errors, malformed lines skipped\n", in, st.errors);
+  if (st.batches_dropped > 0)
+    printf("%s: %ld batches with malformed legs dropped\n", in,
+           st.batches_dropped);
+  return status != 0 || st.errors > 0;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
+  // twriter -i file.csv [file.trace] imports a CSV trace.
+  if (argc >= 3 && argc <= 4 && strcmp(argv[1], "-i") == 0) {
+    char out[PATH_MAX];
+    if (argc == 4) {
+      snprintf(out, sizeof(out), "%s", argv[3]);
+    } else {
+      int len = strlen(argv[2]);
+      if (len > 4 && strcmp(argv[2] + len - 4, ".csv") == 0) len -= 4;
+      snprintf(out, sizeof(out), "%.*s.trace", len, argv[2]);
+    }
+    return csv_import(argv[2], out);
+  }
+
+  if (argc < 4 || argc > 6) {
     printf("%d\n", argc);
-    printf("usage: %s atm_cnt account_cnt trans_cnt\n", argv[0]);
+    printf("usage: %s atm_cnt account_cnt trans_cnt [batch_legs [atomic]]\n",
+           argv[0]);
+    printf("       %s -i trace.csv [trace_file]\n", argv[0]);
     exit(1);
   }
 
@@ -44,9 +359,25 @@ int main(int argc, char *argv[]) {
   int trans_cnt;
   sscanf(argv[3], "%d", &trans_cnt);
 
+  // With batch_legs the transactions are grouped into BATCH commands
+  // of that many legs, best-effort unless atomic is given (and not 0).
+  int batch_legs = 0;
+  if (argc > 4) sscanf(argv[4], "%d", &batch_legs);
+  if (batch_legs < 0 || batch_legs > BATCH_MAX_LEGS) {
+    printf("batch_legs must be between 0 and %d\n", BATCH_MAX_LEGS);
+    exit(1);
+  }
+  int batch_mode = (argc > 5 && atoi(argv[5])) ? BATCH_ATOMIC
+                                               : BATCH_BEST_EFFORT;
+
   // Create trace file name.
   char file[200];
-  sprintf(file, "%d_%d_%d.trace", atm_cnt, account_cnt, trans_cnt);
+  if (batch_legs > 0) {
+    sprintf(file, "%d_%d_%d_b%d%s.trace", atm_cnt, account_cnt, trans_cnt,
+            batch_legs, batch_mode == BATCH_ATOMIC ? "a" : "");
+  } else {
+    sprintf(file, "%d_%d_%d.trace", atm_cnt, account_cnt, trans_cnt);
+  }
 
   // Delete trace file if it already exists.
   remove(file);
@@ -89,8 +420,23 @@ int main(int argc, char *argv[]) {
     write(tfd, &cmd, MESSAGE_SIZE);
   }
 
-  // Next, we randomly generate transactions.
-  for (int i = 0; i < trans_cnt; i++) {
+  // Next, we randomly generate batches of transactions: a BATCH command
+  // followed by its legs, all carrying the id of the ATM sending it.
+  for (int i = 0; batch_legs > 0 && i < trans_cnt; i += batch_legs) {
+    int rand_atm = random_at_most(atm_cnt - 1);
+    int legs = trans_cnt - i < batch_legs ? trans_cnt - i : batch_legs;
+    MSG_BATCH_HDR(&cmd, rand_atm, legs, batch_mode);
+    cmd_dump("twriter", 0, &cmd);
+    write(tfd, &cmd, MESSAGE_SIZE);
+    for (int j = 0; j < legs; j++) {
+      random_leg(&cmd, rand_atm, account_cnt);
+      cmd_dump("twriter", 0, &cmd);
+      write(tfd, &cmd, MESSAGE_SIZE);
+    }
+  }
+
+  // Or, we randomly generate transactions.
+  for (int i = 0; batch_legs == 0 && i < trans_cnt; i++) {
     int rand_atm = random_at_most(atm_cnt - 1);
     int rand_from_acct = random_at_most(account_cnt - 1);
     int rand_to_acct = random_at_most(account_cnt - 1);
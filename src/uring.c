@@ -0,0 +1,134 @@
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The kernel reads the tail of the submission ring and writes the
+// tail of the completion ring, so these need acquire/release ordering.
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int uring_init(Uring *r, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(*r));
+
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) return -1;
+
+  r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  // Newer kernels map both rings with a single mmap.
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    if (r->cq_ring_sz > r->sq_ring_sz) r->sq_ring_sz = r->cq_ring_sz;
+    r->cq_ring_sz = r->sq_ring_sz;
+  }
+
+  r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) goto fail;
+
+  r->cq_ring = single ? r->sq_ring
+                      : mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, r->fd,
+                             IORING_OFF_CQ_RING);
+  if (r->cq_ring == MAP_FAILED) goto fail;
+
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) goto fail;
+
+  char *sq = r->sq_ring;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+
+  char *cq = r->cq_ring;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return 0;
+
+fail:
+  close(r->fd);
+  r->fd = -1;
+  return -1;
+}
+
+void uring_exit(Uring *r) {
+  if (r->fd < 0) return;
+  munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+  if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_sz);
+  munmap(r->sq_ring, r->sq_ring_sz);
+  close(r->fd);
+  r->fd = -1;
+}
+
+// returns the next free submission entry, or NULL if the ring is full
+
+static struct io_uring_sqe *get_sqe(Uring *r) {
+  unsigned tail = *r->sq_tail + r->to_submit;
+  if (tail - load_acquire(r->sq_head) >= r->sq_entries) return NULL;
+  unsigned idx = tail & r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  r->to_submit++;
+  return sqe;
+}
+
+static int prep_rw(Uring *r, int op, int fd, const void *buf, unsigned n,
+                   unsigned long long data) {
+  struct io_uring_sqe *sqe = get_sqe(r);
+  if (sqe == NULL) return -1;
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = n;
+  sqe->off = -1;  // use (and advance) the file position, as read does
+  sqe->user_data = data;
+  return 0;
+}
+
+int uring_prep_read(Uring *r, int fd, void *buf, unsigned n,
+                    unsigned long long data) {
+  return prep_rw(r, IORING_OP_READ, fd, buf, n, data);
+}
+
+int uring_prep_write(Uring *r, int fd, const void *buf, unsigned n,
+                     unsigned long long data) {
+  return prep_rw(r, IORING_OP_WRITE, fd, buf, n, data);
+}
+
+int uring_submit(Uring *r, unsigned wait_nr) {
+  unsigned n = r->to_submit;
+  store_release(r->sq_tail, *r->sq_tail + n);
+  r->to_submit = 0;
+
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  while (1) {
+    r->enters++;
+    int result = syscall(__NR_io_uring_enter, r->fd, n, wait_nr, flags,
+                         NULL, 0);
+    if (result >= 0) return result;
+    // an interrupted call that consumed nothing is simply retried
+    if (errno != EINTR) return -1;
+  }
+}
+
+struct io_uring_cqe *uring_peek(Uring *r) {
+  unsigned head = *r->cq_head;
+  if (head == load_acquire(r->cq_tail)) return NULL;
+  return &r->cqes[head & r->cq_mask];
+}
+
+void uring_seen(Uring *r) { store_release(r->cq_head, *r->cq_head + 1); }
@@ -0,0 +1,102 @@
+#include "velocity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The counters of one account. `window` is the number of the current
+// window since the clock started; amounts saturate, which is harmless
+// since a limit never exceeds INT_MAX.
+typedef struct velocity {
+  unsigned window;
+  unsigned short count, prev_count;
+  unsigned amount, prev_amount;
+} Velocity;
+
+static Velocity *counters = NULL;
+static VelocityLimits limits;
+
+// The limits scaled to compare against counts weighted by time.
+static unsigned long long count_cap;
+static unsigned long long amount_cap;
+
+int velocity_limits(VelocityLimits *out) {
+  memset(out, 0, sizeof(*out));
+  char *eval = getenv("BANKSIM_LIMITS");
+  if (eval == NULL) return 0;
+
+  VelocityLimits l;
+  if (sscanf(eval, "%d,%d,%d", &l.count, &l.amount, &l.window_ms) != 3 ||
+      l.count < 0 || l.count > VELOCITY_MAX_COUNT || l.amount < 0 ||
+      l.window_ms < 1)
+    return -1;
+  *out = l;
+  return 1;
+}
+
+int velocity_open(const VelocityLimits *l, int account_cnt) {
+  velocity_close();
+  if (l == NULL) return 0;
+
+  counters = calloc(account_cnt, sizeof(Velocity));
+  if (counters == NULL) return -1;
+  limits = *l;
+  count_cap = (unsigned long long)limits.count * limits.window_ms;
+  amount_cap = (unsigned long long)limits.amount * limits.window_ms;
+  return 1;
+}
+
+void velocity_close() {
+  free(counters);
+  counters = NULL;
+}
+
+// The coarse clock is read from the vDSO without a system call and is
+// fine enough for windows of milliseconds.
+static unsigned long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Both limits are compared scaled by the window length, so the
+// overlap weighting needs no division: a previous window that ended
+// `into` ms ago still counts for (window_ms - into) / window_ms.
+
+int velocity_charge(int acc, int amt) {
+  if (counters == NULL) return 1;
+
+  unsigned long long now = now_ms();
+  unsigned window = now / limits.window_ms;
+  unsigned long long left = limits.window_ms - now % limits.window_ms;
+  Velocity *v = &counters[acc];
+
+  if (v->window != window) {
+    int adjacent = v->window + 1 == window;
+    v->prev_count = adjacent ? v->count : 0;
+    v->prev_amount = adjacent ? v->amount : 0;
+    v->count = 0;
+    v->amount = 0;
+    v->window = window;
+  }
+
+  unsigned long long count = v->prev_count * left +
+                             (v->count + 1ULL) * limits.window_ms;
+  unsigned long long amount = v->prev_amount * left +
+                              ((unsigned long long)v->amount + amt) *
+                                  limits.window_ms;
+  if ((limits.count > 0 && count > count_cap) ||
+      (limits.amount > 0 && amount > amount_cap))
+    return 0;
+
+  if (v->count < VELOCITY_MAX_COUNT) v->count++;
+  v->amount = v->amount + amt < v->amount ? ~0u : v->amount + amt;
+  return 1;
+}
+
+void velocity_refund(int acc, int amt) {
+  if (counters == NULL) return;
+  Velocity *v = &counters[acc];
+  if (v->count > 0) v->count--;
+  v->amount = v->amount > (unsigned)amt ? v->amount - amt : 0;
+}
@@ -0,0 +1,160 @@
+#include "wire.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "errors.h"
+#include "io.h"
+
+// The largest record a peer sends in one write: a batch and its legs,
+// or a reply and its frames, all compact.
+#define WIRE_RECORD_MAX ((1 + BATCH_MAX_LEGS) * CMD_WIRE_MAX)
+
+// The protocol state of one descriptor. A version of 0 is the fixed
+// format, the default.
+typedef struct wire {
+  int version;
+  bool records; // SOCK_SEQPACKET: a read takes one whole record
+  bool pending; // bytes are waiting in the buffer
+  byte *buf;
+  int start;
+  int end;
+} Wire;
+
+static Wire *wires = NULL;
+static int wire_cnt = 0;
+static int backlog = 0;
+
+static Wire *wire_of(int fd) {
+  return fd >= 0 && fd < wire_cnt ? &wires[fd] : NULL;
+}
+
+int wire_use(int fd, int version) {
+  if (fd < 0) return -1;
+  if (fd >= wire_cnt) {
+    int cnt = wire_cnt > 0 ? wire_cnt : 16;
+    while (cnt <= fd) cnt *= 2;
+    Wire *w = realloc(wires, sizeof(Wire) * cnt);
+    if (w == NULL) return -1;
+    memset(w + wire_cnt, 0, sizeof(Wire) * (cnt - wire_cnt));
+    wires = w;
+    wire_cnt = cnt;
+  }
+
+  Wire *w = &wires[fd];
+  if (w->buf == NULL && (w->buf = malloc(WIRE_RECORD_MAX)) == NULL) return -1;
+  int type;
+  socklen_t len = sizeof(type);
+  w->records = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+               type == SOCK_SEQPACKET;
+  w->version = version;
+  return 1;
+}
+
+int wire_version(int fd) {
+  Wire *w = wire_of(fd);
+  return w != NULL && w->version != 0 ? w->version : PROTOCOL_V1;
+}
+
+void wire_forget(int fd) {
+  Wire *w = wire_of(fd);
+  if (w == NULL) return;
+  backlog -= w->pending;
+  free(w->buf);
+  memset(w, 0, sizeof(Wire));
+}
+
+int wire_write(int fd, Command *cmds, int n) {
+  if (wire_version(fd) != PROTOCOL_V2)
+    return checked_write(fd, cmds, n * MESSAGE_SIZE);
+
+  // one buffer for every compact write, as big as the biggest so far
+  static byte *out = NULL;
+  static int out_cap = 0;
+  if (n * CMD_WIRE_MAX > out_cap) {
+    byte *o = realloc(out, n * CMD_WIRE_MAX);
+    if (o == NULL) {
+      error_msg(ERR_PIPE_WRITE_ERR, "out of memory encoding messages");
+      return ERR_PIPE_WRITE_ERR;
+    }
+    out = o;
+    out_cap = n * CMD_WIRE_MAX;
+  }
+
+  int len = 0;
+  for (int k = 0; k < n; k++) {
+    int used = cmd_encode(&cmds[k], out + len);
+    if (used == 0) {
+      error_msg(ERR_PIPE_WRITE_ERR, "message type does not fit in an opcode");
+      return ERR_PIPE_WRITE_ERR;
+    }
+    len += used;
+  }
+  return checked_write(fd, out, len);
+}
+
+// reads more of what `fd` has into its buffer: one record if it is a
+// SOCK_SEQPACKET socket, which must then start a message
+static int wire_fill(Wire *w, int fd) {
+  if (w->start > 0) {
+    memmove(w->buf, w->buf + w->start, w->end - w->start);
+    w->end -= w->start;
+    w->start = 0;
+  }
+  if (w->records && w->end > 0) {
+    error_msg(ERR_PIPE_READ_ERR, "message cut short at the end of a record");
+    return ERR_PIPE_READ_ERR;
+  }
+  if (w->end == WIRE_RECORD_MAX) {
+    error_msg(ERR_PIPE_READ_ERR, "malformed message");
+    return ERR_PIPE_READ_ERR;
+  }
+
+  int result;
+  do {
+    result = read(fd, w->buf + w->end, WIRE_RECORD_MAX - w->end);
+    io_syscalls++;
+  } while (result < 0 && errno == EINTR);
+  if (result == 0) return ERR_ATM_CLOSED;
+  if (result < 0) {
+    error_msg(ERR_PIPE_READ_ERR, "could not read message");
+    return ERR_PIPE_READ_ERR;
+  }
+  io_bytes += result;
+  w->end += result;
+  return SUCCESS;
+}
+
+int wire_read(int fd, Command *cmds, int n) {
+  Wire *w = wire_of(fd);
+  if (w == NULL || w->version != PROTOCOL_V2)
+    return checked_read(fd, cmds, n * MESSAGE_SIZE);
+
+  int result = SUCCESS;
+  for (int k = 0; k < n && result == SUCCESS;) {
+    int used = cmd_decode(w->buf + w->start, w->end - w->start, &cmds[k]);
+    if (used > 0) {
+      w->start += used;
+      k++;
+    } else if (used == 0) {
+      result = wire_fill(w, fd);
+    } else {
+      error_msg(ERR_PIPE_READ_ERR, "malformed message");
+      result = ERR_PIPE_READ_ERR;
+    }
+  }
+
+  bool pending = w->start < w->end;
+  backlog += pending - w->pending;
+  w->pending = pending;
+  return result;
+}
+
+int wire_buffered(int fd) {
+  Wire *w = wire_of(fd);
+  return w != NULL && w->pending;
+}
+
+int wire_backlog() { return backlog; }